@@ -1,5 +1,16 @@
 /*
  * g++ appsrc.cpp -g -fpermissive `pkg-config --libs --cflags gstreamer-1.0 gstreamer-app-1.0`
+ *
+ * ./a.out [feeder options] [--benchmark] <input>
+ *
+ * The feeder options are described in appsrc_feeder.h (--help lists them),
+ * e.g. --feed-mode=mmap, --feed-mode=uring, --feed-thread, --buffer-pool or
+ * --adaptive-chunks.
+ * With --feed-mode=h264-au the input is a raw Annex-B H.264 elementary
+ * stream that is framed into access units and fed to h264parse directly;
+ * every other mode expects Matroska and goes through matroskademux.
+ * --benchmark links appsrc straight to a fakesink so that only the feed path
+ * is measured; MB/s, CPU per GB and main loop latency are printed at EOS.
  * */
 
 #include <gst/gst.h>
@@ -7,9 +18,9 @@
 #include <iostream>
 #include <gst/app/gstappsrc.h>
 
-using namespace std;
+#include "appsrc_feeder.h"
 
-#define BUFF_SIZE (6144) /* 6 KB */
+using namespace std;
 
 typedef struct _AppContext
 {
@@ -23,10 +34,8 @@ typedef struct _AppContext
 
     GMainLoop *main_loop;
 
-    guint8 *data_ptr;
-    guint sourceid;
-
-    FILE *file;
+    Feeder feeder;
+    MainLoopMonitor monitor;
 }AppContext;
 
 static void
@@ -54,74 +63,6 @@ demux_newpad (GstElement *demux, GstPad *demux_src_pad, gpointer data)
 }
 
 
-static gboolean read_data (AppContext *app)
-{
-    GstBuffer *buffer;
-    gint size;
-    GstFlowReturn ret;
-    static GstClockTime timestamp = 0;
-
-    size = fread(app->data_ptr, 1, BUFF_SIZE, app->file);
-
-    if(size == 0)
-    {
-        ret = gst_app_src_end_of_stream((GstAppSrc *)app->app_src);
-        g_print("eos returned %d at %d\n", ret, __LINE__);
-        return FALSE;
-    }
-
-    buffer = gst_buffer_new_and_alloc (BUFF_SIZE);
-
-    GST_BUFFER_PTS (buffer) = timestamp;
-    GST_BUFFER_DURATION (buffer) = gst_util_uint64_scale_int (1, GST_SECOND, 4);
-    timestamp += GST_BUFFER_DURATION (buffer);
-
-    GstMapInfo map;
-
-    gst_buffer_map (buffer, &map, GST_MAP_WRITE);
-    memcpy (map.data, app->data_ptr, BUFF_SIZE);
-    gst_buffer_unmap (buffer, &map);
-
-    g_signal_emit_by_name (app->app_src, "push-buffer", buffer, &ret);
-
-    gst_buffer_unref (buffer);
-
-    if (ret != GST_FLOW_OK)
-    {
-        g_print ("push-buffer failed\n");
-        return FALSE;
-    }
-
-    if(size != BUFF_SIZE)
-    {
-        ret = gst_app_src_end_of_stream((GstAppSrc *)app->app_src);
-        g_print("eos returned %d at %d\n", ret, __LINE__);
-        return FALSE;
-    }
-
-    return TRUE;
-}
-
-static void start_feed (GstElement * pipeline, guint size, AppContext *app)
-{
-    if (app->sourceid == 0)
-    {
-        GST_DEBUG ("start feeding");
-        app->sourceid = g_idle_add ((GSourceFunc) read_data, app);
-    }
-}
-
-static void stop_feed (GstElement * pipeline, AppContext *app)
-{
-    if (app->sourceid != 0)
-    {
-        GST_DEBUG ("stop feeding");
-        g_source_remove (app->sourceid);
-        app->sourceid = 0;
-    }
-}
-
-
 static void error_cb (GstBus *bus, GstMessage *message, AppContext *app)
 {
     switch(GST_MESSAGE_TYPE(message))
@@ -157,37 +98,60 @@ int main (int argc, char *argv[])
     AppContext app;
     memset (&app, 0, sizeof(app));
 
-    if (argc != 2)
+    FeederConfig config;
+    gboolean benchmark = FALSE;
+    GError *error = NULL;
+    GOptionEntry entries[] = {
+        { "benchmark", 'b', 0, G_OPTION_ARG_NONE, &benchmark, "Feed into a fakesink and report feed throughput only", NULL },
+        { NULL }
+    };
+
+    GOptionContext *ctx = g_option_context_new ("<input_h264_elementary_stream>");
+    feeder_add_options (ctx, &config);
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    g_option_context_add_group (ctx, gst_init_get_option_group ());
+    if (!g_option_context_parse (ctx, &argc, &argv, &error) || argc != 2 ||
+            !feeder_config_finish (&config))
     {
-        g_print ("Usage : <application> <input_h264_elementary_stream>\n");
+        g_print ("Usage : <application> [feeder options] [--benchmark] <input_h264_elementary_stream>\n");
+        if (error)
+            g_printerr ("%s\n", error->message);
+        g_clear_error (&error);
+        g_option_context_free (ctx);
         return -1;
     }
+    g_option_context_free (ctx);
 
-    app.file = fopen (argv[1], "rb");
-    g_assert (app.file);
-
-    gst_init(NULL, NULL);
+    if (!feeder_open (&app.feeder, argv[1], &config))
+        return -1;
 
     GstBus *bus;
+    gboolean use_demux = app.feeder.mode != FEED_MODE_H264_AU;
 
 
-    app.data_ptr = (guint8 *) g_malloc0(BUFF_SIZE);
-
     app.app_src = gst_element_factory_make ("appsrc", "app_source");
-    app.demux = gst_element_factory_make ("matroskademux", "demux");
-    app.h264parse = gst_element_factory_make ("h264parse", "parser");
-    app.nvv4l2decoder = gst_element_factory_make ("nvv4l2decoder", "decoder");
-    app.nveglglessink = gst_element_factory_make ("nveglglessink", "sink");
+    if (benchmark)
+    {
+        app.nveglglessink = gst_element_factory_make ("fakesink", "sink");
+    }
+    else
+    {
+        if (use_demux)
+            app.demux = gst_element_factory_make ("matroskademux", "demux");
+        app.h264parse = gst_element_factory_make ("h264parse", "parser");
+        app.nvv4l2decoder = gst_element_factory_make ("nvv4l2decoder", "decoder");
+        app.nveglglessink = gst_element_factory_make ("nveglglessink", "sink");
+    }
 
 
     app.pipeline = gst_pipeline_new ("simple appsrc pipeline");
 
-    g_signal_connect (app.app_src, "need-data", G_CALLBACK (start_feed), &app);
-    g_signal_connect (app.app_src, "enough-data", G_CALLBACK (stop_feed), &app);
+    feeder_attach (&app.feeder, app.app_src);
 
     g_object_set (G_OBJECT(app.nveglglessink), "sync", 0, NULL);
 
-    if (!app.pipeline || ! app.app_src || !app.demux  || !app.h264parse || !app.nvv4l2decoder || !app.nveglglessink)
+    if (!app.pipeline || ! app.app_src || !app.nveglglessink ||
+            (!benchmark && ((use_demux && !app.demux) || !app.h264parse || !app.nvv4l2decoder)))
     {
         g_printerr ("Not all elements could be created.\n");
         return -1;
@@ -196,33 +160,62 @@ int main (int argc, char *argv[])
     bus = gst_element_get_bus (app.pipeline);
     gst_bus_add_signal_watch (bus);
     g_signal_connect (G_OBJECT (bus), "message::error", (GCallback)error_cb, &app);
+    g_signal_connect (G_OBJECT (bus), "message::eos", (GCallback)error_cb, &app);
     gst_object_unref (bus);
 
-    gst_bin_add_many (GST_BIN(app.pipeline), app.app_src, app.demux, app.h264parse, app.nvv4l2decoder, app.nveglglessink, NULL);
-
-    g_signal_connect (app.demux, "pad-added", G_CALLBACK (demux_newpad), app.h264parse);
-
-    if (gst_element_link_many (app.app_src, app.demux, NULL) != TRUE)
+    if (benchmark)
     {
-        g_printerr ("Failed to link elements in the pipeline\n");
-        gst_object_unref (app.pipeline);
-        return -1;
+        gst_bin_add_many (GST_BIN(app.pipeline), app.app_src, app.nveglglessink, NULL);
+
+        if (gst_element_link_many (app.app_src, app.nveglglessink, NULL) != TRUE)
+        {
+            g_printerr ("Failed to link elements in the pipeline\n");
+            gst_object_unref (app.pipeline);
+            return -1;
+        }
     }
-
-    if (gst_element_link_many (app.h264parse, app.nvv4l2decoder, app.nveglglessink, NULL) != TRUE)
+    else if (!use_demux)
     {
-        g_printerr ("Failed to link elements in the pipeline\n");
-        gst_object_unref (app.pipeline);
-        return -1;
+        gst_bin_add_many (GST_BIN(app.pipeline), app.app_src, app.h264parse, app.nvv4l2decoder, app.nveglglessink, NULL);
+
+        if (gst_element_link_many (app.app_src, app.h264parse, app.nvv4l2decoder, app.nveglglessink, NULL) != TRUE)
+        {
+            g_printerr ("Failed to link elements in the pipeline\n");
+            gst_object_unref (app.pipeline);
+            return -1;
+        }
+    }
+    else
+    {
+        gst_bin_add_many (GST_BIN(app.pipeline), app.app_src, app.demux, app.h264parse, app.nvv4l2decoder, app.nveglglessink, NULL);
+
+        g_signal_connect (app.demux, "pad-added", G_CALLBACK (demux_newpad), app.h264parse);
+
+        if (gst_element_link_many (app.app_src, app.demux, NULL) != TRUE)
+        {
+            g_printerr ("Failed to link elements in the pipeline\n");
+            gst_object_unref (app.pipeline);
+            return -1;
+        }
+
+        if (gst_element_link_many (app.h264parse, app.nvv4l2decoder, app.nveglglessink, NULL) != TRUE)
+        {
+            g_printerr ("Failed to link elements in the pipeline\n");
+            gst_object_unref (app.pipeline);
+            return -1;
+        }
     }
 
     gst_element_set_state (app.pipeline, GST_STATE_PLAYING);
 
     app.main_loop = g_main_loop_new (NULL, FALSE);
+    main_loop_monitor_start (&app.monitor);
     g_main_loop_run (app.main_loop);
 
-    fclose (app.file);
-    g_free (app.data_ptr);
+    main_loop_monitor_stop (&app.monitor);
+    feeder_print_stats (&app.feeder);
+
+    feeder_close (&app.feeder);
     gst_element_set_state (app.pipeline, GST_STATE_NULL);
     g_main_loop_unref (app.main_loop);
     gst_object_unref (app.pipeline);
@@ -1,11 +1,56 @@
 /*
- * g++ appsrc.cpp -g -fpermissive `pkg-config --libs --cflags gstreamer-1.0 gstreamer-app-1.0`
+ * g++ appsrc_and_bins.cpp -g -fpermissive `pkg-config --libs --cflags gstreamer-1.0 gstreamer-app-1.0`
  *
  *
  * gst-launch-1.0 filesrc location = ~/sample_720p.mp4 ! qtdemux ! h264parse ! nvv4l2decoder ! nvvideoconvert ! "video/x-raw" ! tee name=t  \
  * t. ! queue ! nveglglessink   \
  * t. ! queue ! nvvideoconvert  ! "video/x-raw(memory:NVMM)" ! nvv4l2h264enc ! filesink location= file.h264
  *
+ * ./a.out [feeder options] [--record-mode=transcode|passthrough] [--cpu-only] [--benchmark] <input>
+ *
+ * The appsrc is fed by the feeder in appsrc_feeder.h, see there for the modes.
+ * With --feed-mode=h264-au the input is a raw H.264 elementary stream and no
+ * demuxer is used, otherwise it is Matroska.
+ * Feed throughput and main loop latency are printed when the pipeline stops.
+ *
+ * --record-mode=transcode (default) records the decoded frames through the
+ * encoder as above. --record-mode=passthrough tees the parsed bitstream right
+ * after h264parse and writes it to encoded.h264 as is, only the display
+ * branch decodes:
+ *
+ * ... ! h264parse ! video/x-h264,stream-format=byte-stream ! tee name=t  \
+ * t. ! queue ! nvv4l2decoder ! nvvideoconvert ! "video/x-raw" ! nveglglessink   \
+ * t. ! queue ! filesink location= encoded.h264
+ *
+ * --cpu-only swaps in avdec_h264, videoconvert and x264enc, --benchmark
+ * replaces the display sink with an unsynced fakesink. Frames and bytes per
+ * branch are reported at EOS, so e.g.
+ *
+ * ./a.out --cpu-only --benchmark --record-mode=transcode input.mkv
+ * ./a.out --cpu-only --benchmark --record-mode=passthrough input.mkv
+ *
+ * compares recording bound by x264enc with recording bound by the disk.
+ *
+ * encode_bin is built and linked to a new tee pad by encode_bin_attach() and
+ * torn down again by encode_bin_detach(): an idle probe on the tee pad unlinks
+ * it, EOS drains the encoder and the bin is removed once the EOS reaches the
+ * filesink, without touching the display branch. By default it is attached
+ * at startup and records the whole session to encoded.h264. With
+ * --record-on-demand nothing is encoding until "r" is typed on stdin, "s"
+ * stops the recording, every recording goes to its own encoded_<n>.h264.
+ *
+ * --display-policy and --record-policy decide what the queue at the head of
+ * each tee branch does when it is full, so that one slow consumer does not
+ * hold the tee and starve the other branch:
+ *   block        wait for room (default, the old behaviour)
+ *   leak-oldest  queue leaky=downstream, drop the oldest queued buffer
+ *   leak-newest  queue leaky=upstream, drop the incoming buffer
+ *   keyframe     skip buffers in front of the queue until the next keyframe
+ *                arrives and the queue is below half full again; on decoded
+ *                frames every buffer is a keyframe so it only adds hysteresis
+ * Buffers in, out, leaked and skipped, the highest queue level and the time
+ * the tee spent pushing into each branch are printed at EOS ("i" on stdin
+ * prints them while running with --record-on-demand).
  *
  * */
 
@@ -14,9 +59,48 @@
 #include <iostream>
 #include <gst/app/gstappsrc.h>
 
+#include "appsrc_feeder.h"
+
 using namespace std;
 
-#define BUFF_SIZE (6144) /* 6 KB */
+typedef enum
+{
+    RECORD_MODE_TRANSCODE,
+    RECORD_MODE_PASSTHROUGH,
+}RecordMode;
+
+/* buffers and bytes that reached the sink of a tee branch */
+typedef struct _BranchStats
+{
+    guint64 buffers;
+    guint64 bytes;
+}BranchStats;
+
+typedef enum
+{
+    BRANCH_POLICY_BLOCK,
+    BRANCH_POLICY_LEAK_OLDEST,
+    BRANCH_POLICY_LEAK_NEWEST,
+    BRANCH_POLICY_KEYFRAME,
+}BranchPolicy;
+
+/* overload policy and counters of one tee branch, measured around its queue */
+typedef struct _TeeBranch
+{
+    const gchar *name;
+    BranchPolicy policy;
+    GstElement *queue;
+    /* buffers pushed into and out of the queue */
+    guint64 in;
+    guint64 out;
+    /* buffers skipped in front of the queue while waiting for a keyframe */
+    guint64 skipped;
+    guint max_level;
+    /* time the tee spent in the push into this branch, blocked on a full
+     * queue for the most part */
+    gint64 push_time;
+    gboolean dropping;
+}TeeBranch;
 
 typedef struct _AppContext
 {
@@ -36,13 +120,27 @@ typedef struct _AppContext
     GstElement *filesink;
     GstElement *videoconvert1;
     GstElement *videoconvert2;
+    GstElement *caps_filter3;
+
+    GstElement *main_bin;
+    GstElement *encode_bin;
+    GstPad *record_tee_pad;
+    GstPad *record_ghost_pad;
+    gboolean record_stopping;
+    gboolean record_on_demand;
+    guint record_count;
 
     GMainLoop *main_loop;
 
-    guint8 *data_ptr;
-    guint sourceid;
+    RecordMode record_mode;
+    gboolean cpu_only;
+    BranchStats display_stats;
+    BranchStats record_stats;
+    TeeBranch display_branch;
+    TeeBranch record_branch;
 
-    FILE *file;
+    Feeder feeder;
+    MainLoopMonitor monitor;
 }AppContext;
 
 static void
@@ -71,73 +169,373 @@ demux_newpad (GstElement *demux, GstPad *demux_src_pad, gpointer data)
 }
 
 
-static gboolean read_data (AppContext *app)
+static GstPadProbeReturn count_buffer_probe (GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+    BranchStats *stats = (BranchStats *) data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+
+    stats->buffers++;
+    stats->bytes += gst_buffer_get_size (buffer);
+
+    return GST_PAD_PROBE_OK;
+}
+
+static void add_count_probe (GstElement *sink, BranchStats *stats)
+{
+    GstPad *pad = gst_element_get_static_pad (sink, "sink");
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, count_buffer_probe, stats, NULL);
+    gst_object_unref (pad);
+}
+
+static const gchar *branch_policy_names[] = { "block", "leak-oldest", "leak-newest", "keyframe" };
+
+static gboolean branch_policy_from_string (const gchar *str, BranchPolicy *policy)
 {
-    GstBuffer *buffer;
-    gint size;
-    GstFlowReturn ret;
-    static GstClockTime timestamp = 0;
+    guint i;
 
-    size = fread(app->data_ptr, 1, BUFF_SIZE, app->file);
+    if (!str)
+        return TRUE;
 
-    if(size == 0)
+    for (i = 0; i < G_N_ELEMENTS (branch_policy_names); i++)
     {
-        ret = gst_app_src_end_of_stream((GstAppSrc *)app->app_src);
-        g_print("eos returned %d at %d\n", ret, __LINE__);
-        return FALSE;
+        if (!g_strcmp0 (str, branch_policy_names[i]))
+        {
+            *policy = (BranchPolicy) i;
+            return TRUE;
+        }
     }
 
-    buffer = gst_buffer_new_and_alloc (BUFF_SIZE);
+    g_printerr ("unknown branch policy %s\n", str);
+    return FALSE;
+}
+
+static GstFlowReturn tee_branch_chain (GstPad *pad, GstObject *parent, GstBuffer *buffer)
+{
+    TeeBranch *branch = (TeeBranch *) GST_PAD_CHAINFUNCDATA (pad);
+    guint level, level_bytes, max_buffers, max_bytes;
+    guint64 level_time, max_time;
 
-    GST_BUFFER_PTS (buffer) = timestamp;
-    GST_BUFFER_DURATION (buffer) = gst_util_uint64_scale_int (1, GST_SECOND, 4);
-    timestamp += GST_BUFFER_DURATION (buffer);
+    g_object_get (G_OBJECT (branch->queue), "current-level-buffers", &level, "current-level-bytes", &level_bytes,
+            "current-level-time", &level_time, "max-size-buffers", &max_buffers, "max-size-bytes", &max_bytes,
+            "max-size-time", &max_time, NULL);
+    branch->max_level = MAX (branch->max_level, level);
 
-    GstMapInfo map;
+    if (branch->policy == BRANCH_POLICY_KEYFRAME &&
+            ((max_buffers && level >= max_buffers) || (max_bytes && level_bytes >= max_bytes) ||
+             (max_time && level_time >= max_time)))
+        branch->dropping = TRUE;
 
-    gst_buffer_map (buffer, &map, GST_MAP_WRITE);
-    memcpy (map.data, app->data_ptr, BUFF_SIZE);
-    gst_buffer_unmap (buffer, &map);
+    if (branch->dropping)
+    {
+        gboolean half_full = (max_buffers && level * 2 >= max_buffers) || (max_bytes && level_bytes * 2 >= max_bytes) ||
+            (max_time && level_time * 2 >= max_time);
+
+        if (half_full || GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+        {
+            branch->skipped++;
+            gst_buffer_unref (buffer);
+            return GST_FLOW_OK;
+        }
+        branch->dropping = FALSE;
+    }
 
-    g_signal_emit_by_name (app->app_src, "push-buffer", buffer, &ret);
+    branch->in++;
+    gint64 start = g_get_monotonic_time ();
+    GstFlowReturn ret = gst_proxy_pad_chain_default (pad, parent, buffer);
+    branch->push_time += g_get_monotonic_time () - start;
 
-    gst_buffer_unref (buffer);
+    return ret;
+}
 
-    if (ret != GST_FLOW_OK)
+/* Buffer lists get the same policy and counters, one buffer at a time. */
+static GstFlowReturn tee_branch_chain_list (GstPad *pad, GstObject *parent, GstBufferList *list)
+{
+    GstFlowReturn ret = GST_FLOW_OK;
+    guint i, n = gst_buffer_list_length (list);
+
+    for (i = 0; i < n && ret == GST_FLOW_OK; i++)
+        ret = tee_branch_chain (pad, parent, gst_buffer_ref (gst_buffer_list_get (list, i)));
+    gst_buffer_list_unref (list);
+
+    return ret;
+}
+
+static GstPadProbeReturn tee_branch_out_probe (GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+    TeeBranch *branch = (TeeBranch *) data;
+
+    branch->out++;
+
+    return GST_PAD_PROBE_OK;
+}
+
+/* Applies the policy to the queue behind the branch's ghost sink pad and
+ * hooks up the counters, which start from zero for every new recording. */
+static void tee_branch_setup (TeeBranch *branch, GstElement *queue, GstPad *ghost_pad)
+{
+    branch->queue = queue;
+    branch->in = branch->out = branch->skipped = 0;
+    branch->max_level = 0;
+    branch->push_time = 0;
+    branch->dropping = FALSE;
+    if (branch->policy == BRANCH_POLICY_LEAK_OLDEST)
+        g_object_set (G_OBJECT (queue), "leaky", 2, NULL);
+    else if (branch->policy == BRANCH_POLICY_LEAK_NEWEST)
+        g_object_set (G_OBJECT (queue), "leaky", 1, NULL);
+
+    gst_pad_set_chain_function_full (ghost_pad, tee_branch_chain, branch, NULL);
+    gst_pad_set_chain_list_function_full (ghost_pad, tee_branch_chain_list, branch, NULL);
+
+    GstPad *srcpad = gst_element_get_static_pad (queue, "src");
+    gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_BUFFER, tee_branch_out_probe, branch, NULL);
+    gst_object_unref (srcpad);
+}
+
+static void tee_branch_print (TeeBranch *branch)
+{
+    guint level = 0;
+
+    if (branch->queue)
+        g_object_get (G_OBJECT (branch->queue), "current-level-buffers", &level, NULL);
+
+    g_print ("%s branch (%s): %" G_GUINT64_FORMAT " in, %" G_GUINT64_FORMAT " out, %" G_GUINT64_FORMAT
+            " leaked, %" G_GUINT64_FORMAT " skipped, queue level %u max %u, %.1f ms in push\n",
+            branch->name, branch_policy_names[branch->policy], branch->in, branch->out,
+            branch->in - branch->out - level, branch->skipped, level, branch->max_level, branch->push_time / 1000.0);
+}
+
+static void print_branch_stats (AppContext *app, gdouble elapsed)
+{
+    g_print ("record mode %s: %" G_GUINT64_FORMAT " frames displayed (%.1f fps), %" G_GUINT64_FORMAT
+            " buffers recorded, %.1f MB written (%.1f MB/s) in %.2f s\n",
+            app->record_mode == RECORD_MODE_PASSTHROUGH ? "passthrough" : "transcode",
+            app->display_stats.buffers, elapsed > 0 ? app->display_stats.buffers / elapsed : 0.0,
+            app->record_stats.buffers, app->record_stats.bytes / 1e6,
+            elapsed > 0 ? app->record_stats.bytes / 1e6 / elapsed : 0.0, elapsed);
+
+    tee_branch_print (&app->display_branch);
+    tee_branch_print (&app->record_branch);
+    g_print ("tee spent most time pushing into the %s branch\n",
+            app->display_branch.push_time >= app->record_branch.push_time ? "display" : "record");
+}
+
+/* queue ! [nvvideoconvert ! NVMM caps ! nvv4l2h264enc ! byte-stream caps] ! filesink */
+static GstElement *encode_bin_new (AppContext *app)
+{
+    gboolean passthrough = app->record_mode == RECORD_MODE_PASSTHROUGH;
+    GstElement *elements[6];
+    guint n = 0, i;
+
+    gchar *name = g_strdup_printf ("encode_bin_%u", app->record_count);
+    GstElement *bin = gst_bin_new (name);
+    g_free (name);
+
+    elements[n++] = app->queue2 = gst_element_factory_make ("queue", "queue2");
+    if (!passthrough)
     {
-        g_print ("push-buffer failed\n");
-        return FALSE;
+        elements[n++] = app->videoconvert2 = gst_element_factory_make (app->cpu_only ? "videoconvert" : "nvvideoconvert", "videoconvert2");
+        elements[n++] = app->caps_filter2 = gst_element_factory_make ("capsfilter", "caps_filter2");
+        elements[n++] = app->encoder = gst_element_factory_make (app->cpu_only ? "x264enc" : "nvv4l2h264enc", "encoder");
+        elements[n++] = gst_element_factory_make ("capsfilter", "caps_filter3");
+    }
+    elements[n++] = app->filesink = gst_element_factory_make ("filesink", "fsink");
+
+    for (i = 0; i < n; i++)
+    {
+        if (!elements[i])
+        {
+            g_printerr ("Not all elements could be created.\n");
+            for (i = 0; i < n; i++)
+                if (elements[i])
+                    gst_object_unref (gst_object_ref_sink (elements[i]));
+            gst_object_unref (bin);
+            return NULL;
+        }
+        gst_bin_add (GST_BIN(bin), elements[i]);
+    }
+
+    for (i = 0; i + 1 < n; i++)
+    {
+        if (!gst_element_link (elements[i], elements[i + 1]))
+        {
+            g_printerr ("Failed to link elements in the pipeline 3\n");
+            gst_object_unref (bin);
+            return NULL;
+        }
     }
 
-    if(size != BUFF_SIZE)
+    if (!passthrough)
     {
-        ret = gst_app_src_end_of_stream((GstAppSrc *)app->app_src);
-        g_print("eos returned %d at %d\n", ret, __LINE__);
+        GstCaps *caps2 = gst_caps_new_simple ("video/x-raw", NULL, NULL);
+        if (!app->cpu_only)
+        {
+            GstCapsFeatures *feature = gst_caps_features_new ("memory:NVMM", NULL);
+            gst_caps_set_features (caps2, 0, feature);
+        }
+        g_object_set (G_OBJECT (app->caps_filter2), "caps", caps2, NULL);
+        gst_caps_unref (caps2);
+
+        GstCaps *caps3 = gst_caps_new_simple ("video/x-h264", "stream-format", G_TYPE_STRING, "byte-stream", NULL);
+        g_object_set (G_OBJECT (elements[n - 2]), "caps", caps3, NULL);
+        gst_caps_unref (caps3);
+    }
+
+    if (app->record_on_demand)
+    {
+        gchar *location = g_strdup_printf ("encoded_%u.h264", app->record_count);
+        g_object_set (G_OBJECT(app->filesink), "location", location, NULL);
+        g_free (location);
+    }
+    else
+        g_object_set (G_OBJECT(app->filesink), "location", "encoded.h264", NULL);
+
+    GstPad *q2_sink_pad = gst_element_get_static_pad (app->queue2, "sink");
+    GstPad *q2_sink_ghost_pad = gst_ghost_pad_new ("sink", q2_sink_pad);
+    gst_element_add_pad (GST_ELEMENT(bin), q2_sink_ghost_pad);
+    gst_object_unref (q2_sink_pad);
+
+    /* a recording that starts mid stream skips everything up to the next
+     * IDR, h264parse repeats SPS/PPS in front of it */
+    tee_branch_setup (&app->record_branch, app->queue2, q2_sink_ghost_pad);
+    app->record_branch.dropping = passthrough;
+
+    add_count_probe (app->filesink, &app->record_stats);
+
+    return bin;
+}
+
+/* Requests a tee pad and starts recording into a fresh encode_bin. */
+static gboolean encode_bin_attach (AppContext *app)
+{
+    if (app->encode_bin)
+    {
+        g_print ("already recording\n");
         return FALSE;
     }
 
+    GstElement *bin = encode_bin_new (app);
+    if (!bin)
+        return FALSE;
+
+    app->record_tee_pad = gst_element_get_request_pad (app->tee, "src_%u");
+    gchar *name = gst_pad_get_name (app->record_tee_pad);
+    app->record_ghost_pad = gst_ghost_pad_new (name, app->record_tee_pad);
+    g_free (name);
+    gst_element_add_pad (app->main_bin, app->record_ghost_pad);
+
+    /* bring the bin up before linking, the tee would fail on a flushing pad */
+    gst_bin_add (GST_BIN(app->pipeline), bin);
+    gst_element_sync_state_with_parent (bin);
+
+    GstPad *sinkpad = gst_element_get_static_pad (bin, "sink");
+    gst_pad_link (app->record_ghost_pad, sinkpad);
+    gst_object_unref (sinkpad);
+
+    app->encode_bin = bin;
+    g_print ("recording %u started\n", app->record_count);
+
     return TRUE;
 }
 
-static void start_feed (GstElement * pipeline, guint size, AppContext *app)
+static gboolean encode_bin_teardown (gpointer data)
+{
+    AppContext *app = (AppContext *) data;
+
+    gst_element_set_state (app->encode_bin, GST_STATE_NULL);
+    gst_bin_remove (GST_BIN(app->pipeline), app->encode_bin);
+
+    gst_element_remove_pad (app->main_bin, app->record_ghost_pad);
+    gst_element_release_request_pad (app->tee, app->record_tee_pad);
+    gst_object_unref (app->record_tee_pad);
+
+    app->encode_bin = NULL;
+    app->record_tee_pad = NULL;
+    app->record_ghost_pad = NULL;
+    app->queue2 = app->videoconvert2 = app->caps_filter2 = app->encoder = app->filesink = NULL;
+    app->record_branch.queue = NULL;
+    app->record_stopping = FALSE;
+    g_print ("recording %u stopped\n", app->record_count);
+    app->record_count++;
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Everything queued before the EOS is on disk now, keep the EOS itself away
+ * from the bus and remove the bin from the main loop. */
+static GstPadProbeReturn encode_bin_eos_probe (GstPad *pad, GstPadProbeInfo *info, gpointer data)
 {
-    if (app->sourceid == 0)
+    if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) != GST_EVENT_EOS)
+        return GST_PAD_PROBE_OK;
+
+    g_idle_add (encode_bin_teardown, data);
+
+    return GST_PAD_PROBE_DROP;
+}
+
+/* Runs while the tee pad is idle, so the display branch only waits for the
+ * unlink, not for the encoder to drain. */
+static GstPadProbeReturn encode_bin_unlink_probe (GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+    AppContext *app = (AppContext *) data;
+    GstPad *sinkpad = gst_element_get_static_pad (app->encode_bin, "sink");
+    GstPad *fsink_pad = gst_element_get_static_pad (app->filesink, "sink");
+
+    gst_pad_add_probe (fsink_pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, encode_bin_eos_probe, app, NULL);
+    gst_pad_unlink (app->record_ghost_pad, sinkpad);
+    gst_pad_send_event (sinkpad, gst_event_new_eos ());
+
+    gst_object_unref (fsink_pad);
+    gst_object_unref (sinkpad);
+
+    return GST_PAD_PROBE_REMOVE;
+}
+
+/* Stops the current recording, the bin goes away once it is drained. */
+static gboolean encode_bin_detach (AppContext *app)
+{
+    if (!app->encode_bin || app->record_stopping)
     {
-        GST_DEBUG ("start feeding");
-        app->sourceid = g_idle_add ((GSourceFunc) read_data, app);
+        g_print ("not recording\n");
+        return FALSE;
     }
+
+    app->record_stopping = TRUE;
+    gst_pad_add_probe (app->record_tee_pad, GST_PAD_PROBE_TYPE_IDLE, encode_bin_unlink_probe, app, NULL);
+
+    return TRUE;
 }
 
-static void stop_feed (GstElement * pipeline, AppContext *app)
+static gboolean stdin_cb (GIOChannel *source, GIOCondition cond, gpointer data)
 {
-    if (app->sourceid != 0)
+    AppContext *app = (AppContext *) data;
+    gchar *line = NULL;
+
+    if (g_io_channel_read_line (source, &line, NULL, NULL, NULL) != G_IO_STATUS_NORMAL)
+        return G_SOURCE_REMOVE;
+
+    switch (line[0])
     {
-        GST_DEBUG ("stop feeding");
-        g_source_remove (app->sourceid);
-        app->sourceid = 0;
+        case 'r':
+            encode_bin_attach (app);
+            break;
+        case 's':
+            encode_bin_detach (app);
+            break;
+        case 'i':
+            tee_branch_print (&app->display_branch);
+            tee_branch_print (&app->record_branch);
+            break;
+        case 'q':
+            g_main_loop_quit (app->main_loop);
+            break;
+        default:
+            g_print ("r: start recording, s: stop recording, i: branch stats, q: quit\n");
+            break;
     }
-}
+    g_free (line);
 
+    return G_SOURCE_CONTINUE;
+}
 
 static void error_cb (GstBus *bus, GstMessage *message, AppContext *app)
 {
@@ -174,48 +572,98 @@ int main (int argc, char *argv[])
     AppContext app;
     memset (&app, 0, sizeof(app));
 
-    if (argc != 2)
+    FeederConfig config;
+    gchar *record_mode = NULL;
+    gchar *display_policy = NULL;
+    gchar *record_policy = NULL;
+    gboolean cpu_only = FALSE;
+    gboolean benchmark = FALSE;
+    gboolean options_ok = TRUE;
+    GError *error = NULL;
+    GOptionEntry entries[] = {
+        { "record-mode", 'r', 0, G_OPTION_ARG_STRING, &record_mode,
+            "How encoded.h264 is recorded: transcode (default) or passthrough", "MODE" },
+        { "cpu-only", 'c', 0, G_OPTION_ARG_NONE, &cpu_only, "Decode and encode with avdec_h264 and x264enc", NULL },
+        { "benchmark", 'b', 0, G_OPTION_ARG_NONE, &benchmark, "Display into a fakesink and report per branch throughput", NULL },
+        { "record-on-demand", 'd', 0, G_OPTION_ARG_NONE, &app.record_on_demand,
+            "Start without recording, r / s on stdin start and stop a recording", NULL },
+        { "display-policy", 0, 0, G_OPTION_ARG_STRING, &display_policy,
+            "Display branch overload policy: block (default), leak-oldest, leak-newest or keyframe", "POLICY" },
+        { "record-policy", 0, 0, G_OPTION_ARG_STRING, &record_policy,
+            "Record branch overload policy: block (default), leak-oldest, leak-newest or keyframe", "POLICY" },
+        { NULL }
+    };
+
+    GOptionContext *ctx = g_option_context_new ("<input_h264_elementary_stream>");
+    feeder_add_options (ctx, &config);
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    g_option_context_add_group (ctx, gst_init_get_option_group ());
+    if (g_option_context_parse (ctx, &argc, &argv, &error) && record_mode)
+    {
+        if (!g_strcmp0 (record_mode, "passthrough"))
+            app.record_mode = RECORD_MODE_PASSTHROUGH;
+        else if (g_strcmp0 (record_mode, "transcode"))
+        {
+            g_printerr ("unknown record mode %s\n", record_mode);
+            options_ok = FALSE;
+        }
+    }
+    g_free (record_mode);
+    app.display_branch.name = "display";
+    app.record_branch.name = "record";
+    if (!branch_policy_from_string (display_policy, &app.display_branch.policy) ||
+            !branch_policy_from_string (record_policy, &app.record_branch.policy))
+        options_ok = FALSE;
+    g_free (display_policy);
+    g_free (record_policy);
+    if (error || argc != 2 || !options_ok || !feeder_config_finish (&config))
     {
-        g_print ("Usage : <application> <input_h264_elementary_stream>\n");
+        g_print ("Usage : <application> [feeder options] [--record-mode=transcode|passthrough] [--cpu-only] [--benchmark] [--record-on-demand] [--display-policy=POLICY] [--record-policy=POLICY] <input_h264_elementary_stream>\n");
+        if (error)
+            g_printerr ("%s\n", error->message);
+        g_clear_error (&error);
+        g_option_context_free (ctx);
         return -1;
     }
+    g_option_context_free (ctx);
 
-    app.file = fopen (argv[1], "rb");
-    g_assert (app.file);
-
-    gst_init(NULL, NULL);
+    if (!feeder_open (&app.feeder, argv[1], &config))
+        return -1;
 
     GstBus *bus;
+    gboolean use_demux = app.feeder.mode != FEED_MODE_H264_AU;
+    gboolean passthrough = app.record_mode == RECORD_MODE_PASSTHROUGH;
+    app.cpu_only = cpu_only;
+    const gchar *convert_factory = cpu_only ? "videoconvert" : "nvvideoconvert";
 
 
-    app.data_ptr = (guint8 *) g_malloc0(BUFF_SIZE);
-
     app.app_src = gst_element_factory_make ("appsrc", "app_source");
-    app.demux = gst_element_factory_make ("matroskademux", "demux");
+    if (use_demux)
+        app.demux = gst_element_factory_make ("matroskademux", "demux");
     app.h264parse = gst_element_factory_make ("h264parse", "parser");
-    app.nvv4l2decoder = gst_element_factory_make ("nvv4l2decoder", "decoder");
-    app.nveglglessink = gst_element_factory_make ("nveglglessink", "vsink");
-    app.videoconvert1 = gst_element_factory_make ("nvvideoconvert", "videoconvert1");
-    app.videoconvert2 = gst_element_factory_make ("nvvideoconvert", "videoconvert2");
+    app.nvv4l2decoder = gst_element_factory_make (cpu_only ? "avdec_h264" : "nvv4l2decoder", "decoder");
+    if (benchmark)
+        app.nveglglessink = gst_element_factory_make ("fakesink", "vsink");
+    else
+        app.nveglglessink = gst_element_factory_make (cpu_only ? "autovideosink" : "nveglglessink", "vsink");
+    app.videoconvert1 = gst_element_factory_make (convert_factory, "videoconvert1");
     app.queue1 = gst_element_factory_make ("queue", "queue1");
-    app.queue2 = gst_element_factory_make ("queue", "queue2");
-    app.filesink = gst_element_factory_make ("filesink", "fsink");
-    app.encoder = gst_element_factory_make ("nvv4l2h264enc", "encoder");
     app.caps_filter1 = gst_element_factory_make ("capsfilter", "caps_filter1");
-    app.caps_filter2 = gst_element_factory_make ("capsfilter", "caps_filter2");
+    /* only the passthrough main bin has a capsfilter after the parser */
+    if (passthrough)
+        app.caps_filter3 = gst_element_factory_make ("capsfilter", "caps_filter3");
     app.tee = gst_element_factory_make ("tee", "tee");
 
 
     app.pipeline = gst_pipeline_new ("simple appsrc pipeline");
 
-    g_signal_connect (app.app_src, "need-data", G_CALLBACK (start_feed), &app);
-    g_signal_connect (app.app_src, "enough-data", G_CALLBACK (stop_feed), &app);
+    feeder_attach (&app.feeder, app.app_src);
 
-    g_object_set (G_OBJECT(app.nveglglessink), "sync", 0, NULL);
-    g_object_set (G_OBJECT(app.filesink), "location", "encoded.h264", NULL);
+    if (g_object_class_find_property (G_OBJECT_GET_CLASS (app.nveglglessink), "sync"))
+        g_object_set (G_OBJECT(app.nveglglessink), "sync", 0, NULL);
 
-    if (!app.pipeline || ! app.app_src || !app.demux  || !app.h264parse || !app.nvv4l2decoder || !app.nveglglessink ||
-            !app.queue1 || !app.queue2 || !app.videoconvert1 || !app.videoconvert2 || !app.caps_filter1 || !app.caps_filter2 || !app.encoder || !app.tee)
+    if (!app.pipeline || ! app.app_src || (use_demux && !app.demux)  || !app.h264parse || !app.nvv4l2decoder || !app.nveglglessink ||
+            !app.queue1 || !app.videoconvert1 || !app.caps_filter1 || (passthrough && !app.caps_filter3) || !app.tee)
     {
         g_printerr ("Not all elements could be created.\n");
         return -1;
@@ -224,6 +672,7 @@ int main (int argc, char *argv[])
     bus = gst_element_get_bus (app.pipeline);
     gst_bus_add_signal_watch (bus);
     g_signal_connect (G_OBJECT (bus), "message::error", (GCallback)error_cb, &app);
+    g_signal_connect (G_OBJECT (bus), "message::eos", (GCallback)error_cb, &app);
     gst_object_unref (bus);
 
 #if 0
@@ -248,34 +697,60 @@ int main (int argc, char *argv[])
 #else
     GstCaps *caps1 = gst_caps_new_simple ("video/x-raw", NULL, NULL);
     g_object_set (G_OBJECT (app.caps_filter1), "caps", caps1, NULL);
+    gst_caps_unref (caps1);
 
-    GstCaps *caps2 = gst_caps_new_simple ("video/x-raw", NULL, NULL);
-    GstCapsFeatures *feature = gst_caps_features_new ("memory:NVMM", NULL);
-    gst_caps_set_features (caps2, 0, feature);
-    g_object_set (G_OBJECT (app.caps_filter2), "caps", caps2, NULL);
+    if (passthrough)
+    {
+        /* the recorded file is raw Annex-B whichever branch produces it */
+        GstCaps *caps3 = gst_caps_new_simple ("video/x-h264", "stream-format", G_TYPE_STRING, "byte-stream", NULL);
+        g_object_set (G_OBJECT (app.caps_filter3), "caps", caps3, NULL);
+        gst_caps_unref (caps3);
+        /* SPS/PPS in front of every IDR, recordings can start at any of them */
+        g_object_set (G_OBJECT (app.h264parse), "config-interval", -1, NULL);
+    }
 
     GstElement *main_bin    = gst_bin_new ("main_bin");
     GstElement *display_bin = gst_bin_new ("display_bin");
-    GstElement *encode_bin  = gst_bin_new ("encode_bin");
-
-    gst_bin_add_many (GST_BIN(main_bin), app.app_src, app.demux, app.h264parse, app.nvv4l2decoder, app.videoconvert1, app.caps_filter1, app.tee, NULL);
-    if (gst_element_link_many (app.app_src, app.demux, NULL) != TRUE)
+    app.main_bin = main_bin;
+
+    /* in passthrough mode the tee splits the parsed bitstream and decoding
+     * moves into the display branch */
+    if (passthrough)
+        gst_bin_add_many (GST_BIN(main_bin), app.app_src, app.h264parse, app.caps_filter3, app.tee, NULL);
+    else
+        gst_bin_add_many (GST_BIN(main_bin), app.app_src, app.h264parse, app.nvv4l2decoder, app.videoconvert1, app.caps_filter1, app.tee, NULL);
+    if (use_demux)
+    {
+        gst_bin_add (GST_BIN(main_bin), app.demux);
+        if (gst_element_link_many (app.app_src, app.demux, NULL) != TRUE)
+        {
+            g_printerr ("Failed to link elements in the pipeline\n");
+            gst_object_unref (app.pipeline);
+            return -1;
+        }
+        g_signal_connect (app.demux, "pad-added", G_CALLBACK (demux_newpad), app.h264parse);
+    }
+    else if (gst_element_link_many (app.app_src, app.h264parse, NULL) != TRUE)
     {
         g_printerr ("Failed to link elements in the pipeline\n");
         gst_object_unref (app.pipeline);
         return -1;
     }
-    if (gst_element_link_many (app.h264parse, app.nvv4l2decoder, app.videoconvert1, app.caps_filter1, app.tee, NULL) != TRUE)
+    if ((passthrough && gst_element_link_many (app.h264parse, app.caps_filter3, app.tee, NULL) != TRUE) ||
+            (!passthrough && gst_element_link_many (app.h264parse, app.nvv4l2decoder, app.videoconvert1, app.caps_filter1, app.tee, NULL) != TRUE))
     {
         g_printerr ("Failed to link elements in the pipeline 1\n");
         gst_object_unref (app.pipeline);
         return -1;
     }
     gst_bin_add (GST_BIN(app.pipeline), main_bin);
-    g_signal_connect (app.demux, "pad-added", G_CALLBACK (demux_newpad), app.h264parse);
 
-    gst_bin_add_many (GST_BIN(display_bin), app.queue1, app.nveglglessink, NULL);
-    if (gst_element_link_many (app.queue1, app.nveglglessink, NULL) != TRUE)
+    if (passthrough)
+        gst_bin_add_many (GST_BIN(display_bin), app.queue1, app.nvv4l2decoder, app.videoconvert1, app.caps_filter1, app.nveglglessink, NULL);
+    else
+        gst_bin_add_many (GST_BIN(display_bin), app.queue1, app.nveglglessink, NULL);
+    if ((passthrough && gst_element_link_many (app.queue1, app.nvv4l2decoder, app.videoconvert1, app.caps_filter1, app.nveglglessink, NULL) != TRUE) ||
+            (!passthrough && gst_element_link_many (app.queue1, app.nveglglessink, NULL) != TRUE))
     {
         g_printerr ("Failed to link elements in the pipeline 2\n");
         gst_object_unref (app.pipeline);
@@ -283,40 +758,32 @@ int main (int argc, char *argv[])
     }
     gst_bin_add (GST_BIN(app.pipeline), display_bin);
 
-    gst_bin_add_many (GST_BIN(encode_bin), app.queue2, app.videoconvert2, app.caps_filter2, app.encoder, app.filesink, NULL);
-    if (gst_element_link_many (app.queue2, app.videoconvert2, app.caps_filter2, app.encoder, app.filesink, NULL) != TRUE)
-    {
-        g_printerr ("Failed to link elements in the pipeline 3\n");
-        gst_object_unref (app.pipeline);
-        return -1;
-    }
-    gst_bin_add (GST_BIN(app.pipeline), encode_bin);
+    add_count_probe (app.nveglglessink, &app.display_stats);
 
 
     GstPad *tee_pad1 = gst_element_get_request_pad (app.tee, "src_%u");
     GstPad *tee_pad1_ghost = gst_ghost_pad_new ("src1", tee_pad1);
     gst_element_add_pad (GST_ELEMENT(main_bin), tee_pad1_ghost);
 
-    GstPad *tee_pad2 = gst_element_get_request_pad (app.tee, "src_%u");
-    GstPad *tee_pad2_ghost = gst_ghost_pad_new ("src2", tee_pad2);
-    gst_element_add_pad (GST_ELEMENT(main_bin), tee_pad2_ghost);
-
     GstPad *q1_sink_pad = gst_element_get_static_pad (app.queue1, "sink");
     GstPad *q1_sink_ghost_pad = gst_ghost_pad_new ("sink", q1_sink_pad);
     gst_element_add_pad (GST_ELEMENT(display_bin), q1_sink_ghost_pad);
-
-    GstPad *q2_sink_pad = gst_element_get_static_pad (app.queue2, "sink");
-    GstPad *q2_sink_ghost_pad = gst_ghost_pad_new ("sink", q2_sink_pad);
-    gst_element_add_pad (GST_ELEMENT(encode_bin), q2_sink_ghost_pad);
+    tee_branch_setup (&app.display_branch, app.queue1, q1_sink_ghost_pad);
 
 #if 1
     gst_pad_link (tee_pad1_ghost, q1_sink_ghost_pad);
-    gst_pad_link (tee_pad2_ghost, q2_sink_ghost_pad);
 #else
     gst_pad_link (tee_pad1, q1_sink_pad);
-    gst_pad_link (tee_pad2, q2_sink_pad);
 #endif
 
+    /* the display branch alone keeps the tee flowing while nobody records */
+    g_object_set (G_OBJECT (app.tee), "allow-not-linked", TRUE, NULL);
+    if (!app.record_on_demand && !encode_bin_attach (&app))
+    {
+        gst_object_unref (app.pipeline);
+        return -1;
+    }
+
 
 #endif
 
@@ -324,10 +791,22 @@ int main (int argc, char *argv[])
 
     GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(app.pipeline), GST_DEBUG_GRAPH_SHOW_ALL, "appsrc_pipeline");
     app.main_loop = g_main_loop_new (NULL, FALSE);
+    if (app.record_on_demand)
+    {
+        GIOChannel *stdin_channel = g_io_channel_unix_new (fileno (stdin));
+        g_io_add_watch (stdin_channel, G_IO_IN, stdin_cb, &app);
+        g_io_channel_unref (stdin_channel);
+        g_print ("r: start recording, s: stop recording, i: branch stats, q: quit\n");
+    }
+    main_loop_monitor_start (&app.monitor);
+    gint64 start_time = g_get_monotonic_time ();
     g_main_loop_run (app.main_loop);
 
-    fclose (app.file);
-    g_free (app.data_ptr);
+    main_loop_monitor_stop (&app.monitor);
+    feeder_print_stats (&app.feeder);
+    print_branch_stats (&app, (g_get_monotonic_time () - start_time) / (gdouble) G_USEC_PER_SEC);
+
+    feeder_close (&app.feeder);
     gst_element_set_state (app.pipeline, GST_STATE_NULL);
     g_main_loop_unref (app.main_loop);
     gst_object_unref (app.pipeline);
@@ -0,0 +1,1355 @@
+/*
+ * appsrc feeder shared by appsrc.cpp and appsrc_and_bins.cpp.
+ *
+ * Header only, include it from the application and compile as before:
+ * g++ appsrc.cpp -g -fpermissive `pkg-config --libs --cflags gstreamer-1.0 gstreamer-app-1.0`
+ * add -DHAVE_LIBURING ... -luring to build the io_uring read backend.
+ *
+ * The feeder reads the input file in chunks, either with fread into a
+ * freshly allocated buffer or as read-only slices of a mapping of the whole
+ * file, and pushes them into an appsrc.
+ *
+ * Chunks are BUFF_SIZE bytes stamped with a fake 250 ms duration unless
+ * configured otherwise. With adaptive chunking the chunk size doubles while
+ * appsrc keeps running dry at a high need-data rate and halves again when
+ * need-data becomes rare, bounded by chunk-min / chunk-max. In byte-stream
+ * mode no PTS/duration is fabricated and the demuxer timestamps the stream.
+ *
+ * By default the chunks are read from a g_idle_add() callback on the default
+ * main loop, the same thread that handles the bus. With threaded feeding a
+ * dedicated reader thread keeps a bounded ring of prefetched buffers filled;
+ * need-data / enough-data only toggle a flag, so disk I/O overlaps with
+ * demux and decode and never stalls the main loop.
+ *
+ * In h264-au mode the input is a raw Annex-B H.264 stream. It is mapped like
+ * in mmap mode, split into access units by the SIMD start code scanner in
+ * h264_startcode.h and every AU is pushed as one buffer with
+ * stream-format=byte-stream, alignment=au caps, ready for h264parse without
+ * any demuxer.
+ *
+ * In uring mode chunks are read with positional reads that are submitted
+ * FEEDER_URING_DEPTH chunks ahead through one io_uring shared by every feeder
+ * in the process; a single reaper thread completes them and need-data only
+ * hands out finished buffers. Without liburing, or when the kernel refuses
+ * to set up a ring, the same mode falls back to plain pread(). Per-stream
+ * read latency and the aggregate IOPS of the process are reported.
+ *
+ * In fread and uring mode the chunks can be taken from size-classed GstBufferPools
+ * instead of being allocated per chunk. fread then writes straight into the
+ * pooled buffer, which goes back to its pool once downstream releases it.
+ * */
+
+#ifndef __APPSRC_FEEDER_H__
+#define __APPSRC_FEEDER_H__
+
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <errno.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "h264_startcode.h"
+
+#define BUFF_SIZE (6144) /* 6 KB */
+
+/* default bounds of adaptive chunk sizing */
+#define FEEDER_CHUNK_MIN (4 * 1024)
+#define FEEDER_CHUNK_MAX (256 * 1024)
+/* need-data intervals (us) below which chunks grow and above which they shrink */
+#define FEEDER_ADAPT_FAST_US (5000)
+#define FEEDER_ADAPT_SLOW_US (100000)
+/* appsrc default max-bytes, raised so that a few maximum chunks fit */
+#define FEEDER_APPSRC_MAX_BYTES (200000)
+
+/* frame rate used to timestamp access units in h264-au mode */
+#define FEEDER_AU_FPS (30)
+
+/* reads each feeder keeps in flight, and the size of the shared io_uring */
+#define FEEDER_URING_DEPTH (8)
+#define FEEDER_URING_ENTRIES (256)
+
+/* number of prefetched chunks the reader thread keeps ready */
+#define FEEDER_RING_SIZE (64)
+
+/* period of the main loop latency monitor */
+#define MAIN_LOOP_MONITOR_INTERVAL_MS (10)
+
+/* buffer pool size classes are powers of two from 4 KB to 1 MB */
+#define FEEDER_POOL_MIN_SHIFT (12)
+#define FEEDER_POOL_CLASSES (9)
+/* upper bound of the memory held by one size class */
+#define FEEDER_POOL_MAX_BYTES (8 * 1024 * 1024)
+#define FEEDER_POOL_MIN_BUFFERS (4)
+/* buffers of one class that can be out besides the prefetch ring: queued
+ * in appsrc, reads in flight and held downstream */
+#define FEEDER_POOL_QUEUE_BUFFERS (16)
+
+/* GstBufferPool that counts how often it had to allocate and how many
+ * buffers downstream gave back, so hit rate and outstanding buffers can be
+ * reported. */
+typedef struct _FeederBufferPool
+{
+    GstBufferPool parent;
+
+    gint acquired;
+    gint allocated;
+    gint released;
+    gint preallocated;
+}FeederBufferPool;
+
+typedef struct _FeederBufferPoolClass
+{
+    GstBufferPoolClass parent_class;
+}FeederBufferPoolClass;
+
+GType feeder_buffer_pool_get_type (void);
+#define FEEDER_TYPE_BUFFER_POOL (feeder_buffer_pool_get_type ())
+#define FEEDER_BUFFER_POOL(obj) ((FeederBufferPool *) (obj))
+
+G_DEFINE_TYPE (FeederBufferPool, feeder_buffer_pool, GST_TYPE_BUFFER_POOL);
+
+static GstFlowReturn feeder_buffer_pool_acquire_buffer (GstBufferPool *pool, GstBuffer **buffer,
+        GstBufferPoolAcquireParams *params)
+{
+    GstFlowReturn ret;
+
+    ret = GST_BUFFER_POOL_CLASS (feeder_buffer_pool_parent_class)->acquire_buffer (pool, buffer, params);
+    if (ret == GST_FLOW_OK)
+        g_atomic_int_inc (&FEEDER_BUFFER_POOL (pool)->acquired);
+
+    return ret;
+}
+
+static GstFlowReturn feeder_buffer_pool_alloc_buffer (GstBufferPool *pool, GstBuffer **buffer,
+        GstBufferPoolAcquireParams *params)
+{
+    g_atomic_int_inc (&FEEDER_BUFFER_POOL (pool)->allocated);
+
+    return GST_BUFFER_POOL_CLASS (feeder_buffer_pool_parent_class)->alloc_buffer (pool, buffer, params);
+}
+
+static void feeder_buffer_pool_release_buffer (GstBufferPool *pool, GstBuffer *buffer)
+{
+    g_atomic_int_inc (&FEEDER_BUFFER_POOL (pool)->released);
+
+    GST_BUFFER_POOL_CLASS (feeder_buffer_pool_parent_class)->release_buffer (pool, buffer);
+}
+
+static void feeder_buffer_pool_class_init (FeederBufferPoolClass *klass)
+{
+    GstBufferPoolClass *pool_class = GST_BUFFER_POOL_CLASS (klass);
+
+    pool_class->acquire_buffer = feeder_buffer_pool_acquire_buffer;
+    pool_class->alloc_buffer = feeder_buffer_pool_alloc_buffer;
+    pool_class->release_buffer = feeder_buffer_pool_release_buffer;
+}
+
+static void feeder_buffer_pool_init (FeederBufferPool *pool)
+{
+}
+
+static GstBufferPool *feeder_buffer_pool_new (guint size)
+{
+    GstBufferPool *pool = (GstBufferPool *) g_object_new (FEEDER_TYPE_BUFFER_POOL, NULL);
+    GstStructure *config = gst_buffer_pool_get_config (pool);
+    /* a full prefetch ring alone must never empty a class, even the 1 MB
+     * one, the reader would wait for buffers only it can give back */
+    guint max_buffers = MAX (FEEDER_RING_SIZE + FEEDER_POOL_QUEUE_BUFFERS, FEEDER_POOL_MAX_BYTES / size);
+
+    gst_buffer_pool_config_set_params (config, NULL, size, FEEDER_POOL_MIN_BUFFERS, max_buffers);
+    if (!gst_buffer_pool_set_config (pool, config) || !gst_buffer_pool_set_active (pool, TRUE))
+    {
+        g_printerr ("failed to configure buffer pool of size %u\n", size);
+        gst_object_unref (pool);
+        return NULL;
+    }
+    FEEDER_BUFFER_POOL (pool)->preallocated = FEEDER_POOL_MIN_BUFFERS;
+
+    return pool;
+}
+
+typedef enum
+{
+    FEED_MODE_FREAD,
+    FEED_MODE_MMAP,
+    FEED_MODE_H264_AU,
+    FEED_MODE_URING,
+}FeedMode;
+
+struct _Feeder;
+
+/* one positional read in flight on the shared io_uring */
+typedef struct _FeederIoRequest
+{
+    struct _Feeder *feeder;
+    GstBuffer *buffer;
+    GstMapInfo map;
+    gsize len;
+    guint64 offset;
+    gint64 submit_time;
+    gint result;
+    gboolean done;
+}FeederIoRequest;
+
+typedef struct _MappedFile
+{
+    gpointer addr;
+    gsize size;
+}MappedFile;
+
+typedef struct _FeederConfig
+{
+    gchar *mode_name;
+    FeedMode mode;
+    gboolean threaded;
+    gboolean use_pool;
+    gint chunk_size;
+    gint chunk_min;
+    gint chunk_max;
+    gboolean adaptive;
+    gboolean byte_stream;
+    gint au_fps;
+}FeederConfig;
+
+typedef struct _Feeder
+{
+    GstElement *app_src;
+
+    FeedMode mode;
+    gboolean threaded;
+
+    /* current chunk size, read by the reader thread and adapted on need-data */
+    gint chunk_size;
+    gint chunk_min;
+    gint chunk_max;
+    gboolean adaptive;
+    gboolean byte_stream;
+    gint64 last_need_data;
+    gint64 need_data_interval;
+    guint chunk_grows;
+    guint chunk_shrinks;
+
+    FILE *file;
+    guint8 *data_ptr;
+
+    /* size-classed pools for fread mode, created on first use */
+    gboolean use_pool;
+    GstBufferPool *pools[FEEDER_POOL_CLASSES];
+    /* bumped on the reader or streaming thread, read by the report */
+    guint64 pool_fallbacks;
+
+    /* whole input file mapped once, chunks are pushed as shared sub-memories */
+    GstMemory *file_mem;
+    gsize file_size;
+    gsize file_offset;
+
+    /* h264-au mode keeps the mapping mapped and frames it into AUs */
+    GstMapInfo file_map;
+    H264AuFramer framer;
+    gint au_fps;
+    guint64 au_count;
+
+    /* uring mode, read positionally through io_uring or with pread */
+    gint fd;
+    gboolean use_uring;
+    guint64 read_offset;
+    FeederIoRequest *io_reqs[FEEDER_URING_DEPTH];
+    guint io_head;
+    guint io_count;
+    /* the read statistics are protected by lock */
+    gint64 io_first_read;
+    guint64 io_reads;
+    guint64 io_latency_sum;
+    guint64 io_latency_max;
+
+    GstClockTime timestamp;
+
+    /* g_idle_add() source when feeding from the main loop */
+    guint sourceid;
+
+    /* reader thread and its prefetch ring, protected by lock */
+    GThread *thread;
+    GMutex lock;
+    GCond cond;
+    GstBuffer *ring[FEEDER_RING_SIZE];
+    guint ring_head;
+    guint ring_count;
+    gboolean feeding;
+    gboolean input_done;
+    gboolean stopping;
+
+    /* feed statistics */
+    guint64 bytes_fed;
+    gint64 feed_start_time;
+    gint64 feed_end_time;
+    guint64 feed_cpu_ns;
+}Feeder;
+
+typedef struct _MainLoopMonitor
+{
+    guint sourceid;
+    gint64 expected;
+    gint64 total_lateness;
+    gint64 max_lateness;
+    guint64 samples;
+}MainLoopMonitor;
+
+static guint64 thread_cpu_time_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (guint64) ts.tv_sec * GST_SECOND + ts.tv_nsec;
+}
+
+static void mapped_file_release (gpointer data)
+{
+    MappedFile *mf = (MappedFile *) data;
+
+    munmap (mf->addr, mf->size);
+    g_free (mf);
+}
+
+/* Maps @path read-only and wraps the mapping in a GstMemory. Every chunk
+ * pushed downstream shares this memory, so the mapping is only released
+ * once the last buffer referencing it has been freed. */
+static GstMemory *map_input_file (const gchar *path, gsize *size)
+{
+    struct stat st;
+    gpointer addr;
+    MappedFile *mf;
+
+    int fd = open (path, O_RDONLY);
+    if (fd < 0)
+    {
+        g_printerr ("failed to open %s\n", path);
+        return NULL;
+    }
+
+    if (fstat (fd, &st) < 0 || st.st_size == 0)
+    {
+        g_printerr ("failed to stat %s or file is empty\n", path);
+        close (fd);
+        return NULL;
+    }
+
+    addr = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (addr == MAP_FAILED)
+    {
+        g_printerr ("failed to mmap %s\n", path);
+        return NULL;
+    }
+    madvise (addr, st.st_size, MADV_SEQUENTIAL);
+
+    mf = g_new0 (MappedFile, 1);
+    mf->addr = addr;
+    mf->size = st.st_size;
+    *size = st.st_size;
+
+    return gst_memory_new_wrapped (GST_MEMORY_FLAG_READONLY, addr, st.st_size, 0, st.st_size,
+            mf, mapped_file_release);
+}
+
+static const gchar *feed_mode_name (FeedMode mode)
+{
+    switch (mode)
+    {
+        case FEED_MODE_MMAP:
+            return "mmap";
+        case FEED_MODE_H264_AU:
+            return "h264-au";
+        case FEED_MODE_URING:
+            return "uring";
+        default:
+            return "fread";
+    }
+}
+
+static gboolean feed_mode_from_string (const gchar *str, FeedMode *mode)
+{
+    if (!str || !g_strcmp0 (str, "fread"))
+        *mode = FEED_MODE_FREAD;
+    else if (!g_strcmp0 (str, "mmap"))
+        *mode = FEED_MODE_MMAP;
+    else if (!g_strcmp0 (str, "h264-au"))
+        *mode = FEED_MODE_H264_AU;
+    else if (!g_strcmp0 (str, "uring"))
+        *mode = FEED_MODE_URING;
+    else
+        return FALSE;
+
+    return TRUE;
+}
+
+static guint feeder_pool_class (gsize size)
+{
+    guint index = 0;
+
+    while (index < FEEDER_POOL_CLASSES - 1 && ((gsize) 1 << (FEEDER_POOL_MIN_SHIFT + index)) < size)
+        index++;
+
+    return index;
+}
+
+/* Takes a buffer of at least @size bytes from the matching size class. A
+ * plain buffer is allocated when the class is exhausted, waiting could
+ * block the reader thread on buffers sitting in its own prefetch ring. */
+static GstBuffer *feeder_pool_acquire (Feeder *feeder, gsize size)
+{
+    guint index = feeder_pool_class (size);
+    guint class_size = 1 << (FEEDER_POOL_MIN_SHIFT + index);
+    GstBufferPoolAcquireParams params = { };
+    GstBuffer *buffer = NULL;
+
+    if (size <= class_size)
+    {
+        /* published atomically, feeder_close () flushes it from another thread */
+        if (!feeder->pools[index])
+            g_atomic_pointer_set (&feeder->pools[index], feeder_buffer_pool_new (class_size));
+
+        params.flags = GST_BUFFER_POOL_ACQUIRE_FLAG_DONTWAIT;
+
+        if (feeder->pools[index] &&
+                gst_buffer_pool_acquire_buffer (feeder->pools[index], &buffer, &params) == GST_FLOW_OK)
+            return buffer;
+    }
+
+    __atomic_fetch_add (&feeder->pool_fallbacks, 1, __ATOMIC_RELAXED);
+    return gst_buffer_new_and_alloc (size);
+}
+
+/* Reads straight into a pooled buffer, no intermediate copy. */
+static GstBuffer *feeder_read_chunk_pooled (Feeder *feeder)
+{
+    GstBuffer *buffer;
+    GstMapInfo map;
+    gsize size;
+
+    gint chunk_size = g_atomic_int_get (&feeder->chunk_size);
+
+    buffer = feeder_pool_acquire (feeder, chunk_size);
+
+    gst_buffer_map (buffer, &map, GST_MAP_WRITE);
+    size = fread (map.data, 1, chunk_size, feeder->file);
+    gst_buffer_unmap (buffer, &map);
+
+    if (size == 0)
+    {
+        gst_buffer_unref (buffer);
+        return NULL;
+    }
+    gst_buffer_set_size (buffer, size);
+
+    return buffer;
+}
+
+static GstBuffer *feeder_read_chunk_fread (Feeder *feeder)
+{
+    GstBuffer *buffer;
+    gsize size;
+
+    if (feeder->use_pool)
+        return feeder_read_chunk_pooled (feeder);
+
+    size = fread (feeder->data_ptr, 1, g_atomic_int_get (&feeder->chunk_size), feeder->file);
+    if (size == 0)
+        return NULL;
+
+    buffer = gst_buffer_new_and_alloc (size);
+    gst_buffer_fill (buffer, 0, feeder->data_ptr, size);
+
+    return buffer;
+}
+
+/* Zero-copy variant of feeder_read_chunk_fread: each chunk is a read-only
+ * slice of the mapped input file, no allocation of payload memory and no
+ * memcpy. */
+static GstBuffer *feeder_read_chunk_mmap (Feeder *feeder)
+{
+    GstBuffer *buffer;
+    gsize size;
+
+    if (feeder->file_offset >= feeder->file_size)
+        return NULL;
+
+    size = MIN ((gsize) g_atomic_int_get (&feeder->chunk_size), feeder->file_size - feeder->file_offset);
+
+    buffer = gst_buffer_new ();
+    gst_buffer_append_memory (buffer, gst_memory_share (feeder->file_mem, feeder->file_offset, size));
+    feeder->file_offset += size;
+
+    return buffer;
+}
+
+/* reads completed by all feeders of the process, for the aggregate IOPS */
+static guint64 feeder_io_total_reads = 0;
+
+/* Called with the feeder lock held. */
+static void feeder_io_record (Feeder *feeder, gint64 latency)
+{
+    if (feeder->io_first_read == 0)
+        feeder->io_first_read = g_get_monotonic_time () - latency;
+    __atomic_fetch_add (&feeder_io_total_reads, 1, __ATOMIC_RELAXED);
+
+    feeder->io_reads++;
+    feeder->io_latency_sum += latency;
+    feeder->io_latency_max = MAX (feeder->io_latency_max, (guint64) latency);
+}
+
+static GstBuffer *feeder_io_buffer_new (Feeder *feeder, gsize size)
+{
+    return feeder->use_pool ? feeder_pool_acquire (feeder, size) : gst_buffer_new_and_alloc (size);
+}
+
+/* Synchronous fallback when io_uring is not available. */
+static GstBuffer *feeder_read_chunk_pread (Feeder *feeder)
+{
+    GstBuffer *buffer;
+    GstMapInfo map;
+    gssize size;
+    gsize len;
+    gint64 start;
+
+    if (feeder->read_offset >= feeder->file_size)
+        return NULL;
+
+    len = MIN ((gsize) g_atomic_int_get (&feeder->chunk_size), feeder->file_size - feeder->read_offset);
+    buffer = feeder_io_buffer_new (feeder, len);
+
+    start = g_get_monotonic_time ();
+    gst_buffer_map (buffer, &map, GST_MAP_WRITE);
+    size = pread (feeder->fd, map.data, len, feeder->read_offset);
+    gst_buffer_unmap (buffer, &map);
+    g_mutex_lock (&feeder->lock);
+    feeder_io_record (feeder, g_get_monotonic_time () - start);
+    g_mutex_unlock (&feeder->lock);
+
+    if (size <= 0)
+    {
+        if (size < 0)
+            g_printerr ("pread failed: %s\n", g_strerror (errno));
+        gst_buffer_unref (buffer);
+        return NULL;
+    }
+
+    gst_buffer_set_size (buffer, size);
+    feeder->read_offset += size;
+
+    return buffer;
+}
+
+#ifdef HAVE_LIBURING
+typedef struct _FeederUring
+{
+    struct io_uring ring;
+    /* serializes submissions, completions are only touched by the reaper */
+    GMutex lock;
+    GThread *reaper;
+    gint users;
+}FeederUring;
+
+static FeederUring *feeder_uring = NULL;
+static GMutex feeder_uring_init_lock;
+
+static gpointer feeder_uring_reap (gpointer data)
+{
+    FeederUring *uring = (FeederUring *) data;
+    struct io_uring_cqe *cqe;
+
+    while (TRUE)
+    {
+        int ret = io_uring_wait_cqe (&uring->ring, &cqe);
+        if (ret == -EINTR)
+            continue;
+        if (ret < 0)
+        {
+            g_printerr ("io_uring_wait_cqe failed: %s\n", g_strerror (-ret));
+            break;
+        }
+
+        FeederIoRequest *req = (FeederIoRequest *) io_uring_cqe_get_data (cqe);
+        gint res = cqe->res;
+        io_uring_cqe_seen (&uring->ring, cqe);
+
+        /* a NOP without request asks the reaper to exit */
+        if (!req)
+            break;
+
+        Feeder *feeder = req->feeder;
+        g_mutex_lock (&feeder->lock);
+        req->result = res;
+        req->done = TRUE;
+        feeder_io_record (feeder, g_get_monotonic_time () - req->submit_time);
+        g_cond_broadcast (&feeder->cond);
+        g_mutex_unlock (&feeder->lock);
+    }
+
+    return NULL;
+}
+
+/* Takes a reference on the process wide ring, creating it on first use. */
+static gboolean feeder_uring_acquire (void)
+{
+    gboolean ok = TRUE;
+
+    g_mutex_lock (&feeder_uring_init_lock);
+    if (!feeder_uring)
+    {
+        FeederUring *uring = g_new0 (FeederUring, 1);
+        int ret = io_uring_queue_init (FEEDER_URING_ENTRIES, &uring->ring, 0);
+        if (ret < 0)
+        {
+            g_printerr ("io_uring_queue_init failed: %s\n", g_strerror (-ret));
+            g_free (uring);
+            ok = FALSE;
+        }
+        else
+        {
+            g_mutex_init (&uring->lock);
+            uring->reaper = g_thread_new ("feeder-uring", feeder_uring_reap, uring);
+            feeder_uring = uring;
+        }
+    }
+    if (ok)
+        feeder_uring->users++;
+    g_mutex_unlock (&feeder_uring_init_lock);
+
+    return ok;
+}
+
+static void feeder_uring_release (void)
+{
+    g_mutex_lock (&feeder_uring_init_lock);
+    if (feeder_uring && --feeder_uring->users == 0)
+    {
+        FeederUring *uring = feeder_uring;
+        struct io_uring_sqe *sqe;
+
+        g_mutex_lock (&uring->lock);
+        sqe = io_uring_get_sqe (&uring->ring);
+        io_uring_prep_nop (sqe);
+        io_uring_sqe_set_data (sqe, NULL);
+        io_uring_submit (&uring->ring);
+        g_mutex_unlock (&uring->lock);
+
+        g_thread_join (uring->reaper);
+        io_uring_queue_exit (&uring->ring);
+        g_mutex_clear (&uring->lock);
+        g_free (uring);
+        feeder_uring = NULL;
+    }
+    g_mutex_unlock (&feeder_uring_init_lock);
+}
+
+static gboolean feeder_uring_submit (Feeder *feeder, FeederIoRequest *req, gsize len, guint64 offset)
+{
+    struct io_uring_sqe *sqe;
+    int ret;
+
+    g_mutex_lock (&feeder_uring->lock);
+    sqe = io_uring_get_sqe (&feeder_uring->ring);
+    if (!sqe)
+    {
+        g_mutex_unlock (&feeder_uring->lock);
+        return FALSE;
+    }
+    io_uring_prep_read (sqe, feeder->fd, req->map.data, len, offset);
+    io_uring_sqe_set_data (sqe, req);
+    req->submit_time = g_get_monotonic_time ();
+    ret = io_uring_submit (&feeder_uring->ring);
+    g_mutex_unlock (&feeder_uring->lock);
+
+    return ret >= 0;
+}
+#else
+static gboolean feeder_uring_acquire (void)
+{
+    g_printerr ("built without HAVE_LIBURING\n");
+    return FALSE;
+}
+
+static void feeder_uring_release (void)
+{
+}
+
+static gboolean feeder_uring_submit (Feeder *feeder, FeederIoRequest *req, gsize len, guint64 offset)
+{
+    return FALSE;
+}
+#endif
+
+/* Tops the feeder up to FEEDER_URING_DEPTH reads in flight. A read that
+ * cannot be queued, e.g. because the shared submission queue is full, is
+ * done synchronously instead. */
+static void feeder_io_submit_ahead (Feeder *feeder)
+{
+    while (feeder->io_count < FEEDER_URING_DEPTH && feeder->read_offset < feeder->file_size)
+    {
+        gsize len = MIN ((gsize) g_atomic_int_get (&feeder->chunk_size), feeder->file_size - feeder->read_offset);
+        FeederIoRequest *req = g_new0 (FeederIoRequest, 1);
+
+        req->feeder = feeder;
+        req->len = len;
+        req->offset = feeder->read_offset;
+        req->buffer = feeder_io_buffer_new (feeder, len);
+        gst_buffer_map (req->buffer, &req->map, GST_MAP_WRITE);
+
+        if (!feeder_uring_submit (feeder, req, len, feeder->read_offset))
+        {
+            gint64 start = g_get_monotonic_time ();
+            gssize ret = pread (feeder->fd, req->map.data, len, feeder->read_offset);
+
+            g_mutex_lock (&feeder->lock);
+            req->result = ret < 0 ? -errno : ret;
+            req->done = TRUE;
+            feeder_io_record (feeder, g_get_monotonic_time () - start);
+            g_mutex_unlock (&feeder->lock);
+        }
+
+        feeder->read_offset += len;
+        feeder->io_reqs[(feeder->io_head + feeder->io_count) % FEEDER_URING_DEPTH] = req;
+        feeder->io_count++;
+    }
+}
+
+/* Waits for the oldest read in flight and hands back its buffer. */
+static GstBuffer *feeder_io_complete_head (Feeder *feeder, gint *result)
+{
+    FeederIoRequest *req = feeder->io_reqs[feeder->io_head];
+    GstBuffer *buffer;
+
+    g_mutex_lock (&feeder->lock);
+    while (!req->done)
+        g_cond_wait (&feeder->cond, &feeder->lock);
+    g_mutex_unlock (&feeder->lock);
+
+    /* the reads behind this one are already in flight for the offsets
+     * after it, so the rest of a short read is completed here */
+    while (req->result > 0 && (gsize) req->result < req->len)
+    {
+        gssize ret = pread (feeder->fd, req->map.data + req->result, req->len - req->result,
+                req->offset + req->result);
+
+        if (ret <= 0)
+        {
+            /* the file shrank under us */
+            req->result = ret < 0 ? -errno : -EIO;
+            break;
+        }
+        req->result += ret;
+    }
+
+    feeder->io_reqs[feeder->io_head] = NULL;
+    feeder->io_head = (feeder->io_head + 1) % FEEDER_URING_DEPTH;
+    feeder->io_count--;
+
+    gst_buffer_unmap (req->buffer, &req->map);
+    buffer = req->buffer;
+    *result = req->result;
+    g_free (req);
+
+    return buffer;
+}
+
+static GstBuffer *feeder_read_chunk_uring (Feeder *feeder)
+{
+    GstBuffer *buffer;
+    gint result;
+
+    if (!feeder->use_uring)
+        return feeder_read_chunk_pread (feeder);
+
+    feeder_io_submit_ahead (feeder);
+    if (feeder->io_count == 0)
+        return NULL;
+
+    buffer = feeder_io_complete_head (feeder, &result);
+    if (result <= 0)
+    {
+        if (result < 0)
+            g_printerr ("read failed: %s\n", g_strerror (-result));
+        gst_buffer_unref (buffer);
+        return NULL;
+    }
+    gst_buffer_set_size (buffer, result);
+
+    /* keep the queue full while this chunk travels downstream */
+    feeder_io_submit_ahead (feeder);
+
+    return buffer;
+}
+
+/* Pushes exactly one access unit, again as a slice of the mapping. */
+static GstBuffer *feeder_read_chunk_h264_au (Feeder *feeder)
+{
+    GstBuffer *buffer;
+    size_t offset, size;
+
+    if (!h264_au_framer_next (&feeder->framer, &offset, &size))
+        return NULL;
+
+    buffer = gst_buffer_new ();
+    gst_buffer_append_memory (buffer, gst_memory_share (feeder->file_mem, offset, size));
+    feeder->au_count++;
+
+    return buffer;
+}
+
+/* Reads the next chunk of input and, unless in byte-stream mode, timestamps
+ * it. Returns NULL at the end of the input. */
+static GstBuffer *feeder_read_chunk (Feeder *feeder)
+{
+    GstBuffer *buffer;
+    guint64 cpu_start = thread_cpu_time_ns ();
+
+    if (feeder->mode == FEED_MODE_H264_AU)
+        buffer = feeder_read_chunk_h264_au (feeder);
+    else if (feeder->mode == FEED_MODE_URING)
+        buffer = feeder_read_chunk_uring (feeder);
+    else if (feeder->mode == FEED_MODE_MMAP)
+        buffer = feeder_read_chunk_mmap (feeder);
+    else
+        buffer = feeder_read_chunk_fread (feeder);
+
+    if (buffer && !feeder->byte_stream && feeder->mode == FEED_MODE_H264_AU)
+    {
+        /* AUs are in decode order, h264parse derives the PTS */
+        GST_BUFFER_DTS (buffer) = feeder->timestamp;
+        GST_BUFFER_DURATION (buffer) = gst_util_uint64_scale_int (1, GST_SECOND, feeder->au_fps);
+        feeder->timestamp += GST_BUFFER_DURATION (buffer);
+    }
+    else if (buffer && !feeder->byte_stream)
+    {
+        GST_BUFFER_PTS (buffer) = feeder->timestamp;
+        GST_BUFFER_DURATION (buffer) = gst_util_uint64_scale_int (1, GST_SECOND, 4);
+        feeder->timestamp += GST_BUFFER_DURATION (buffer);
+    }
+
+    feeder->feed_cpu_ns += thread_cpu_time_ns () - cpu_start;
+
+    return buffer;
+}
+
+static gboolean feeder_push (Feeder *feeder, GstBuffer *buffer)
+{
+    GstFlowReturn ret;
+    gsize size = gst_buffer_get_size (buffer);
+
+    g_signal_emit_by_name (feeder->app_src, "push-buffer", buffer, &ret);
+
+    gst_buffer_unref (buffer);
+
+    if (ret != GST_FLOW_OK)
+    {
+        g_print ("push-buffer failed\n");
+        return FALSE;
+    }
+
+    feeder->bytes_fed += size;
+
+    return TRUE;
+}
+
+static void feeder_end_of_stream (Feeder *feeder)
+{
+    GstFlowReturn ret;
+
+    feeder->feed_end_time = g_get_monotonic_time ();
+    ret = gst_app_src_end_of_stream ((GstAppSrc *) feeder->app_src);
+    g_print ("eos returned %d at %d\n", ret, __LINE__);
+}
+
+static gboolean read_data (Feeder *feeder)
+{
+    GstBuffer *buffer;
+
+    if (feeder->feed_start_time == 0)
+        feeder->feed_start_time = g_get_monotonic_time ();
+
+    buffer = feeder_read_chunk (feeder);
+    if (!buffer)
+    {
+        feeder_end_of_stream (feeder);
+        feeder->sourceid = 0;
+        return FALSE;
+    }
+
+    if (!feeder_push (feeder, buffer))
+    {
+        feeder->sourceid = 0;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Reader thread: keeps the prefetch ring full and drains it into appsrc
+ * whenever appsrc asked for data. */
+static gpointer feeder_thread_func (gpointer data)
+{
+    Feeder *feeder = (Feeder *) data;
+    GstBuffer *buffer;
+
+    feeder->feed_start_time = g_get_monotonic_time ();
+
+    g_mutex_lock (&feeder->lock);
+    while (!feeder->stopping)
+    {
+        if (feeder->feeding && feeder->ring_count > 0)
+        {
+            buffer = feeder->ring[feeder->ring_head];
+            feeder->ring[feeder->ring_head] = NULL;
+            feeder->ring_head = (feeder->ring_head + 1) % FEEDER_RING_SIZE;
+            feeder->ring_count--;
+
+            /* pushing may emit enough-data, which takes the lock */
+            g_mutex_unlock (&feeder->lock);
+            gboolean ok = feeder_push (feeder, buffer);
+            g_mutex_lock (&feeder->lock);
+
+            if (!ok)
+                break;
+            continue;
+        }
+
+        if (feeder->input_done && feeder->ring_count == 0)
+        {
+            g_mutex_unlock (&feeder->lock);
+            feeder_end_of_stream (feeder);
+            g_mutex_lock (&feeder->lock);
+            break;
+        }
+
+        if (!feeder->input_done && feeder->ring_count < FEEDER_RING_SIZE)
+        {
+            g_mutex_unlock (&feeder->lock);
+            buffer = feeder_read_chunk (feeder);
+            g_mutex_lock (&feeder->lock);
+
+            if (buffer)
+            {
+                feeder->ring[(feeder->ring_head + feeder->ring_count) % FEEDER_RING_SIZE] = buffer;
+                feeder->ring_count++;
+            }
+            else
+            {
+                feeder->input_done = TRUE;
+            }
+            continue;
+        }
+
+        g_cond_wait (&feeder->cond, &feeder->lock);
+    }
+    g_mutex_unlock (&feeder->lock);
+
+    return NULL;
+}
+
+/* Called on every need-data. A short interval while the appsrc queue is
+ * empty means downstream drains us faster than we push small chunks, so the
+ * chunk size doubles to cut per-push overhead. A long interval means the
+ * consumer is slow and large chunks only add latency, so it halves. */
+static void feeder_adapt_chunk_size (Feeder *feeder)
+{
+    gint64 now = g_get_monotonic_time ();
+    guint64 level = 0;
+    gint chunk_size = g_atomic_int_get (&feeder->chunk_size);
+
+    if (feeder->last_need_data == 0)
+    {
+        feeder->last_need_data = now;
+        return;
+    }
+
+    gint64 interval = now - feeder->last_need_data;
+    feeder->last_need_data = now;
+    feeder->need_data_interval = feeder->need_data_interval ?
+        (feeder->need_data_interval * 7 + interval) / 8 : interval;
+
+    g_object_get (feeder->app_src, "current-level-bytes", &level, NULL);
+
+    if (feeder->need_data_interval < FEEDER_ADAPT_FAST_US && level == 0 && chunk_size < feeder->chunk_max)
+    {
+        g_atomic_int_set (&feeder->chunk_size, MIN (chunk_size * 2, feeder->chunk_max));
+        feeder->chunk_grows++;
+    }
+    else if (feeder->need_data_interval > FEEDER_ADAPT_SLOW_US && chunk_size > feeder->chunk_min)
+    {
+        g_atomic_int_set (&feeder->chunk_size, MAX (chunk_size / 2, feeder->chunk_min));
+        feeder->chunk_shrinks++;
+    }
+}
+
+static void start_feed (GstElement * pipeline, guint size, Feeder *feeder)
+{
+    if (feeder->adaptive)
+        feeder_adapt_chunk_size (feeder);
+
+    if (feeder->threaded)
+    {
+        g_mutex_lock (&feeder->lock);
+        feeder->feeding = TRUE;
+        g_cond_signal (&feeder->cond);
+        g_mutex_unlock (&feeder->lock);
+    }
+    else if (feeder->sourceid == 0)
+    {
+        GST_DEBUG ("start feeding");
+        feeder->sourceid = g_idle_add ((GSourceFunc) read_data, feeder);
+    }
+}
+
+static void stop_feed (GstElement * pipeline, Feeder *feeder)
+{
+    if (feeder->threaded)
+    {
+        g_mutex_lock (&feeder->lock);
+        feeder->feeding = FALSE;
+        g_mutex_unlock (&feeder->lock);
+    }
+    else if (feeder->sourceid != 0)
+    {
+        GST_DEBUG ("stop feeding");
+        g_source_remove (feeder->sourceid);
+        feeder->sourceid = 0;
+    }
+}
+
+/* Adds the feeder options to @ctx, parsed values land in @config. Call
+ * feeder_config_finish() after parsing. */
+static void feeder_add_options (GOptionContext *ctx, FeederConfig *config)
+{
+    GOptionEntry entries[] = {
+        { "feed-mode", 'm', 0, G_OPTION_ARG_STRING, &config->mode_name, "How the input is fed to appsrc: fread (default), mmap, h264-au or uring", "MODE" },
+        { "feed-thread", 't', 0, G_OPTION_ARG_NONE, &config->threaded, "Read on a dedicated prefetching thread instead of the main loop", NULL },
+        { "buffer-pool", 'p', 0, G_OPTION_ARG_NONE, &config->use_pool, "Take fread chunks from recycled buffer pools", NULL },
+        { "chunk-size", 0, 0, G_OPTION_ARG_INT, &config->chunk_size, "Initial chunk size in bytes (default 6144)", "BYTES" },
+        { "adaptive-chunks", 'a', 0, G_OPTION_ARG_NONE, &config->adaptive, "Grow or shrink the chunk size from the need-data rate", NULL },
+        { "chunk-min", 0, 0, G_OPTION_ARG_INT, &config->chunk_min, "Lower bound of adaptive chunks (default 4096)", "BYTES" },
+        { "chunk-max", 0, 0, G_OPTION_ARG_INT, &config->chunk_max, "Upper bound of adaptive chunks (default 262144)", "BYTES" },
+        { "byte-stream", 'B', 0, G_OPTION_ARG_NONE, &config->byte_stream, "Push plain bytes without fabricated PTS/duration", NULL },
+        { "au-fps", 0, 0, G_OPTION_ARG_INT, &config->au_fps, "Frame rate used to timestamp h264-au buffers (default 30)", "FPS" },
+        { NULL }
+    };
+
+    memset (config, 0, sizeof (FeederConfig));
+    config->chunk_size = BUFF_SIZE;
+    config->chunk_min = FEEDER_CHUNK_MIN;
+    config->chunk_max = FEEDER_CHUNK_MAX;
+    config->au_fps = FEEDER_AU_FPS;
+
+    g_option_context_add_main_entries (ctx, entries, NULL);
+}
+
+static gboolean feeder_config_finish (FeederConfig *config)
+{
+    gboolean ok = feed_mode_from_string (config->mode_name, &config->mode);
+
+    g_free (config->mode_name);
+    config->mode_name = NULL;
+
+    if (config->chunk_min <= 0 || config->chunk_min > config->chunk_max || config->chunk_size <= 0 ||
+            config->au_fps <= 0)
+        return FALSE;
+
+    if (config->adaptive)
+        config->chunk_size = CLAMP (config->chunk_size, config->chunk_min, config->chunk_max);
+
+    return ok;
+}
+
+static gboolean feeder_open (Feeder *feeder, const gchar *path, const FeederConfig *config)
+{
+    memset (feeder, 0, sizeof (Feeder));
+    feeder->mode = config->mode;
+    feeder->threaded = config->threaded;
+    /* mmap chunks reference the mapping, there is nothing to pool */
+    feeder->use_pool = config->use_pool && (config->mode == FEED_MODE_FREAD || config->mode == FEED_MODE_URING);
+    feeder->fd = -1;
+    feeder->chunk_size = config->chunk_size;
+    feeder->adaptive = config->adaptive;
+    feeder->chunk_min = config->adaptive ? config->chunk_min : config->chunk_size;
+    feeder->chunk_max = config->adaptive ? config->chunk_max : config->chunk_size;
+    feeder->byte_stream = config->byte_stream;
+    feeder->au_fps = config->au_fps;
+
+    g_mutex_init (&feeder->lock);
+    g_cond_init (&feeder->cond);
+
+    switch (feeder->mode)
+    {
+        case FEED_MODE_MMAP:
+        case FEED_MODE_H264_AU:
+            feeder->file_mem = map_input_file (path, &feeder->file_size);
+            if (!feeder->file_mem)
+                return FALSE;
+
+            if (feeder->mode == FEED_MODE_H264_AU)
+            {
+                const char *scanner;
+
+                gst_memory_map (feeder->file_mem, &feeder->file_map, GST_MAP_READ);
+                h264_au_framer_init (&feeder->framer, feeder->file_map.data, feeder->file_map.size);
+                h264_find_start_code_impl (&scanner);
+                g_print ("framing access units with the %s start code scanner\n", scanner);
+            }
+            break;
+
+        case FEED_MODE_URING:
+            {
+                struct stat st;
+
+                feeder->fd = open (path, O_RDONLY);
+                if (feeder->fd < 0 || fstat (feeder->fd, &st) < 0)
+                {
+                    g_printerr ("failed to open %s\n", path);
+                    return FALSE;
+                }
+                feeder->file_size = st.st_size;
+
+                feeder->use_uring = feeder_uring_acquire ();
+                if (!feeder->use_uring)
+                    g_print ("io_uring is not available, falling back to pread\n");
+            }
+            break;
+
+        default:
+            feeder->file = fopen (path, "rb");
+            if (!feeder->file)
+            {
+                g_printerr ("failed to open %s\n", path);
+                return FALSE;
+            }
+            feeder->data_ptr = (guint8 *) g_malloc0 (feeder->chunk_max);
+            break;
+    }
+
+    return TRUE;
+}
+
+/* Connects the feeder to @app_src. With threaded feeding the reader thread
+ * starts prefetching right away. */
+static void feeder_attach (Feeder *feeder, GstElement *app_src)
+{
+    feeder->app_src = app_src;
+
+    if (feeder->mode == FEED_MODE_H264_AU)
+    {
+        GstCaps *caps = gst_caps_new_simple ("video/x-h264",
+                "stream-format", G_TYPE_STRING, "byte-stream",
+                "alignment", G_TYPE_STRING, "au", NULL);
+        g_object_set (app_src, "caps", caps, "format", GST_FORMAT_TIME, NULL);
+        gst_caps_unref (caps);
+    }
+
+    if (feeder->chunk_max * 4 > FEEDER_APPSRC_MAX_BYTES)
+        g_object_set (app_src, "max-bytes", (guint64) feeder->chunk_max * 4, NULL);
+
+    g_signal_connect (app_src, "need-data", G_CALLBACK (start_feed), feeder);
+    g_signal_connect (app_src, "enough-data", G_CALLBACK (stop_feed), feeder);
+
+    if (feeder->threaded)
+        feeder->thread = g_thread_new ("feeder", feeder_thread_func, feeder);
+}
+
+static void feeder_close (Feeder *feeder)
+{
+    guint i;
+
+    if (feeder->thread)
+    {
+        /* nothing may keep the reader in an acquire while it is joined */
+        for (i = 0; i < FEEDER_POOL_CLASSES; i++)
+        {
+            GstBufferPool *pool = g_atomic_pointer_get (&feeder->pools[i]);
+            if (pool)
+                gst_buffer_pool_set_flushing (pool, TRUE);
+        }
+
+        g_mutex_lock (&feeder->lock);
+        feeder->stopping = TRUE;
+        g_cond_signal (&feeder->cond);
+        g_mutex_unlock (&feeder->lock);
+        g_thread_join (feeder->thread);
+        feeder->thread = NULL;
+    }
+
+    if (feeder->sourceid != 0)
+    {
+        g_source_remove (feeder->sourceid);
+        feeder->sourceid = 0;
+    }
+
+    for (i = 0; i < FEEDER_RING_SIZE; i++)
+        gst_buffer_replace (&feeder->ring[i], NULL);
+
+    /* reads still in flight write into their buffers, wait for them */
+    while (feeder->io_count > 0)
+    {
+        gint result;
+        gst_buffer_unref (feeder_io_complete_head (feeder, &result));
+    }
+    if (feeder->use_uring)
+        feeder_uring_release ();
+    if (feeder->fd >= 0)
+        close (feeder->fd);
+
+    /* buffers still held downstream keep their pool alive until released */
+    for (i = 0; i < FEEDER_POOL_CLASSES; i++)
+    {
+        if (feeder->pools[i])
+        {
+            gst_buffer_pool_set_active (feeder->pools[i], FALSE);
+            gst_object_unref (feeder->pools[i]);
+            feeder->pools[i] = NULL;
+        }
+    }
+
+    if (feeder->file)
+        fclose (feeder->file);
+    g_free (feeder->data_ptr);
+
+    /* drops our reference, the mapping goes away with the last pushed chunk */
+    if (feeder->file_map.memory)
+        gst_memory_unmap (feeder->file_mem, &feeder->file_map);
+    if (feeder->file_mem)
+        gst_memory_unref (feeder->file_mem);
+
+    g_mutex_clear (&feeder->lock);
+    g_cond_clear (&feeder->cond);
+}
+
+/* Pool counters summed over all size classes. A hit is an acquire that was
+ * served by a recycled or preallocated buffer, outstanding buffers are the
+ * ones currently held by the feeder or downstream. */
+static void feeder_get_pool_stats (Feeder *feeder, guint64 *acquired, guint64 *hits, guint64 *outstanding)
+{
+    guint i;
+
+    *acquired = *hits = *outstanding = 0;
+    for (i = 0; i < FEEDER_POOL_CLASSES; i++)
+    {
+        FeederBufferPool *pool = FEEDER_BUFFER_POOL (feeder->pools[i]);
+        if (!pool)
+            continue;
+
+        gint acq = g_atomic_int_get (&pool->acquired);
+        gint misses = MAX (0, g_atomic_int_get (&pool->allocated) - pool->preallocated);
+
+        *acquired += acq;
+        *hits += MAX (0, acq - misses);
+        /* preallocated buffers are put into the pool through release_buffer too */
+        *outstanding += MAX (0, acq - (g_atomic_int_get (&pool->released) - pool->preallocated));
+    }
+}
+
+static void feeder_print_pool_stats (Feeder *feeder)
+{
+    guint64 acquired, hits, outstanding;
+
+    if (!feeder->use_pool)
+        return;
+
+    feeder_get_pool_stats (feeder, &acquired, &hits, &outstanding);
+    g_print ("buffer pool: %" G_GUINT64_FORMAT " acquired, hit rate %.1f %%, %" G_GUINT64_FORMAT
+            " outstanding, %" G_GUINT64_FORMAT " unpooled fallbacks\n",
+            acquired, acquired ? hits * 100.0 / acquired : 0.0, outstanding,
+            __atomic_load_n (&feeder->pool_fallbacks, __ATOMIC_RELAXED));
+}
+
+static void feeder_print_stats (Feeder *feeder)
+{
+    struct rusage usage;
+    gint64 end = feeder->feed_end_time ? feeder->feed_end_time : g_get_monotonic_time ();
+    gdouble elapsed = (end - feeder->feed_start_time) / (gdouble) G_USEC_PER_SEC;
+    gdouble gb = feeder->bytes_fed / 1e9;
+
+    if (feeder->bytes_fed == 0 || elapsed <= 0)
+        return;
+
+    getrusage (RUSAGE_SELF, &usage);
+    gdouble process_cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+
+    g_print ("feed mode %s%s: %" G_GUINT64_FORMAT " bytes in %.3f s = %.1f MB/s, "
+            "feed CPU %.3f s/GB, process CPU %.3f s/GB\n",
+            feed_mode_name (feeder->mode), feeder->threaded ? " (reader thread)" : "",
+            feeder->bytes_fed, elapsed, feeder->bytes_fed / 1e6 / elapsed,
+            feeder->feed_cpu_ns / 1e9 / gb, process_cpu / gb);
+
+    g_mutex_lock (&feeder->lock);
+    if (feeder->io_reads > 0)
+    {
+        gint64 io_elapsed = g_get_monotonic_time () - feeder->io_first_read;
+
+        g_print ("%s reads: %" G_GUINT64_FORMAT ", latency avg %.1f us max %" G_GUINT64_FORMAT
+                " us, process IOPS %.0f\n", feeder->use_uring ? "io_uring" : "pread",
+                feeder->io_reads, (gdouble) feeder->io_latency_sum / feeder->io_reads, feeder->io_latency_max,
+                io_elapsed > 0 ? __atomic_load_n (&feeder_io_total_reads, __ATOMIC_RELAXED) *
+                (gdouble) G_USEC_PER_SEC / io_elapsed : 0.0);
+    }
+    g_mutex_unlock (&feeder->lock);
+
+    if (feeder->mode == FEED_MODE_H264_AU)
+        g_print ("%" G_GUINT64_FORMAT " access units, %.1f AU/s\n", feeder->au_count, feeder->au_count / elapsed);
+
+    if (feeder->adaptive)
+        g_print ("adaptive chunks: final size %d bytes, %u grows, %u shrinks, need-data every %.3f ms\n",
+                g_atomic_int_get (&feeder->chunk_size), feeder->chunk_grows, feeder->chunk_shrinks,
+                feeder->need_data_interval / 1000.0);
+
+    feeder_print_pool_stats (feeder);
+}
+
+/* Wakes up every MAIN_LOOP_MONITOR_INTERVAL_MS and records how late the
+ * default main loop dispatched it, i.e. how long bus handling would have
+ * been stalled by whatever else runs on the main loop. */
+static gboolean main_loop_monitor_tick (gpointer data)
+{
+    MainLoopMonitor *monitor = (MainLoopMonitor *) data;
+    gint64 now = g_get_monotonic_time ();
+    gint64 lateness = MAX (0, now - monitor->expected);
+
+    monitor->total_lateness += lateness;
+    monitor->max_lateness = MAX (monitor->max_lateness, lateness);
+    monitor->samples++;
+    monitor->expected = now + MAIN_LOOP_MONITOR_INTERVAL_MS * 1000;
+
+    return TRUE;
+}
+
+static void main_loop_monitor_start (MainLoopMonitor *monitor)
+{
+    memset (monitor, 0, sizeof (MainLoopMonitor));
+    monitor->expected = g_get_monotonic_time () + MAIN_LOOP_MONITOR_INTERVAL_MS * 1000;
+    monitor->sourceid = g_timeout_add (MAIN_LOOP_MONITOR_INTERVAL_MS, main_loop_monitor_tick, monitor);
+}
+
+static void main_loop_monitor_stop (MainLoopMonitor *monitor)
+{
+    if (monitor->sourceid != 0)
+    {
+        g_source_remove (monitor->sourceid);
+        monitor->sourceid = 0;
+    }
+
+    if (monitor->samples == 0)
+        return;
+
+    g_print ("main loop latency: avg %.3f ms, max %.3f ms over %" G_GUINT64_FORMAT " samples\n",
+            monitor->total_lateness / 1000.0 / monitor->samples, monitor->max_lateness / 1000.0,
+            monitor->samples);
+}
+
+#endif /* __APPSRC_FEEDER_H__ */
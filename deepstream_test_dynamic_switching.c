@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
 #include <glib.h>
 #include <math.h>
 #include <gmodule.h>
@@ -12,6 +13,10 @@
 #include "gst-nvmessage.h"
 #include "nvdsmeta.h"
 #include "nvdstilerconfig.h"
+#include "hdr_histogram.h"
+#include "metrics_sampler.h"
+#include "h264_startcode.h"
+#include "keyframe_filter.h"
 
 #define GPU_ID 0
 #define SET_GPU_ID(object, gpu_id) g_object_set (G_OBJECT (object), "gpu-id", gpu_id, NULL);
@@ -19,6 +24,93 @@
 #define MUXER_OUTPUT_WIDTH 1280
 #define MUXER_OUTPUT_HEIGHT 720
 
+/* Retune batched-push-timeout and batch-size from the observed arrivals
+ * instead of the fixed 33333 us / 200 below. The timeout follows the
+ * slowest active source's inter-arrival time plus jitter, capped at
+ * BATCH_TARGET_LATENCY_US; with BATCH_TARGET_THROUGHPUT the cap is
+ * dropped so batches wait to fill. batch-size follows the number of
+ * sources that delivered recently. */
+#define USE_ADAPTIVE_BATCHING
+//#define BATCH_TARGET_THROUGHPUT
+#define BATCH_TARGET_LATENCY_US 40000
+#define BATCH_MIN_TIMEOUT_US 1000
+#define BATCH_CONTROL_INTERVAL_MS 1000
+
+/* Admit a new source only when the predicted NVDEC and CPU load with it
+ * stays under the limits and every running stream meets the frame rate
+ * SLO. The cost of a stream is learned per codec as percent per megapixel
+ * per second, measured ADMISSION_SETTLE_S after each admission, and
+ * scaled by the resolution and frame rate of the stream being added.
+ * Sources that do not fit wait in a queue and are retried every second. */
+#define USE_ADMISSION_CONTROL
+#define ADMISSION_SLO_FPS 25
+#define ADMISSION_NVDEC_LIMIT 90
+#define ADMISSION_CPU_LIMIT 75
+#define ADMISSION_SETTLE_S 3
+#define ADMISSION_MAX_QUEUE 16
+#define ADMISSION_LEARN_ALPHA 0.5
+/* used until a stream reported its caps and a cost was measured,
+ * 1080p30 is 62 MP/s */
+#define ADMISSION_DEFAULT_WIDTH 1920
+#define ADMISSION_DEFAULT_HEIGHT 1080
+#define ADMISSION_DEFAULT_FPS 30
+#define ADMISSION_DEFAULT_NVDEC_COST 0.2
+#define ADMISSION_DEFAULT_HW_CPU_COST 0.02
+#define ADMISSION_DEFAULT_SW_CPU_COST 0.25
+
+/* Move running sources between the hardware and the software decoder to
+ * keep both NVDEC and CPU under their thresholds, one swap per interval.
+ * A swap waits for the next keyframe, drains the old decoder and keeps the
+ * looping segment base. MIGRATION_TEST instead flips one source after the
+ * other every MIGRATION_TEST_INTERVAL_S between two avdec_h264 stand-ins
+ * and checks the output has no PTS gap longer than one GOP. */
+#define USE_DECODER_REBALANCER
+#define REBALANCE_INTERVAL_S 5
+#define REBALANCE_NVDEC_HIGH 95
+#define REBALANCE_NVDEC_LOW 70
+#define REBALANCE_CPU_HIGH 75
+//#define MIGRATION_TEST
+#define MIGRATION_TEST_INTERVAL_S 3
+
+/* Loop the input from memory instead of seeking on EOS. The file is read
+ * and split into access units once, every source replays them from an
+ * appsrc with DTS that keep counting across passes, so a loop boundary
+ * costs no state change, flush or file read. Without it each source reads
+ * the file and restart_stream_buf_prob seeks back on EOS. Either way the
+ * wall time from the last frame of a pass to the first frame of the next
+ * is reported every LOOP_REPORT_INTERVAL_S next to the normal frame gap. */
+#define USE_MEMORY_LOOP
+/* frame rate when the SPS carries no VUI timing info */
+#define MEMORY_LOOP_FPS 30
+#define MEMORY_LOOP_BURST 8
+#define MEMORY_LOOP_MAX_BYTES (2 * 1024 * 1024)
+#define LOOP_REPORT_INTERVAL_S 10
+
+/* Replace the streaming thread of every source by jobs on one pool of
+ * as many threads as cores, see PooledSrc. Needs USE_MEMORY_LOOP. Threads,
+ * context switches per second and RSS are reported every
+ * LOOP_REPORT_INTERVAL_S in either mode for comparison. */
+//#define USE_THREAD_POOL
+
+#if defined(USE_THREAD_POOL) && !defined(USE_MEMORY_LOOP)
+#error USE_THREAD_POOL replays the memory loop cache, define USE_MEMORY_LOOP
+#endif
+
+/* Decode only the keyframe of every KEYFRAME_ONLY_GOP_INTERVAL-th GOP on
+ * every KEYFRAME_ONLY_SOURCE_STRIDE-th source, the rest is dropped after
+ * h264parse, see keyframe_filter.h. Decoder load falls with the GOP
+ * length; force sw_decode in create_source_bin and compare the process cpu
+ * of keyframe_report with and without it to see it on avdec_h264. Such
+ * sources are not held to ADMISSION_SLO_FPS. */
+//#define USE_KEYFRAME_ONLY
+#define KEYFRAME_ONLY_GOP_INTERVAL 1
+#define KEYFRAME_ONLY_SOURCE_STRIDE 1
+
+#ifdef MIGRATION_TEST
+#define HW_DECODER_FACTORY "avdec_h264"
+#else
+#define HW_DECODER_FACTORY "nvv4l2decoder"
+#endif
 
 #define NVGSTDS_ELEM_ADD_PROBE(probe_id, elem, pad, probe_func, probe_type, probe_data) \
     do { \
@@ -31,9 +123,358 @@
         gst_object_unref (gstpad); \
     } while (0)
 
-static gboolean seek_decode (gpointer data)
+typedef struct _decoder_data
+{
+    guint64 prev_accumulated_base;
+    guint64 accumulated_base;
+    GstElement *decoder;
+    /* the last segment accounted for, a sticky segment re-sent to a
+     * swapped in decoder must not advance the base again */
+    guint32 segment_seqnum;
+    gulong restart_probe;
+
+    guint index;
+    GstElement *bin;
+    GstElement *parser;
+    gboolean sw;
+    /* decoder swap state, see migrate_source () */
+    gboolean migrating;
+    gboolean draining;
+    gboolean target_sw;
+    gulong block_probe;
+    gint64 migrate_start;
+#ifdef MIGRATION_TEST
+    /* stream time gaps at the bin output and between keyframes */
+    GstClockTime last_pts;
+    GstClockTime max_gap;
+    GstClockTime last_key_pts;
+    GstClockTime gop;
+#endif
+
+    /* first PTS of the latest pass, loop_pending until it was output */
+    GstClockTime loop_pts;
+    gboolean loop_pending;
+    gint64 last_output;
+#ifdef USE_MEMORY_LOOP
+    guint next_au;
+    guint64 pushed;
+#endif
+#ifdef USE_KEYFRAME_ONLY
+    KeyframeFilter keyframes;
+#endif
+}decoder_data;
+
+/* us between output frames across a loop boundary, and otherwise */
+HdrHistogram loop_stall, frame_gap;
+
+static GstPadProbeReturn loop_stall_probe (GstPad * pad, GstPadProbeInfo * info, gpointer u_data)
+{
+    decoder_data *data = (decoder_data *) u_data;
+    GstClockTime pts = GST_BUFFER_PTS (GST_PAD_PROBE_INFO_BUFFER (info));
+    gint64 now = g_get_monotonic_time ();
+
+    if (data->last_output)
+    {
+        if (__atomic_load_n (&data->loop_pending, __ATOMIC_ACQUIRE) && GST_CLOCK_TIME_IS_VALID (pts) &&
+                pts >= data->loop_pts)
+        {
+            hdr_record (&loop_stall, now - data->last_output);
+            __atomic_store_n (&data->loop_pending, FALSE, __ATOMIC_RELAXED);
+        }
+        else
+            hdr_record (&frame_gap, now - data->last_output);
+    }
+    data->last_output = now;
+
+    return GST_PAD_PROBE_OK;
+}
+
+static void loop_boundary (decoder_data *data, GstClockTime pts)
+{
+    data->loop_pts = pts;
+    __atomic_store_n (&data->loop_pending, TRUE, __ATOMIC_RELEASE);
+}
+
+static gboolean loop_report (gpointer user_data)
+{
+    if (hdr_count (&loop_stall) == 0)
+        return TRUE;
+
+    g_print ("loop boundaries: %lu, stall p50 %.2f p99 %.2f max %.2f ms, frame gap p50 %.2f p99 %.2f ms\n",
+            (unsigned long) hdr_count (&loop_stall), hdr_percentile (&loop_stall, 50) / 1e3,
+            hdr_percentile (&loop_stall, 99) / 1e3, hdr_max (&loop_stall) / 1e3,
+            hdr_percentile (&frame_gap, 50) / 1e3, hdr_percentile (&frame_gap, 99) / 1e3);
+
+    return TRUE;
+}
+
+#ifdef USE_MEMORY_LOOP
+typedef struct _au_entry
+{
+    gsize offset;
+    gsize size;
+}au_entry;
+
+/* the access units of the input file, shared read-only by all sources */
+GstMemory *au_cache_mem = NULL;
+GArray *au_cache = NULL;
+/* from the first SPS, see au_cache_load */
+gint au_cache_fps_n = MEMORY_LOOP_FPS;
+gint au_cache_fps_d = 1;
+gboolean au_cache_pts_is_dts = FALSE;
+
+static gboolean au_cache_load (const gchar *filename)
+{
+    GError *error = NULL;
+    H264AuFramer framer;
+    H264SpsTiming timing;
+    au_entry au;
+    gchar *contents;
+    gsize length;
+
+    if (au_cache)
+        return TRUE;
+
+    if (!g_file_get_contents (filename, &contents, &length, &error))
+    {
+        g_printerr ("failed to read %s: %s\n", filename, error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+
+    au_cache_mem = gst_memory_new_wrapped (GST_MEMORY_FLAG_READONLY, contents, length, 0, length, contents, g_free);
+    au_cache = g_array_new (FALSE, FALSE, sizeof (au_entry));
+
+    h264_au_framer_init (&framer, (const uint8_t *) contents, length);
+    while (h264_au_framer_next (&framer, &au.offset, &au.size))
+        g_array_append_val (au_cache, au);
+
+    if (au_cache->len == 0)
+    {
+        g_printerr ("no H.264 access units in %s\n", filename);
+        g_array_free (au_cache, TRUE);
+        au_cache = NULL;
+        gst_memory_unref (au_cache_mem);
+        au_cache_mem = NULL;
+        return FALSE;
+    }
+
+    /* The AUs are replayed in decode order at a fixed rate. Only the DTS is
+     * known without parsing every slice header, so the PTS is set as well
+     * only when pic_order_cnt_type 2 rules out reordering, otherwise the
+     * decoder interpolates it from the frame rate of the caps. */
+    if (h264_find_sps_timing ((const uint8_t *) contents, length, &timing))
+    {
+        if (timing.fps_n > 0 && timing.fps_n <= (guint32) G_MAXINT && timing.fps_d <= (guint32) G_MAXINT)
+        {
+            au_cache_fps_n = timing.fps_n;
+            au_cache_fps_d = timing.fps_d;
+        }
+        au_cache_pts_is_dts = timing.no_reordering;
+    }
+    g_print ("cached %u access units, %lu bytes of %s at %d/%d fps\n", au_cache->len, (unsigned long) length,
+            filename, au_cache_fps_n, au_cache_fps_d);
+
+    return TRUE;
+}
+
+static GstBuffer *memory_loop_next_buffer (decoder_data *data)
+{
+    GstClockTime duration = gst_util_uint64_scale_int (GST_SECOND, au_cache_fps_d, au_cache_fps_n);
+    au_entry *au = &g_array_index (au_cache, au_entry, data->next_au);
+    GstBuffer *buf = gst_buffer_new ();
+
+    gst_buffer_append_memory (buf, gst_memory_share (au_cache_mem, au->offset, au->size));
+    GST_BUFFER_DTS (buf) = data->pushed * duration;
+    if (au_cache_pts_is_dts)
+        GST_BUFFER_PTS (buf) = GST_BUFFER_DTS (buf);
+    GST_BUFFER_DURATION (buf) = duration;
+
+    if (data->next_au == 0 && data->pushed > 0)
+        loop_boundary (data, GST_BUFFER_DTS (buf));
+    data->pushed++;
+    data->next_au = (data->next_au + 1) % au_cache->len;
+
+    return buf;
+}
+
+static GstCaps *memory_loop_caps (void)
+{
+    return gst_caps_new_simple ("video/x-h264", "stream-format", G_TYPE_STRING, "byte-stream",
+            "alignment", G_TYPE_STRING, "au", "framerate", GST_TYPE_FRACTION, au_cache_fps_n, au_cache_fps_d, NULL);
+}
+
+static void memory_loop_need_data (GstAppSrc *src, guint length, gpointer user_data)
+{
+    decoder_data *data = (decoder_data *) user_data;
+    gint i;
+
+    for (i = 0; i < MEMORY_LOOP_BURST; i++)
+    {
+        if (gst_app_src_push_buffer (src, memory_loop_next_buffer (data)) != GST_FLOW_OK)
+            break;
+    }
+}
+
+static gboolean memory_loop_setup (decoder_data *data, GstElement *source, const gchar *filename)
+{
+    GstAppSrcCallbacks callbacks = { memory_loop_need_data, NULL, NULL };
+    GstCaps *caps;
+
+    if (!au_cache_load (filename))
+        return FALSE;
+
+    caps = memory_loop_caps ();
+    g_object_set (G_OBJECT (source), "caps", caps, "format", GST_FORMAT_TIME,
+            "max-bytes", (guint64) MEMORY_LOOP_MAX_BYTES, NULL);
+    gst_caps_unref (caps);
+    gst_app_src_set_callbacks (GST_APP_SRC (source), &callbacks, data, NULL);
+
+    return TRUE;
+}
+
+#ifdef USE_THREAD_POOL
+/* A source without a streaming thread of its own: while it is PAUSED or
+ * PLAYING a job on stream_pool pushes MEMORY_LOOP_BURST access units and
+ * queues the next job, so every source gets a turn on the shared threads.
+ * h264parse and the decoder's chain run on the pool thread as well.
+ * GstTaskPool cannot be used for this, a task keeps its pool thread until
+ * it stops and a looping source never stops. A job blocked downstream,
+ * e.g. in nvstreammux waiting for the other sources of a batch, is freed
+ * at the latest by batched-push-timeout. */
+GThreadPool *stream_pool = NULL;
+
+typedef struct _PooledSrc
+{
+    GstElement element;
+    GstPad *srcpad;
+    decoder_data *data;
+    gint running;
+}PooledSrc;
+
+typedef struct _PooledSrcClass
+{
+    GstElementClass parent_class;
+}PooledSrcClass;
+
+static GstStaticPadTemplate pooled_src_template = GST_STATIC_PAD_TEMPLATE ("src",
+        GST_PAD_SRC, GST_PAD_ALWAYS, GST_STATIC_CAPS ("video/x-h264"));
+
+GType pooled_src_get_type (void);
+G_DEFINE_TYPE (PooledSrc, pooled_src, GST_TYPE_ELEMENT);
+
+/* runs on a stream_pool thread, the job holds a ref on the source */
+static void pooled_src_run (gpointer job, gpointer user_data)
+{
+    PooledSrc *src = (PooledSrc *) job;
+    GstFlowReturn ret = GST_FLOW_OK;
+    gint i;
+
+    for (i = 0; i < MEMORY_LOOP_BURST && ret == GST_FLOW_OK && g_atomic_int_get (&src->running); i++)
+        ret = gst_pad_push (src->srcpad, memory_loop_next_buffer (src->data));
+
+    if (ret == GST_FLOW_OK && g_atomic_int_get (&src->running))
+    {
+        g_thread_pool_push (stream_pool, src, NULL);
+        return;
+    }
+
+    if (ret != GST_FLOW_OK && ret != GST_FLOW_FLUSHING)
+        GST_ELEMENT_FLOW_ERROR (src, ret);
+    gst_object_unref (src);
+}
+
+static gboolean pooled_src_query (GstPad *pad, GstObject *parent, GstQuery *query)
+{
+    if (GST_QUERY_TYPE (query) == GST_QUERY_LATENCY)
+    {
+        gst_query_set_latency (query, FALSE, 0, GST_CLOCK_TIME_NONE);
+        return TRUE;
+    }
+
+    return gst_pad_query_default (pad, parent, query);
+}
+
+static GstStateChangeReturn pooled_src_change_state (GstElement *element, GstStateChange transition)
+{
+    PooledSrc *src = (PooledSrc *) element;
+    GstStateChangeReturn ret;
+
+    if (transition == GST_STATE_CHANGE_PAUSED_TO_READY)
+        g_atomic_int_set (&src->running, FALSE);
+
+    ret = GST_ELEMENT_CLASS (pooled_src_parent_class)->change_state (element, transition);
+
+    if (transition == GST_STATE_CHANGE_READY_TO_PAUSED && ret != GST_STATE_CHANGE_FAILURE)
+    {
+        gchar *stream_id = gst_pad_create_stream_id (src->srcpad, element, NULL);
+        GstCaps *caps = memory_loop_caps ();
+        GstSegment segment;
+
+        gst_pad_push_event (src->srcpad, gst_event_new_stream_start (stream_id));
+        gst_pad_push_event (src->srcpad, gst_event_new_caps (caps));
+        gst_segment_init (&segment, GST_FORMAT_TIME);
+        gst_pad_push_event (src->srcpad, gst_event_new_segment (&segment));
+        g_free (stream_id);
+        gst_caps_unref (caps);
+
+        g_atomic_int_set (&src->running, TRUE);
+        g_thread_pool_push (stream_pool, gst_object_ref (src), NULL);
+    }
+
+    return ret;
+}
+
+static void pooled_src_class_init (PooledSrcClass *klass)
+{
+    GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+    element_class->change_state = pooled_src_change_state;
+    gst_element_class_add_static_pad_template (element_class, &pooled_src_template);
+    gst_element_class_set_static_metadata (element_class, "Pooled source", "Source/Video",
+            "Replays the cached access units from a shared thread pool", "local");
+}
+
+static void pooled_src_init (PooledSrc *src)
+{
+    src->srcpad = gst_pad_new_from_static_template (&pooled_src_template, "src");
+    gst_pad_set_query_function (src->srcpad, pooled_src_query);
+    gst_element_add_pad (GST_ELEMENT (src), src->srcpad);
+}
+
+static GstElement *pooled_src_new (decoder_data *data, const gchar *filename)
 {
-    GstElement *bin = (GstElement *) data;
+    PooledSrc *src;
+
+    if (!au_cache_load (filename))
+        return NULL;
+
+    src = (PooledSrc *) g_object_new (pooled_src_get_type (), "name", "file-source", NULL);
+    src->data = data;
+
+    return GST_ELEMENT (src);
+}
+#endif
+#endif
+
+void init_decoder_data (decoder_data *dec_data, GstElement *decoder)
+{
+    memset (dec_data, 0, sizeof (decoder_data));
+    dec_data->prev_accumulated_base = 0;
+    dec_data->accumulated_base = 0;
+    dec_data->decoder = decoder;
+#ifdef MIGRATION_TEST
+    dec_data->last_pts = GST_CLOCK_TIME_NONE;
+    dec_data->last_key_pts = GST_CLOCK_TIME_NONE;
+#endif
+}
+
+/* Takes the source, not its decoder: a swap may replace the decoder
+ * before this runs. */
+static gboolean seek_decode (gpointer u_data)
+{
+    decoder_data *data = (decoder_data *) u_data;
+    GstElement *bin = data->decoder;
     gboolean ret = TRUE;
 
     gst_element_set_state (bin, GST_STATE_PAUSED);
@@ -51,20 +492,6 @@ static gboolean seek_decode (gpointer data)
     return FALSE;
 }
 
-typedef struct _decoder_data
-{
-    guint64 prev_accumulated_base;
-    guint64 accumulated_base;
-    GstElement *decoder;
-}decoder_data;
-
-void init_decoder_data (decoder_data *dec_data, GstElement *decoder)
-{
-    dec_data->prev_accumulated_base = 0;
-    dec_data->accumulated_base = 0;
-    dec_data->decoder = decoder;
-}
-
 static GstPadProbeReturn restart_stream_buf_prob (GstPad * pad, GstPadProbeInfo * info, gpointer u_data)
 {
   GstEvent *event = GST_EVENT (info->data);
@@ -80,17 +507,21 @@ static GstPadProbeReturn restart_stream_buf_prob (GstPad * pad, GstPadProbeInfo
   {
     if (GST_EVENT_TYPE (event) == GST_EVENT_EOS)
     {
-      g_timeout_add (1, seek_decode, data->decoder);
+      g_timeout_add (1, seek_decode, data);
     }
 
-    if (GST_EVENT_TYPE (event) == GST_EVENT_SEGMENT)
+    if (GST_EVENT_TYPE (event) == GST_EVENT_SEGMENT && gst_event_get_seqnum (event) != data->segment_seqnum)
     {
         GstSegment *segment;
 
+        data->segment_seqnum = gst_event_get_seqnum (event);
+
         gst_event_parse_segment (event, (const GstSegment **) &segment);
         segment->base = data->accumulated_base;
         data->prev_accumulated_base = data->accumulated_base;
         data->accumulated_base += segment->stop;
+        if (data->prev_accumulated_base)
+            loop_boundary (data, data->prev_accumulated_base);
     }
 
     switch (GST_EVENT_TYPE (event))
@@ -171,93 +602,458 @@ static gboolean bus_call (GstBus * bus, GstMessage * msg, gpointer data)
 }
 
 unsigned int cpu_percent_utilization = 0;
-long int sum = 0, lastSum = 0, idle = 0, lastIdle = 0;
 
-static int get_cpu_percentage_utilization ()
+/* utilization comes from a background sampler, creating a source only
+ * reads its last snapshot. With USE_FAKE_METRICS the values are set by
+ * hand, e.g. to exercise the software decoder path without a loaded GPU. */
+//#define USE_FAKE_METRICS
+#define FAKE_NVDEC_UTILIZATION 100
+#define FAKE_CPU_UTILIZATION 50
+MetricsSampler *metrics = NULL;
+
+decoder_data *dec_data[300];
+
+#ifdef USE_ADAPTIVE_BATCHING
+typedef struct _source_arrival
+{
+    /* monotonic us of the last buffer, 0 before the first */
+    gint64 last;
+    /* RFC 3550 style running averages, us */
+    gint64 interval;
+    gint64 jitter;
+}source_arrival;
+
+source_arrival arrival[300];
+/* arrival of the oldest frame waiting for the next batch */
+gint64 batch_first_arrival = 0;
+gint batch_size_current = 200;
+gint push_timeout_current = 33333;
+/* percent of batch-size filled, and us the oldest frame waited */
+HdrHistogram batch_fill, batch_wait;
+
+static GstPadProbeReturn arrival_probe (GstPad * pad, GstPadProbeInfo * info, gpointer u_data)
 {
-    int i = 0;
-    char str[100];
-    const char d[2] = " ";
-    char* token;
+    source_arrival *src = (source_arrival *) u_data;
+    gint64 now = g_get_monotonic_time ();
+    gint64 zero = 0;
+
+    if (src->last)
+    {
+        gint64 d = now - src->last;
+        gint64 interval = __atomic_load_n (&src->interval, __ATOMIC_RELAXED);
+
+        if (interval == 0)
+            interval = d;
+        __atomic_store_n (&src->jitter, src->jitter + ((d > interval ? d - interval : interval - d) - src->jitter) / 16,
+                __ATOMIC_RELAXED);
+        __atomic_store_n (&src->interval, interval + (d - interval) / 16, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n (&src->last, now, __ATOMIC_RELAXED);
 
-    long double idleFraction;
-    FILE* fp = fopen("/proc/stat","r");
-    i = 0;
-    fgets(str,100,fp);
-    fclose(fp);
-    token = strtok(str,d);
-    sum = 0;
+    __atomic_compare_exchange_n (&batch_first_arrival, &zero, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
 
-    while(token!=NULL)
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn batch_probe (GstPad * pad, GstPadProbeInfo * info, gpointer u_data)
+{
+    NvDsBatchMeta *batch_meta = gst_buffer_get_nvds_batch_meta (GST_BUFFER (info->data));
+    gint64 first = __atomic_exchange_n (&batch_first_arrival, 0, __ATOMIC_RELAXED);
+    gint batch_size = __atomic_load_n (&batch_size_current, __ATOMIC_RELAXED);
+
+    if (first)
+        hdr_record (&batch_wait, g_get_monotonic_time () - first);
+    if (batch_meta && batch_size > 0)
+        hdr_record (&batch_fill, batch_meta->num_frames_in_batch * 100 / batch_size);
+
+    return GST_PAD_PROBE_OK;
+}
+
+static void add_arrival_probe (GstPad *sinkpad, guint source_id)
+{
+    memset (&arrival[source_id], 0, sizeof (source_arrival));
+    gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_BUFFER, arrival_probe, &arrival[source_id], NULL);
+}
+
+/* Only writes a property when it moves by more than an eighth, every
+ * change costs nvstreammux a lock round trip and resets its timer. */
+static gboolean retune_needed (gint cur, gint want)
+{
+    return want != cur && (want - cur > cur / 8 || cur - want > cur / 8);
+}
+
+static gboolean batch_controller (gpointer data)
+{
+    gint64 now = g_get_monotonic_time ();
+    gint64 timeout = BATCH_MIN_TIMEOUT_US;
+    gint active = 0, i;
+    HdrHistogram fill, wait;
+
+    for (i = 0; i < g_num_sources; i++)
     {
-        token = strtok(NULL,d);
-        if(token!=NULL)
-        {
-            sum += atoi(token);
-            if(i==3)
-            {
-                idle = atoi(token);
-            }
+        gint64 last = __atomic_load_n (&arrival[i].last, __ATOMIC_RELAXED);
+        gint64 interval = __atomic_load_n (&arrival[i].interval, __ATOMIC_RELAXED);
+        gint64 jitter = __atomic_load_n (&arrival[i].jitter, __ATOMIC_RELAXED);
 
-            i++;
-        }
+        /* a source that missed four of its own frames is not waited for */
+        if (!last || interval == 0 || now - last > 4 * interval + BATCH_MIN_TIMEOUT_US)
+            continue;
+
+        active++;
+        timeout = MAX (timeout, interval + 4 * jitter);
     }
-    idleFraction = 100 - (idle-lastIdle)*100.0/(sum-lastSum);
-    //printf("Busy for : %lf %% of the time.", idleFraction);
 
-    lastIdle = idle;
-    lastSum = sum;
+#ifndef BATCH_TARGET_THROUGHPUT
+    timeout = MIN (timeout, BATCH_TARGET_LATENCY_US);
+#endif
 
-    return idleFraction;
-}
+    if (active > 0 && retune_needed (batch_size_current, active))
+    {
+        g_object_set (G_OBJECT (streammux), "batch-size", active, NULL);
+        __atomic_store_n (&batch_size_current, active, __ATOMIC_RELAXED);
+    }
+    if (active > 0 && retune_needed (push_timeout_current, (gint) timeout))
+    {
+        g_object_set (G_OBJECT (streammux), "batched-push-timeout", (gint) timeout, NULL);
+        push_timeout_current = (gint) timeout;
+    }
 
+    hdr_take (&batch_fill, &fill);
+    hdr_take (&batch_wait, &wait);
+    g_print ("batching: %d/%d sources active, batch-size %d, timeout %d us, "
+            "fill p50 %lu%% p10 %lu%%, wait p50 %.1f p99 %.1f max %.1f ms\n",
+            active, g_num_sources, batch_size_current, push_timeout_current,
+            (unsigned long) hdr_percentile (&fill, 50), (unsigned long) hdr_percentile (&fill, 10),
+            hdr_percentile (&wait, 50) / 1e3, hdr_percentile (&wait, 99) / 1e3, hdr_max (&wait) / 1e3);
 
-decoder_data *dec_data[300];
+    return TRUE;
+}
+#endif
 gboolean sw_decode = false;
 
 unsigned int nvdec_percent_utilization = 0;
 
-static int get_nvdec_percentage_utilization ()
+unsigned int hw_decoder = 0;
+unsigned int sw_decoder = 0;
+
+#ifdef USE_ADMISSION_CONTROL
+typedef struct _admission_cost
+{
+    gchar codec[32];
+    /* percent per megapixel/s */
+    gdouble nvdec;
+    gdouble hw_cpu;
+    gdouble sw_cpu;
+}admission_cost;
+
+typedef struct _admission_stream
 {
-    FILE *fp;
-    char str[1024] = {0};
+    gchar codec[32];
+    gint width;
+    gint height;
+    gdouble fps;
+    gboolean hw;
+    /* decoded frames, counted on the decoder's streaming thread */
+    guint64 frames;
+    guint64 last_frames;
+    /* set when only some of the access units get decoded */
+    const KeyframeFilter *keyframes;
+}admission_stream;
+
+/* protects the caps fields of admission_streams */
+G_LOCK_DEFINE_STATIC (admission);
+admission_stream admission_streams[300];
+admission_cost admission_costs[8];
+gint admission_num_costs = 0;
+
+/* waiting sources, each entry holds the monotonic us of its request */
+GQueue admission_queue = G_QUEUE_INIT;
+/* requests not admitted on the tick they arrived, counted once each, and
+ * those of them that found the queue full and were dropped */
+guint admission_rejected = 0;
+guint admission_dropped = 0;
+gint admission_below_slo = 0;
+gint64 admission_last_report = 0;
+/* source whose cost is being measured, -1 for none */
+gint admission_measuring = -1;
+gint64 admission_measure_start = 0;
+gdouble admission_before_nvdec = 0, admission_before_cpu = 0;
+
+static admission_cost *admission_cost_lookup (const gchar *codec)
+{
+    admission_cost *cost;
+    gint i;
 
-    fp = popen ("/usr/bin/nvidia-smi -q | grep Decoder", "r");
-    if (fp == NULL)
+    for (i = 0; i < admission_num_costs; i++)
     {
-        printf ("failed to run command\n");
-        return -1;
+        if (!strcmp (admission_costs[i].codec, codec))
+            return &admission_costs[i];
     }
+    if (admission_num_costs == G_N_ELEMENTS (admission_costs))
+        return &admission_costs[0];
 
-#if 0
-    if (fgets (str, sizeof(str), fp) != NULL)
-        printf ("%s\n", str);
-    else
-        printf ("nothing in the string\n");
-#else
-    if (fgets (str, sizeof(str), fp) == NULL)
-        printf ("nothing in the string\n");
-#endif
+    cost = &admission_costs[admission_num_costs++];
+    g_strlcpy (cost->codec, codec, sizeof (cost->codec));
+    cost->nvdec = ADMISSION_DEFAULT_NVDEC_COST;
+    cost->hw_cpu = ADMISSION_DEFAULT_HW_CPU_COST;
+    cost->sw_cpu = ADMISSION_DEFAULT_SW_CPU_COST;
+
+    return cost;
+}
+
+static gdouble admission_mpixels (const admission_stream *stream)
+{
+    gdouble fraction = stream->keyframes ? keyframe_filter_fraction (stream->keyframes) : 1.0;
+
+    return stream->width * (gdouble) stream->height * stream->fps * fraction / 1e6;
+}
+
+static GstPadProbeReturn admission_caps_probe (GstPad * pad, GstPadProbeInfo * info, gpointer u_data)
+{
+    admission_stream *stream = (admission_stream *) u_data;
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+    GstStructure *st;
+    GstCaps *caps;
+    gint num, den;
+
+    if (GST_EVENT_TYPE (event) != GST_EVENT_CAPS)
+        return GST_PAD_PROBE_OK;
+
+    gst_event_parse_caps (event, &caps);
+    st = gst_caps_get_structure (caps, 0);
+
+    G_LOCK (admission);
+    g_strlcpy (stream->codec, gst_structure_get_name (st), sizeof (stream->codec));
+    gst_structure_get_int (st, "width", &stream->width);
+    gst_structure_get_int (st, "height", &stream->height);
+    if (gst_structure_get_fraction (st, "framerate", &num, &den) && num > 0 && den > 0)
+        stream->fps = (gdouble) num / den;
+    G_UNLOCK (admission);
+
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn admission_frame_probe (GstPad * pad, GstPadProbeInfo * info, gpointer u_data)
+{
+    admission_stream *stream = (admission_stream *) u_data;
+
+    __atomic_fetch_add (&stream->frames, 1, __ATOMIC_RELAXED);
+
+    return GST_PAD_PROBE_OK;
+}
+
+/* Counts the frames and reads the caps of @decoder for stream @index, again
+ * for every decoder a migration puts in. */
+static void admission_stream_attach (guint index, GstElement *decoder)
+{
+    admission_stream *stream = &admission_streams[index];
+    gulong probe_id;
+
+    NVGSTDS_ELEM_ADD_PROBE (probe_id, decoder, "sink", admission_caps_probe,
+            GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, stream);
+    NVGSTDS_ELEM_ADD_PROBE (probe_id, decoder, "src", admission_frame_probe,
+            GST_PAD_PROBE_TYPE_BUFFER, stream);
+}
+
+static void admission_stream_init (guint index, GstElement *decoder)
+{
+    admission_stream *stream = &admission_streams[index];
+
+    G_LOCK (admission);
+    memset (stream, 0, sizeof (admission_stream));
+    g_strlcpy (stream->codec, "video/x-h264", sizeof (stream->codec));
+    stream->width = ADMISSION_DEFAULT_WIDTH;
+    stream->height = ADMISSION_DEFAULT_HEIGHT;
+    stream->fps = ADMISSION_DEFAULT_FPS;
+    stream->hw = !sw_decode;
+    G_UNLOCK (admission);
+
+    admission_stream_attach (index, decoder);
+}
+
+/* Folds the load change since the last admission into the cost of its
+ * codec once the new stream had time to settle. */
+static void admission_learn (const MetricsSnapshot *m)
+{
+    admission_stream stream;
+    admission_cost *cost;
+    gdouble mp;
 
+    if (admission_measuring < 0 ||
+            g_get_monotonic_time () - admission_measure_start < ADMISSION_SETTLE_S * G_TIME_SPAN_SECOND)
+        return;
 
-    char *tmp = str;
-    while (*tmp != '%')
+    G_LOCK (admission);
+    stream = admission_streams[admission_measuring];
+    G_UNLOCK (admission);
+
+    cost = admission_cost_lookup (stream.codec);
+    mp = admission_mpixels (&stream);
+    if (mp > 0)
     {
-        if (isdigit (*tmp))
+        gdouble nvdec = MAX (0, m->value[METRIC_NVDEC] - admission_before_nvdec) / mp;
+        gdouble cpu = MAX (0, m->value[METRIC_CPU] - admission_before_cpu) / mp;
+
+        if (stream.hw)
         {
-            nvdec_percent_utilization = atoi(tmp);
-            break;
+            if (m->valid[METRIC_NVDEC])
+                cost->nvdec += ADMISSION_LEARN_ALPHA * (nvdec - cost->nvdec);
+            cost->hw_cpu += ADMISSION_LEARN_ALPHA * (cpu - cost->hw_cpu);
         }
-        tmp++;
+        else
+            cost->sw_cpu += ADMISSION_LEARN_ALPHA * (cpu - cost->sw_cpu);
     }
+    admission_measuring = -1;
+}
 
-    pclose (fp);
+/* Frame rate of every stream over the last interval against the SLO. */
+static void admission_report (const MetricsSnapshot *m)
+{
+    gint64 now = g_get_monotonic_time ();
+    gdouble elapsed = (now - admission_last_report) / 1e6;
+    gdouble min_fps = 0;
+    gint i, measured = 0;
 
-    return nvdec_percent_utilization;
+    admission_below_slo = 0;
+    if (admission_last_report == 0)
+    {
+        admission_last_report = now;
+        return;
+    }
+    admission_last_report = now;
+
+    for (i = 0; i < g_num_sources; i++)
+    {
+        admission_stream *stream = &admission_streams[i];
+        guint64 frames = __atomic_load_n (&stream->frames, __ATOMIC_RELAXED);
+        gdouble fps = (frames - stream->last_frames) / elapsed;
+
+        stream->last_frames = frames;
+        /* a stream that was just added is still prerolling */
+        if (i == admission_measuring)
+            continue;
+        if (stream->keyframes && stream->keyframes->interval)
+            continue;
+        if (fps < ADMISSION_SLO_FPS)
+            admission_below_slo++;
+        min_fps = measured++ ? MIN (min_fps, fps) : fps;
+    }
+
+    g_print ("admission: %d streams, %d below %d fps, min %.1f fps (%.0f%% of SLO), "
+            "nvdec %.0f%% cpu %.0f%%, %u queued, %u rejected, %u dropped\n",
+            g_num_sources, admission_below_slo, ADMISSION_SLO_FPS, min_fps, min_fps * 100 / ADMISSION_SLO_FPS,
+            m->value[METRIC_NVDEC], m->value[METRIC_CPU], admission_queue.length, admission_rejected,
+            admission_dropped);
 }
 
-unsigned int hw_decoder = 0;
-unsigned int sw_decoder = 0;
+/* Decides whether the next source fits and whether it gets the hardware
+ * or the software decoder, through sw_decode. */
+static gboolean admission_admit (gint source_id, const MetricsSnapshot *m)
+{
+    admission_stream next;
+    admission_cost *cost;
+    gdouble mp, hw_nvdec, hw_cpu, sw_cpu;
+
+    /* the previous stream's cost is not known yet */
+    if (admission_measuring >= 0 || admission_below_slo > 0 || source_id >= (gint) G_N_ELEMENTS (admission_streams))
+        return FALSE;
+
+    /* all sources play the same file, predict from the last one */
+    G_LOCK (admission);
+    if (source_id > 0)
+        next = admission_streams[source_id - 1];
+    else
+    {
+        memset (&next, 0, sizeof (next));
+        g_strlcpy (next.codec, "video/x-h264", sizeof (next.codec));
+        next.width = ADMISSION_DEFAULT_WIDTH;
+        next.height = ADMISSION_DEFAULT_HEIGHT;
+        next.fps = ADMISSION_DEFAULT_FPS;
+    }
+    G_UNLOCK (admission);
+
+    cost = admission_cost_lookup (next.codec);
+    mp = admission_mpixels (&next);
+    hw_nvdec = m->value[METRIC_NVDEC] + cost->nvdec * mp;
+    hw_cpu = m->value[METRIC_CPU] + cost->hw_cpu * mp;
+    sw_cpu = m->value[METRIC_CPU] + cost->sw_cpu * mp;
+
+    if (hw_nvdec <= ADMISSION_NVDEC_LIMIT && hw_cpu <= ADMISSION_CPU_LIMIT)
+        sw_decode = false;
+    else if (sw_cpu <= ADMISSION_CPU_LIMIT)
+        sw_decode = true;
+    else
+        return FALSE;
+
+    g_print ("admitting source %d %s %dx%d@%.0f on %s, predicted nvdec %.0f%% cpu %.0f%%\n",
+            source_id, next.codec, next.width, next.height, next.fps, sw_decode ? "sw" : "hw",
+            sw_decode ? m->value[METRIC_NVDEC] : hw_nvdec, sw_decode ? sw_cpu : hw_cpu);
+
+    admission_measuring = source_id;
+    admission_measure_start = g_get_monotonic_time ();
+    admission_before_nvdec = m->value[METRIC_NVDEC];
+    admission_before_cpu = m->value[METRIC_CPU];
+
+    return TRUE;
+}
+#endif
+
+/* With the shared pool libav must not start a thread per core for every
+ * decoder, it decodes on the pool thread that pushed the frame. */
+static void configure_decoder (GstElement *decoder)
+{
+#ifdef USE_THREAD_POOL
+    if (decoder && g_str_has_prefix (GST_OBJECT_NAME (gst_element_get_factory (decoder)), "avdec_"))
+        g_object_set (G_OBJECT (decoder), "max-threads", 1, NULL);
+#endif
+}
+
+/* avdec_h264 outputs system memory, have nvvideoconvert upload it */
+static void set_sw_decode_caps (GstElement *capsfilter)
+{
+    GstCaps *caps;
+    GstCapsFeatures *feature;
+    caps = gst_caps_new_simple ("video/x-raw", "format", G_TYPE_STRING, "NV12", "width", G_TYPE_INT, 640, "height", G_TYPE_INT, 480, NULL);
+    feature = gst_caps_features_new ("memory:NVMM", NULL);
+    gst_caps_set_features (caps, 0, feature);
+
+    g_object_set (G_OBJECT(capsfilter), "caps", caps, NULL);
+    gst_caps_unref (caps);
+}
+
+#ifdef MIGRATION_TEST
+static GstPadProbeReturn gop_probe (GstPad * pad, GstPadProbeInfo * info, gpointer u_data)
+{
+    decoder_data *data = (decoder_data *) u_data;
+    GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER (info);
+    GstClockTime pts = GST_BUFFER_PTS (buf);
+
+    if (GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT) || !GST_CLOCK_TIME_IS_VALID (pts))
+        return GST_PAD_PROBE_OK;
+
+    /* the file loops, the PTS here are not rebased yet */
+    if (GST_CLOCK_TIME_IS_VALID (data->last_key_pts) && pts > data->last_key_pts)
+        data->gop = MAX (data->gop, pts - data->last_key_pts);
+    data->last_key_pts = pts;
+
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn output_gap_probe (GstPad * pad, GstPadProbeInfo * info, gpointer u_data)
+{
+    decoder_data *data = (decoder_data *) u_data;
+    GstClockTime pts = GST_BUFFER_PTS (GST_PAD_PROBE_INFO_BUFFER (info));
+
+    if (!GST_CLOCK_TIME_IS_VALID (pts))
+        return GST_PAD_PROBE_OK;
+
+    if (GST_CLOCK_TIME_IS_VALID (data->last_pts) && pts > data->last_pts)
+        data->max_gap = MAX (data->max_gap, pts - data->last_pts);
+    data->last_pts = pts;
+
+    return GST_PAD_PROBE_OK;
+}
+#endif
 
 static GstElement *create_source_bin (guint index, gchar *filename)
 {
@@ -273,25 +1069,33 @@ static GstElement *create_source_bin (guint index, gchar *filename)
     g_snprintf (bin_name, 15, "source-bin-%02d", index);
     bin = gst_bin_new (bin_name);
 
+#ifdef USE_THREAD_POOL
+    source = pooled_src_new (dec_data[index], filename);
+#elif defined(USE_MEMORY_LOOP)
+    source = gst_element_factory_make ("appsrc", "file-source");
+#else
     source = gst_element_factory_make ("filesrc", "file-source");
+#endif
 
     h264parser = gst_element_factory_make ("h264parse", "h264-parser");
 
-    nvdec_percent_utilization = get_nvdec_percentage_utilization ();
+    nvdec_percent_utilization = metrics_sampler_get (metrics, METRIC_NVDEC);
     printf ("nvdec utilization = %d \n", nvdec_percent_utilization);
 
-    cpu_percent_utilization = get_cpu_percentage_utilization ();
+    cpu_percent_utilization = metrics_sampler_get (metrics, METRIC_CPU);
     printf ("cpu   utilization = %d \n", cpu_percent_utilization);
 
+#ifndef USE_ADMISSION_CONTROL
     if (nvdec_percent_utilization > 99)
         sw_decode = true;
     else
         sw_decode = false;
+#endif
 
     //sw_decode = true;
     if (sw_decode == false)
     {
-        decoder = gst_element_factory_make ("nvv4l2decoder", "nvv4l2decoder");
+        decoder = gst_element_factory_make (HW_DECODER_FACTORY, "nvv4l2decoder");
         hw_decoder++;
     }
     else
@@ -300,21 +1104,14 @@ static GstElement *create_source_bin (guint index, gchar *filename)
         decoder = gst_element_factory_make ("avdec_h264", "avdec_h264");
         sw_decoder++;
     }
+    configure_decoder (decoder);
 
     nvvideoconvert = gst_element_factory_make ("nvvideoconvert", "nvvideoconvert");
 
     capsfilter = gst_element_factory_make ("capsfilter", "caps-filter");
 
     if (sw_decode == true)
-    {
-        GstCaps *caps;
-        GstCapsFeatures *feature;
-        caps = gst_caps_new_simple ("video/x-raw", "format", G_TYPE_STRING, "NV12", "width", G_TYPE_INT, 640, "height", G_TYPE_INT, 480, NULL);
-        feature = gst_caps_features_new ("memory:NVMM", NULL);
-        gst_caps_set_features (caps, 0, feature);
-
-        g_object_set (G_OBJECT(capsfilter), "caps", caps, NULL);
-    }
+        set_sw_decode_caps (capsfilter);
 
     if (!bin || !source || !h264parser || !decoder || !nvvideoconvert || !capsfilter)
     {
@@ -323,14 +1120,50 @@ static GstElement *create_source_bin (guint index, gchar *filename)
     }
 
     init_decoder_data (dec_data[index], decoder);
-    gulong src_buffer_probe;
-    NVGSTDS_ELEM_ADD_PROBE (src_buffer_probe, decoder,
+    dec_data[index]->index = index;
+    dec_data[index]->bin = bin;
+    dec_data[index]->parser = h264parser;
+    dec_data[index]->sw = sw_decode;
+    /* SPS/PPS with every IDR, a decoder swapped in at a keyframe needs them */
+    g_object_set (G_OBJECT (h264parser), "config-interval", -1, NULL);
+#ifdef USE_KEYFRAME_ONLY
+    /* ahead of any probe migrate_source () puts on the same pad */
+    keyframe_filter_init (&dec_data[index]->keyframes,
+            index % KEYFRAME_ONLY_SOURCE_STRIDE == 0 ? KEYFRAME_ONLY_GOP_INTERVAL : 0);
+    gulong keyframe_probe;
+    NVGSTDS_ELEM_ADD_PROBE (keyframe_probe, h264parser, "src", keyframe_filter_probe, GST_PAD_PROBE_TYPE_BUFFER,
+            &dec_data[index]->keyframes);
+#endif
+#ifdef USE_THREAD_POOL
+    /* pooled_src_new () already loaded the cache */
+#elif defined(USE_MEMORY_LOOP)
+    if (!memory_loop_setup (dec_data[index], source, filename))
+        return NULL;
+#else
+    NVGSTDS_ELEM_ADD_PROBE (dec_data[index]->restart_probe, decoder,
             "sink", restart_stream_buf_prob,
             (GstPadProbeType) (GST_PAD_PROBE_TYPE_EVENT_BOTH | GST_PAD_PROBE_TYPE_EVENT_FLUSH | GST_PAD_PROBE_TYPE_BUFFER),
             dec_data[index]);
+#endif
+    gulong stall_probe;
+    NVGSTDS_ELEM_ADD_PROBE (stall_probe, capsfilter, "src", loop_stall_probe, GST_PAD_PROBE_TYPE_BUFFER,
+            dec_data[index]);
+#ifdef USE_ADMISSION_CONTROL
+    admission_stream_init (index, decoder);
+#ifdef USE_KEYFRAME_ONLY
+    admission_streams[index].keyframes = &dec_data[index]->keyframes;
+#endif
+#endif
+#ifdef MIGRATION_TEST
+    gulong test_probe;
+    NVGSTDS_ELEM_ADD_PROBE (test_probe, h264parser, "src", gop_probe, GST_PAD_PROBE_TYPE_BUFFER, dec_data[index]);
+    NVGSTDS_ELEM_ADD_PROBE (test_probe, capsfilter, "src", output_gap_probe, GST_PAD_PROBE_TYPE_BUFFER, dec_data[index]);
+#endif
 
+#ifndef USE_MEMORY_LOOP
     /* We set the input filename to the source element */
     g_object_set (G_OBJECT (source), "location", filename, NULL);
+#endif
 
     gst_bin_add_many (GST_BIN (bin), source, h264parser, decoder, nvvideoconvert, capsfilter,  NULL);
 
@@ -359,6 +1192,287 @@ static GstElement *create_source_bin (guint index, gchar *filename)
     return bin;
 }
 
+static gboolean migrate_finish (gpointer user_data)
+{
+    decoder_data *data = (decoder_data *) user_data;
+    GstElement *old = data->decoder, *decoder, *convert, *capsfilter;
+    GstPad *pad;
+
+    convert = gst_bin_get_by_name (GST_BIN (data->bin), "nvvideoconvert");
+    capsfilter = gst_bin_get_by_name (GST_BIN (data->bin), "caps-filter");
+
+    gst_element_set_state (old, GST_STATE_NULL);
+    gst_bin_remove (GST_BIN (data->bin), old);
+
+    decoder = gst_element_factory_make (data->target_sw ? "avdec_h264" : HW_DECODER_FACTORY, NULL);
+    if (!decoder)
+    {
+        g_printerr ("source %u: could not create the new decoder\n", data->index);
+        g_main_loop_quit (loop);
+        goto done;
+    }
+    configure_decoder (decoder);
+    if (data->target_sw)
+        set_sw_decode_caps (capsfilter);
+    else
+        /* back to the ANY caps create_source_bin gives a hw source */
+        g_object_set (G_OBJECT (capsfilter), "caps", NULL, NULL);
+
+    gst_bin_add (GST_BIN (data->bin), decoder);
+    if (!gst_element_link_many (data->parser, decoder, convert, NULL))
+    {
+        g_printerr ("source %u: could not link the new decoder\n", data->index);
+        g_main_loop_quit (loop);
+        goto done;
+    }
+
+    data->decoder = decoder;
+#ifndef USE_MEMORY_LOOP
+    NVGSTDS_ELEM_ADD_PROBE (data->restart_probe, decoder,
+            "sink", restart_stream_buf_prob,
+            (GstPadProbeType) (GST_PAD_PROBE_TYPE_EVENT_BOTH | GST_PAD_PROBE_TYPE_EVENT_FLUSH | GST_PAD_PROBE_TYPE_BUFFER),
+            data);
+#endif
+#ifdef USE_ADMISSION_CONTROL
+    admission_stream_attach (data->index, decoder);
+#endif
+    gst_element_sync_state_with_parent (decoder);
+
+    if (data->target_sw)
+    {
+        hw_decoder--;
+        sw_decoder++;
+    }
+    else
+    {
+        sw_decoder--;
+        hw_decoder++;
+    }
+    data->sw = data->target_sw;
+#ifdef USE_ADMISSION_CONTROL
+    admission_streams[data->index].hw = !data->sw;
+#endif
+
+    g_print ("source %u: moved to the %s decoder in %.1f ms, HW decoders used = %d SW decoders used = %d\n",
+            data->index, data->sw ? "sw" : "hw", (g_get_monotonic_time () - data->migrate_start) / 1e3,
+            hw_decoder, sw_decoder);
+
+done:
+    /* the keyframe the parser held back goes into the new decoder */
+    pad = gst_element_get_static_pad (data->parser, "src");
+    gst_pad_remove_probe (pad, data->block_probe);
+    gst_object_unref (pad);
+    data->migrating = FALSE;
+    data->draining = FALSE;
+
+    gst_object_unref (convert);
+    gst_object_unref (capsfilter);
+
+    return FALSE;
+}
+
+/* On the old decoder's streaming thread, it must not be stopped from here. */
+static GstPadProbeReturn migrate_eos_probe (GstPad * pad, GstPadProbeInfo * info, gpointer u_data)
+{
+    if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) != GST_EVENT_EOS)
+        return GST_PAD_PROBE_OK;
+
+    g_idle_add (migrate_finish, u_data);
+
+    return GST_PAD_PROBE_DROP;
+}
+
+static GstPadProbeReturn migrate_block_probe (GstPad * pad, GstPadProbeInfo * info, gpointer u_data)
+{
+    decoder_data *data = (decoder_data *) u_data;
+    GstPad *decoder_pad;
+
+    if (GST_BUFFER_FLAG_IS_SET (GST_PAD_PROBE_INFO_BUFFER (info), GST_BUFFER_FLAG_DELTA_UNIT))
+        return GST_PAD_PROBE_PASS;
+    if (data->draining)
+        return GST_PAD_PROBE_OK;
+
+    /* Blocked in front of a keyframe: push out what the old decoder still
+     * holds. The looping probe would turn the EOS into a seek, take it off
+     * first. */
+    data->draining = TRUE;
+    if (data->restart_probe)
+    {
+        decoder_pad = gst_element_get_static_pad (data->decoder, "sink");
+        gst_pad_remove_probe (decoder_pad, data->restart_probe);
+        gst_object_unref (decoder_pad);
+        data->restart_probe = 0;
+    }
+
+    decoder_pad = gst_element_get_static_pad (data->decoder, "src");
+    gst_pad_add_probe (decoder_pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, migrate_eos_probe, data, NULL);
+    gst_object_unref (decoder_pad);
+
+    decoder_pad = gst_element_get_static_pad (data->decoder, "sink");
+    gst_pad_send_event (decoder_pad, gst_event_new_eos ());
+    gst_object_unref (decoder_pad);
+
+    return GST_PAD_PROBE_OK;
+}
+
+/* Swaps the decoder of a running source at its next keyframe, from the
+ * main loop. Returns FALSE when the source is already being moved. */
+static gboolean migrate_source (guint index, gboolean to_sw)
+{
+    decoder_data *data = dec_data[index];
+    GstPad *pad;
+
+    if (data->migrating || data->sw == to_sw)
+        return FALSE;
+
+    data->migrating = TRUE;
+    data->target_sw = to_sw;
+    data->migrate_start = g_get_monotonic_time ();
+
+    pad = gst_element_get_static_pad (data->parser, "src");
+    data->block_probe = gst_pad_add_probe (pad,
+            (GstPadProbeType) (GST_PAD_PROBE_TYPE_BLOCK | GST_PAD_PROBE_TYPE_BUFFER),
+            migrate_block_probe, data, NULL);
+    gst_object_unref (pad);
+
+    return TRUE;
+}
+
+#ifdef USE_DECODER_REBALANCER
+static gboolean migration_pending (void)
+{
+    gint i;
+
+    for (i = 0; i < g_num_sources; i++)
+    {
+        if (dec_data[i]->migrating)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* last source on the given decoder, -1 for none */
+static gint find_source_on (gboolean sw)
+{
+    gint i;
+
+    for (i = g_num_sources - 1; i >= 0; i--)
+    {
+        if (dec_data[i]->sw == sw)
+            return i;
+    }
+
+    return -1;
+}
+
+#ifdef MIGRATION_TEST
+static gboolean rebalance (gpointer user_data)
+{
+    static gint next = 0, last = -1;
+    decoder_data *data;
+
+    if (g_num_sources == 0 || migration_pending ())
+        return TRUE;
+
+    if (last >= 0)
+    {
+        data = dec_data[last];
+        g_print ("source %d: max output gap %.1f ms, GOP %.1f ms, %s\n", last,
+                data->max_gap / 1e6, data->gop / 1e6, data->max_gap <= data->gop ? "OK" : "GAP LONGER THAN A GOP");
+    }
+
+    last = next;
+    data = dec_data[last];
+    data->max_gap = 0;
+    migrate_source (last, !data->sw);
+    next = (next + 1) % g_num_sources;
+
+    return TRUE;
+}
+#else
+static gboolean rebalance (gpointer user_data)
+{
+    MetricsSnapshot m;
+    gdouble nvdec, cpu;
+    gint index = -1;
+    gboolean to_sw = FALSE;
+
+    if (migration_pending ())
+        return TRUE;
+
+    metrics_sampler_read (metrics, &m);
+    nvdec = m.value[METRIC_NVDEC];
+    cpu = m.value[METRIC_CPU];
+
+    if (nvdec > REBALANCE_NVDEC_HIGH && cpu < REBALANCE_CPU_HIGH)
+    {
+        index = find_source_on (FALSE);
+        to_sw = TRUE;
+    }
+    else if (cpu > REBALANCE_CPU_HIGH && nvdec < REBALANCE_NVDEC_HIGH)
+        index = find_source_on (TRUE);
+    /* the hardware decoder is cheaper on the CPU, go back when it has room */
+    else if (nvdec < REBALANCE_NVDEC_LOW)
+        index = find_source_on (TRUE);
+
+    if (index >= 0)
+    {
+        g_print ("rebalance: nvdec %.0f%% cpu %.0f%%, moving source %d to the %s decoder\n",
+                nvdec, cpu, index, to_sw ? "sw" : "hw");
+        migrate_source (index, to_sw);
+    }
+
+    return TRUE;
+}
+#endif
+#endif
+
+static gboolean thread_report (gpointer user_data)
+{
+    MetricsSnapshot m;
+
+    metrics_sampler_read (metrics, &m);
+    g_print ("%s: %d streams, %.0f threads, %.0f context switches/s, RSS %.0f MB, process cpu %.0f%%\n",
+#ifdef USE_THREAD_POOL
+            "thread pool",
+#else
+            "thread per source",
+#endif
+            g_num_sources, m.value[METRIC_THREADS], m.value[METRIC_CTX_SWITCHES], m.value[METRIC_RSS_MB],
+            m.value[METRIC_PROCESS_CPU]);
+
+    return TRUE;
+}
+
+#ifdef USE_KEYFRAME_ONLY
+/* Access units in and decoded over all sources since the start. */
+static gboolean keyframe_report (gpointer user_data)
+{
+    MetricsSnapshot m;
+    guint64 seen = 0, passed = 0;
+    gint i, filtered = 0;
+
+    for (i = 0; i < g_num_sources; i++)
+    {
+        KeyframeFilter *f = &dec_data[i]->keyframes;
+
+        seen += __atomic_load_n (&f->seen, __ATOMIC_RELAXED);
+        passed += __atomic_load_n (&f->passed, __ATOMIC_RELAXED);
+        if (f->interval)
+            filtered++;
+    }
+
+    metrics_sampler_read (metrics, &m);
+    g_print ("keyframe only: %d of %d sources, %lu of %lu access units decoded (1/%.1f), "
+            "HW decoders %u SW decoders %u, process cpu %.0f%%\n",
+            filtered, g_num_sources, (unsigned long) passed, (unsigned long) seen,
+            passed ? (gdouble) seen / passed : 0.0, hw_decoder, sw_decoder, m.value[METRIC_PROCESS_CPU]);
+
+    return TRUE;
+}
+#endif
+
 static gboolean add_sources(gpointer data);
 static gboolean add_sources(gpointer data)
 {
@@ -370,11 +1484,51 @@ static gboolean add_sources(gpointer data)
     GstPad *src_bin_pad = NULL;
 
 
+#ifdef USE_ADMISSION_CONTROL
+    MetricsSnapshot m;
+    gboolean queued = FALSE;
+    gint64 *request;
+
+    metrics_sampler_read (metrics, &m);
+    admission_learn (&m);
+    admission_report (&m);
+
+    /* one new source asks to join every tick */
+    if (admission_queue.length < ADMISSION_MAX_QUEUE)
+    {
+        request = g_new (gint64, 1);
+        *request = g_get_monotonic_time ();
+        g_queue_push_tail (&admission_queue, request);
+        queued = TRUE;
+    }
+    else
+    {
+        g_print ("admission queue full, request dropped\n");
+        admission_dropped++;
+        admission_rejected++;
+    }
+
+    /* the queued requests are retried every tick, but the new one only
+     * counts as rejected on this one */
+    if (!admission_admit (source_id, &m))
+    {
+        if (queued)
+            admission_rejected++;
+        return TRUE;
+    }
+
+    request = (gint64 *) g_queue_pop_head (&admission_queue);
+    if (queued && admission_queue.length > 0)
+        admission_rejected++;
+    g_print ("source %d waited %.1f s for admission\n", source_id, (g_get_monotonic_time () - *request) / 1e6);
+    g_free (request);
+#else
     if (nvdec_percent_utilization > 90 && cpu_percent_utilization > 75)
     {
         printf ("nvdec utilization = %d  CPU utiliztion = %d \n", nvdec_percent_utilization, cpu_percent_utilization);
         return TRUE;
     }
+#endif
     //if (g_num_sources > 300)
         //return TRUE;
 
@@ -390,6 +1544,9 @@ static gboolean add_sources(gpointer data)
 
     g_snprintf (pad_name, 15, "sink_%u", source_id);
     sinkpad = gst_element_get_request_pad (streammux, pad_name);
+#ifdef USE_ADAPTIVE_BATCHING
+    add_arrival_probe (sinkpad, source_id);
+#endif
 
     src_bin_pad = gst_element_get_static_pad (source_bin, "src");
     if (!src_bin_pad)
@@ -451,6 +1608,24 @@ int main (int argc, char *argv[])
 
     /* Standard GStreamer initialization */
     gst_init (&argc, &argv);
+
+    hdr_init (&loop_stall);
+    hdr_init (&frame_gap);
+
+    metrics = metrics_sampler_new (METRICS_INTERVAL_MS);
+#ifdef USE_FAKE_METRICS
+    metrics_fake_set (METRIC_NVDEC, FAKE_NVDEC_UTILIZATION);
+    metrics_fake_set (METRIC_CPU, FAKE_CPU_UTILIZATION);
+    metrics_sampler_add (metrics, metrics_provider_fake ());
+#else
+    metrics_sampler_add (metrics, metrics_provider_proc_stat ());
+    metrics_sampler_add (metrics, metrics_provider_proc_self ());
+    metrics_sampler_add (metrics, metrics_provider_nvml (GPU_ID));
+#endif
+    metrics_sampler_start (metrics);
+#ifdef USE_THREAD_POOL
+    stream_pool = g_thread_pool_new (pooled_src_run, NULL, g_get_num_processors (), TRUE, NULL);
+#endif
     loop = g_main_loop_new (NULL, FALSE);
 
     /* Create gstreamer elements */
@@ -494,6 +1669,9 @@ int main (int argc, char *argv[])
 
         g_snprintf (pad_name, 15, "sink_%u", i);
         sinkpad = gst_element_get_request_pad (streammux, pad_name);
+#ifdef USE_ADAPTIVE_BATCHING
+        add_arrival_probe (sinkpad, i);
+#endif
 
         src_bin_pad = gst_element_get_static_pad (source_bin, "src");
         if (!src_bin_pad)
@@ -551,6 +1729,14 @@ int main (int argc, char *argv[])
 
     g_object_set(G_OBJECT(sink), "sync", FALSE, "qos", FALSE, NULL);
 
+#ifdef USE_ADAPTIVE_BATCHING
+    hdr_init (&batch_fill);
+    hdr_init (&batch_wait);
+    GstPad *mux_src_pad = gst_element_get_static_pad (streammux, "src");
+    gst_pad_add_probe (mux_src_pad, GST_PAD_PROBE_TYPE_BUFFER, batch_probe, NULL, NULL);
+    gst_object_unref (mux_src_pad);
+#endif
+
     gst_element_set_state (pipeline, GST_STATE_PAUSED);
     /* Set the pipeline to "playing" state */
     //g_usleep(100000);
@@ -566,10 +1752,26 @@ int main (int argc, char *argv[])
     /* Wait till pipeline encounters an error or EOS */
     g_print ("Running...\n");
     g_timeout_add_seconds (1, add_sources, (gpointer)g_source_bin_list);
+#ifdef USE_ADAPTIVE_BATCHING
+    g_timeout_add (BATCH_CONTROL_INTERVAL_MS, batch_controller, NULL);
+#endif
+    g_timeout_add_seconds (LOOP_REPORT_INTERVAL_S, loop_report, NULL);
+    g_timeout_add_seconds (LOOP_REPORT_INTERVAL_S, thread_report, NULL);
+#ifdef USE_KEYFRAME_ONLY
+    g_timeout_add_seconds (LOOP_REPORT_INTERVAL_S, keyframe_report, NULL);
+#endif
+#ifdef USE_DECODER_REBALANCER
+#ifdef MIGRATION_TEST
+    g_timeout_add_seconds (MIGRATION_TEST_INTERVAL_S, rebalance, NULL);
+#else
+    g_timeout_add_seconds (REBALANCE_INTERVAL_S, rebalance, NULL);
+#endif
+#endif
     g_main_loop_run (loop);
 
     /* Out of the main loop, clean up nicely */
     g_print ("Returned, stopping playback\n");
+    loop_report (NULL);
     gst_element_set_state (pipeline, GST_STATE_NULL);
     g_print ("Deleting pipeline\n");
     gst_object_unref (GST_OBJECT (pipeline));
@@ -577,6 +1779,10 @@ int main (int argc, char *argv[])
     g_main_loop_unref (loop);
     g_free (g_source_bin_list);
     g_free (uri);
+    metrics_sampler_free (metrics);
+#ifdef USE_THREAD_POOL
+    g_thread_pool_free (stream_pool, FALSE, TRUE);
+#endif
 
     return 0;
 }
@@ -18,6 +18,9 @@
 #define MUXER_OUTPUT_HEIGHT 720
 #define USE_DEMUX
 #define USE_FILESINK  //USE_DEMUX should be defined for correct output
+/* batch with cpubatchmux/cpubatchdemux from gstcpubatchmux.c instead of
+ * nvstreammux/nvstreamdemux, run with GST_PLUGIN_PATH pointing at the plugin */
+//#define USE_CPU_BATCHMUX
 
 GMainLoop *loop = NULL;
 GstElement **g_source_bin_list = NULL;
@@ -264,14 +267,22 @@ int main (int argc, char *argv[])
 
     /* Use nvinfer to run inferencing on decoder's output,
      * behaviour of inferencing is set through config file */
+#ifdef USE_CPU_BATCHMUX
+    streammux = gst_element_factory_make ("cpubatchmux", "stream-muxer");
+#else
     streammux = gst_element_factory_make ("nvstreammux", "stream-muxer");
+#endif
     //g_object_set(G_OBJECT(streammux), "batched-push-timeout", 25000, NULL);
     //g_object_set(G_OBJECT(streammux), "batched-push-timeout", 33333, NULL);
     //g_object_set(G_OBJECT(streammux), "batch-size", 200, NULL);
     //SET_GPU_ID (streammux, GPU_ID);
 
 #ifdef USE_DEMUX
+#ifdef USE_CPU_BATCHMUX
+    streamdemux = gst_element_factory_make ("cpubatchdemux", "stream-demuxer");
+#else
     streamdemux = gst_element_factory_make ("nvstreamdemux", "stream-demuxer");
+#endif
 #else
     streamdemux = gst_element_factory_make ("tee", "stream-demuxer");
 #endif
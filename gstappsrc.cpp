@@ -1,52 +1,422 @@
 //gcc -Wall $(pkg-config --cflags gstreamer-1.0) gstappsrc.cpp $(pkg-config --libs gstreamer-1.0) -lgstapp-1.0
+//
+// ./a.out [--fps=30[,15,...]] [--jitter=MS] [--aligned]
+//
+// Every appsrc is driven by the push scheduler on the main loop at its own
+// rate; a comma separated --fps list is handed out to the sources round
+// robin. Sources start at random phases within their first frame period
+// unless --aligned is given, and --jitter moves every push by up to +/- MS
+// around its ideal time. A push that falls due while the appsrc signalled
+// enough-data is skipped, like a live camera dropping frames. --fps=0.2
+// --aligned reproduces the old burst of all sources every 5 seconds.
+//
+// Decoder latency is traced per buffer: inputs are matched to outputs by PTS
+// (in order when the PTS is missing or changed) and timed with the monotonic
+// clock into one histogram per decoder. kill -USR1 <pid> prints p50, p90,
+// p99 and max per decoder and over all of them, so does Ctrl-C on exit.
 
 #include <gst/gst.h>
 #include <gst/app/gstappsrc.h>
 #include <glib.h>
+#include <glib-unix.h>
 #include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
 
 #include <stdint.h>
+#include <string.h>
+
+#include "hdr_histogram.h"
 
 GMainLoop *loop = NULL;
 
 #define BATCH 32
 
+/* 1: every appsrc pushes a buffer around the same cached, read-only
+ * GstMemory of the image, loaded once per distinct file.
+ * 0: read and copy the file for every source on every cycle.
+ * Push CPU and RSS are printed for every cycle either way. */
+#define USE_JPEG_CACHE 1
+
+/* decoder inputs waiting for their output */
+#define LATENCY_PENDING 64
+
 typedef struct _srcbinctx
 {
-    GQueue *queue;
-    struct timeval start;
+    gchar name[16];
+    /* the sink and src probes may run on different threads */
+    GMutex lock;
+    GstClockTime pending_pts[LATENCY_PENDING];
+    guint64 pending_time[LATENCY_PENDING];
+    guint pending_head;
+    guint pending_count;
+    /* inputs that never produced an output */
+    guint64 unmatched;
+    /* ns from decoder input to output */
+    HdrHistogram latency;
 }srcbinctx;
 
+static srcbinctx *decoder_ctx[BATCH];
+
+static guint64 monotonic_time_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * G_GUINT64_CONSTANT (1000000000) + ts.tv_nsec;
+}
+
 GstPadProbeReturn decoder_sinkpad_probe_callback(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
 {
     srcbinctx *sbc = (srcbinctx *)user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+    guint slot;
 
-    gettimeofday (&sbc->start, NULL);
+    g_mutex_lock (&sbc->lock);
+    if (sbc->pending_count == LATENCY_PENDING)
+    {
+        sbc->pending_head = (sbc->pending_head + 1) % LATENCY_PENDING;
+        sbc->pending_count--;
+        sbc->unmatched++;
+    }
+    slot = (sbc->pending_head + sbc->pending_count++) % LATENCY_PENDING;
+    sbc->pending_pts[slot] = GST_BUFFER_PTS (buffer);
+    sbc->pending_time[slot] = monotonic_time_ns ();
+    g_mutex_unlock (&sbc->lock);
 
-    g_queue_push_head (sbc->queue, &sbc->start);
     return GST_PAD_PROBE_OK;
 }
 
 GstPadProbeReturn decoder_srcpad_probe_callback(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
 {
     srcbinctx *sbc = (srcbinctx *)user_data;
-    struct timeval *s;
-    struct timeval start, end;
+    GstClockTime pts = GST_BUFFER_PTS (GST_PAD_PROBE_INFO_BUFFER (info));
+    guint64 end = monotonic_time_ns ();
+    guint64 start = 0;
+    guint i, match = 0;
 
-    gettimeofday (&end, NULL);
+    g_mutex_lock (&sbc->lock);
+    if (GST_CLOCK_TIME_IS_VALID (pts))
+    {
+        for (i = 0; i < sbc->pending_count; i++)
+        {
+            if (sbc->pending_pts[(sbc->pending_head + i) % LATENCY_PENDING] == pts)
+            {
+                match = i;
+                break;
+            }
+        }
+    }
 
-    if (!g_queue_is_empty (sbc->queue))
+    /* inputs queued before the match were dropped by the decoder */
+    if (sbc->pending_count > 0)
     {
-        s = (timeval *) g_queue_pop_tail (sbc->queue);
+        start = sbc->pending_time[(sbc->pending_head + match) % LATENCY_PENDING];
+        sbc->unmatched += match;
+        sbc->pending_head = (sbc->pending_head + match + 1) % LATENCY_PENDING;
+        sbc->pending_count -= match + 1;
+    }
+    g_mutex_unlock (&sbc->lock);
 
-        start = *s;
+    if (start)
+        hdr_record (&sbc->latency, end - start);
 
-        g_print("latency = %ld ms for decoder %p inside probe function\n", ((end.tv_sec * 1000000 + end.tv_usec)
-                    - (start.tv_sec * 1000000 + start.tv_usec)) / 1000, gst_pad_get_parent_element(pad));
-    }
     return GST_PAD_PROBE_OK;
 }
 
+static void latency_print (const gchar *name, const HdrHistogram *h, guint64 unmatched)
+{
+    g_print ("%-16s %8" G_GUINT64_FORMAT " buffers  p50 %7.2f  p90 %7.2f  p99 %7.2f  max %7.2f ms  unmatched %"
+            G_GUINT64_FORMAT "\n", name, hdr_count (h), hdr_percentile (h, 50) / 1e6, hdr_percentile (h, 90) / 1e6,
+            hdr_percentile (h, 99) / 1e6, hdr_max (h) / 1e6, unmatched);
+}
+
+static void latency_report (void)
+{
+    HdrHistogram *all = g_new (HdrHistogram, 1);
+    guint64 unmatched = 0;
+    int i;
+
+    hdr_init (all);
+    g_print ("decoder latency:\n");
+    for (i = 0; i < BATCH; i++)
+    {
+        srcbinctx *sbc = decoder_ctx[i];
+
+        if (!sbc)
+            continue;
+        latency_print (sbc->name, &sbc->latency, sbc->unmatched);
+        hdr_merge (all, &sbc->latency);
+        unmatched += sbc->unmatched;
+    }
+    latency_print ("all", all, unmatched);
+    g_free (all);
+}
+
+static gboolean latency_report_cb (gpointer data)
+{
+    latency_report ();
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean quit_cb (gpointer data)
+{
+    g_main_loop_quit (loop);
+    return G_SOURCE_REMOVE;
+}
+
+/* one appsrc as seen by the push scheduler, times are monotonic us */
+typedef struct _SourceSchedule
+{
+    GstElement *appsrc;
+    gint64 period;
+    /* ideal time of the next push and the same with jitter applied */
+    gint64 next_push;
+    gint64 due;
+    /* set from need-data / enough-data on the streaming thread */
+    gint need_data;
+    guint64 pushed;
+    guint64 skipped;
+}SourceSchedule;
+
+typedef struct _PushScheduler
+{
+    GSource *source;
+    /* min-heap on due */
+    SourceSchedule *heap[BATCH];
+    SourceSchedule sources[BATCH];
+    gint64 jitter;
+
+    const gchar *jpeg_file_path;
+    GHashTable *jpeg_cache;
+
+    /* since the last stats report */
+    guint64 pushed;
+    guint64 skipped;
+    gint64 lateness_sum;
+    gint64 lateness_max;
+    gint64 push_cpu_ns;
+}PushScheduler;
+
+/* path -> GstMemory holding the whole file */
+static GHashTable *jpeg_cache_new (void)
+{
+    return g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) gst_memory_unref);
+}
+
+static GstBuffer *jpeg_cache_get_buffer (GHashTable *cache, const gchar *path, GError **error)
+{
+    GstMemory *mem = (GstMemory *) g_hash_table_lookup (cache, path);
+
+    if (!mem)
+    {
+        gchar *data;
+        gsize size;
+
+        if (!g_file_get_contents (path, &data, &size, error))
+            return NULL;
+
+        mem = gst_memory_new_wrapped (GST_MEMORY_FLAG_READONLY, data, size, 0, size, data, g_free);
+        g_hash_table_insert (cache, g_strdup (path), mem);
+    }
+
+    /* a new buffer for every push, the payload is only referenced */
+    GstBuffer *buffer = gst_buffer_new ();
+    gst_buffer_append_memory (buffer, gst_memory_ref (mem));
+
+    return buffer;
+}
+
+static gint64 thread_cpu_time_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * G_GINT64_CONSTANT (1000000000) + ts.tv_nsec;
+}
+
+static gdouble rss_mb (void)
+{
+    gchar *statm = NULL;
+    gulong size = 0, resident = 0;
+
+    if (g_file_get_contents ("/proc/self/statm", &statm, NULL, NULL))
+        sscanf (statm, "%lu %lu", &size, &resident);
+    g_free (statm);
+
+    return resident * (gdouble) sysconf (_SC_PAGESIZE) / (1024 * 1024);
+}
+
+static void scheduler_sift_down (PushScheduler *sched, gint i)
+{
+    while (TRUE)
+    {
+        gint smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+
+        if (l < BATCH && sched->heap[l]->due < sched->heap[smallest]->due)
+            smallest = l;
+        if (r < BATCH && sched->heap[r]->due < sched->heap[smallest]->due)
+            smallest = r;
+        if (smallest == i)
+            break;
+
+        SourceSchedule *tmp = sched->heap[i];
+        sched->heap[i] = sched->heap[smallest];
+        sched->heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static void need_data_cb (GstElement *appsrc, guint size, gpointer data)
+{
+    SourceSchedule *src = (SourceSchedule *) data;
+    g_atomic_int_set (&src->need_data, 1);
+}
+
+static void enough_data_cb (GstElement *appsrc, gpointer data)
+{
+    SourceSchedule *src = (SourceSchedule *) data;
+    g_atomic_int_set (&src->need_data, 0);
+}
+
+static void scheduler_push (PushScheduler *sched, SourceSchedule *src)
+{
+    GError *error = NULL;
+    GstBuffer *buffer = NULL;
+
+#if USE_JPEG_CACHE
+    buffer = jpeg_cache_get_buffer (sched->jpeg_cache, sched->jpeg_file_path, &error);
+#else
+    gsize file_size;
+    guint8 *jpeg_data;
+
+    if (g_file_get_contents(sched->jpeg_file_path, (gchar **)&jpeg_data, &file_size, &error))
+        buffer = gst_buffer_new_wrapped(jpeg_data, file_size);
+#endif
+
+    if (!buffer)
+    {
+        g_printerr("Error reading JPEG file: %s\n", error->message);
+        g_clear_error(&error);
+        return;
+    }
+
+    gst_app_src_push_buffer(GST_APP_SRC(src->appsrc), buffer);
+    src->pushed++;
+    sched->pushed++;
+}
+
+static gint64 scheduler_jitter (PushScheduler *sched)
+{
+    return sched->jitter ? g_random_int_range (-sched->jitter, sched->jitter + 1) : 0;
+}
+
+/* Pushes every source that is due and re-arms for the earliest next one. */
+static gboolean scheduler_run (gpointer data)
+{
+    PushScheduler *sched = (PushScheduler *) data;
+    gint64 now = g_get_monotonic_time ();
+    gint64 cpu_start = thread_cpu_time_ns ();
+
+    while (sched->heap[0]->due <= now)
+    {
+        SourceSchedule *src = sched->heap[0];
+        gint64 lateness = now - src->due;
+
+        sched->lateness_sum += lateness;
+        sched->lateness_max = MAX (sched->lateness_max, lateness);
+
+        if (g_atomic_int_get (&src->need_data))
+            scheduler_push (sched, src);
+        else
+        {
+            src->skipped++;
+            sched->skipped++;
+        }
+
+        /* after a stall resume from now instead of pushing the backlog */
+        src->next_push += src->period;
+        if (src->next_push < now)
+            src->next_push = now + src->period;
+        src->due = src->next_push + scheduler_jitter (sched);
+        scheduler_sift_down (sched, 0);
+    }
+
+    sched->push_cpu_ns += thread_cpu_time_ns () - cpu_start;
+    g_source_set_ready_time (sched->source, sched->heap[0]->due);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean scheduler_dispatch (GSource *source, GSourceFunc callback, gpointer user_data)
+{
+    return callback (user_data);
+}
+
+static GSourceFuncs scheduler_funcs = { NULL, NULL, scheduler_dispatch, NULL };
+
+static gboolean scheduler_report (gpointer data)
+{
+    PushScheduler *sched = (PushScheduler *) data;
+    guint64 due = sched->pushed + sched->skipped;
+
+    g_print ("pushed %" G_GUINT64_FORMAT ", skipped %" G_GUINT64_FORMAT " on enough-data, lateness avg %.0f us max %"
+            G_GINT64_FORMAT " us, push cpu %.3f ms, rss %.1f MB\n", sched->pushed, sched->skipped,
+            due ? (gdouble) sched->lateness_sum / due : 0.0, sched->lateness_max, sched->push_cpu_ns / 1e6, rss_mb ());
+
+    sched->pushed = sched->skipped = 0;
+    sched->lateness_sum = sched->lateness_max = sched->push_cpu_ns = 0;
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* Sets every source up with its rate and phase and attaches the scheduler
+ * to the default main context. */
+static void scheduler_start (PushScheduler *sched, GstElement *pipeline, gdouble *fps, guint n_fps,
+        gint jitter_ms, gboolean aligned)
+{
+    gint64 now = g_get_monotonic_time ();
+    gint64 min_period = 0;
+    int i;
+
+    for (i = 0; i < BATCH; i++)
+    {
+        SourceSchedule *src = &sched->sources[i];
+        gchar appsrc_name[16] = { };
+
+        g_snprintf (appsrc_name, 15, "appsrc-%02d", i);
+        src->appsrc = gst_bin_get_by_name (GST_BIN(pipeline), appsrc_name);
+        src->period = (gint64) (G_USEC_PER_SEC / fps[i % n_fps]);
+        /* a random phase within one period, in double so long periods
+         * don't overflow a gint32 */
+        src->next_push = now + (aligned ? 0 : (gint64) (g_random_double_range (0, 1) * src->period));
+        src->due = src->next_push;
+        src->need_data = 1;
+
+        g_signal_connect (src->appsrc, "need-data", G_CALLBACK (need_data_cb), src);
+        g_signal_connect (src->appsrc, "enough-data", G_CALLBACK (enough_data_cb), src);
+
+        sched->heap[i] = src;
+        min_period = i == 0 ? src->period : MIN (min_period, src->period);
+    }
+
+    /* keep the jitter below half the shortest period so frames of one
+     * source never swap */
+    sched->jitter = MIN ((gint64) jitter_ms * 1000, min_period / 2);
+
+    for (i = BATCH / 2 - 1; i >= 0; i--)
+        scheduler_sift_down (sched, i);
+
+    sched->source = g_source_new (&scheduler_funcs, sizeof (GSource));
+    g_source_set_callback (sched->source, scheduler_run, sched, NULL);
+    g_source_set_priority (sched->source, G_PRIORITY_HIGH);
+    g_source_set_ready_time (sched->source, sched->heap[0]->due);
+    g_source_attach (sched->source, NULL);
+
+    g_timeout_add_seconds (5, scheduler_report, sched);
+}
+
 static gboolean bus_call (GstBus * bus, GstMessage * msg, gpointer data)
 {
     GMainLoop *loop = (GMainLoop *) data;
@@ -94,14 +464,21 @@ static GstElement *create_source_bin (guint index, gchar *filename)
     gchar appsrc_name[16] = { };
     GstPad *pad;
 
-    srcbinctx *sbc = (srcbinctx *) malloc (sizeof(srcbinctx));
-    sbc->queue = g_queue_new ();
+    srcbinctx *sbc = g_new0 (srcbinctx, 1);
+    g_mutex_init (&sbc->lock);
+    hdr_init (&sbc->latency);
+    g_snprintf (sbc->name, sizeof (sbc->name), "decoder-%02d", index);
+    decoder_ctx[index] = sbc;
 
     g_snprintf (bin_name, 15, "source-bin-%02d", index);
     bin = gst_bin_new (bin_name);
 
     g_snprintf (appsrc_name, 15, "appsrc-%02d", index);
     source = gst_element_factory_make ("appsrc", appsrc_name);
+    /* driven by the push scheduler like a live camera, the format can only
+     * change before the pipeline leaves NULL */
+    if (source)
+        g_object_set (G_OBJECT(source), "is-live", TRUE, "do-timestamp", TRUE, "format", GST_FORMAT_TIME, NULL);
 
     jpegparse = gst_element_factory_make ("jpegparse", NULL);
 
@@ -159,7 +536,53 @@ gint main (gint argc, gchar *argv[])
     GstElement *pipeline, *nvstreammux, *fakesink;
     gchar pad_name[16]={0};
 
-    gst_init (&argc, &argv);
+    gchar *fps_list = NULL;
+    gint jitter_ms = 0;
+    gboolean aligned = FALSE;
+    GError *error = NULL;
+    GOptionEntry entries[] = {
+        { "fps", 'f', 0, G_OPTION_ARG_STRING, &fps_list, "Push rate per source, a comma separated list is applied round robin (default 30)", "FPS[,FPS...]" },
+        { "jitter", 'j', 0, G_OPTION_ARG_INT, &jitter_ms, "Move every push by up to +/- MS", "MS" },
+        { "aligned", 'a', 0, G_OPTION_ARG_NONE, &aligned, "Start all sources in phase instead of at random offsets", NULL },
+        { NULL }
+    };
+
+    GOptionContext *ctx = g_option_context_new (NULL);
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    g_option_context_add_group (ctx, gst_init_get_option_group ());
+    if (!g_option_context_parse (ctx, &argc, &argv, &error))
+    {
+        g_printerr ("%s\n", error->message);
+        g_clear_error (&error);
+        g_option_context_free (ctx);
+        return -1;
+    }
+    g_option_context_free (ctx);
+
+    gchar **fps_strv = g_strsplit (fps_list ? fps_list : "30", ",", -1);
+    guint n_fps = g_strv_length (fps_strv);
+    gdouble *fps = g_new0 (gdouble, MAX (n_fps, 1));
+    for (i = 0; i < (int) n_fps; i++)
+    {
+        fps[i] = g_ascii_strtod (fps_strv[i], NULL);
+        if (fps[i] <= 0)
+        {
+            g_printerr ("invalid rate %s\n", fps_strv[i]);
+            g_strfreev (fps_strv);
+            g_free (fps_list);
+            g_free (fps);
+            return -1;
+        }
+    }
+    g_strfreev (fps_strv);
+    g_free (fps_list);
+    if (n_fps == 0 || jitter_ms < 0)
+    {
+        g_printerr ("invalid --fps or --jitter\n");
+        g_free (fps);
+        return -1;
+    }
+
     loop = g_main_loop_new (NULL, FALSE);
     GstPad *sinkpad = NULL, *src_bin_pad = NULL;
 
@@ -207,36 +630,14 @@ gint main (gint argc, gchar *argv[])
 
     gst_element_set_state (pipeline, GST_STATE_PLAYING);
 
-    const gchar *jpeg_file_path = "./sample_720p.jpeg";
-    GError *error = NULL;
-    gsize file_size;
-    guint8 *jpeg_data;
-    GstElement *appsrc = NULL;
-
-    while (1)
-    {
-        for (i = 0; i < BATCH; i++)
-        {
-            gchar appsrc_name[16] = { };
-
-            if (g_file_get_contents(jpeg_file_path, (gchar **)&jpeg_data, &file_size, &error))
-            {
-                g_snprintf (appsrc_name, 15, "appsrc-%02d", i);
-                appsrc = gst_bin_get_by_name (GST_BIN(pipeline), appsrc_name);
-                //g_print ("pushing buffer into pipeline for appsrc %s of size %ld\n", appsrc_name, file_size);
-                GstBuffer *buffer = gst_buffer_new_wrapped(jpeg_data, file_size);
-                gst_app_src_push_buffer(GST_APP_SRC(appsrc), buffer);
-
-            }
-            else
-            {
-                g_printerr("Error reading JPEG file: %s\n", error->message);
-                g_clear_error(&error);
-            }
-        }
-
-        g_usleep (5000000);
-    }
+    PushScheduler sched;
+    memset (&sched, 0, sizeof (sched));
+    sched.jpeg_file_path = "./sample_720p.jpeg";
+#if USE_JPEG_CACHE
+    sched.jpeg_cache = jpeg_cache_new ();
+#endif
+    scheduler_start (&sched, pipeline, fps, n_fps, jitter_ms, aligned);
+    g_free (fps);
 
     /* play */
 
@@ -247,7 +648,11 @@ gint main (gint argc, gchar *argv[])
     bus_watch_id = gst_bus_add_watch (bus, bus_call, loop);
     gst_object_unref (bus);
 
+    g_unix_signal_add (SIGUSR1, latency_report_cb, NULL);
+    g_unix_signal_add (SIGINT, quit_cb, NULL);
+
     g_main_loop_run (loop);
+    latency_report ();
     gst_object_unref (GST_OBJECT (pipeline));
     g_source_remove (bus_watch_id);
     g_main_loop_unref (loop);
@@ -0,0 +1,1035 @@
+/*
+ * gcc -shared -fPIC -O2 gstcpubatchmux.c -o libgstcpubatchmux.so `pkg-config --cflags --libs gstreamer-1.0`
+ *
+ * GST_PLUGIN_PATH=. gst-launch-1.0 \
+ *     cpubatchmux name=m batched-push-timeout=40000 ! cpubatchdemux name=d \
+ *     audiotestsrc ! m.sink_0  audiotestsrc ! m.sink_1 \
+ *     d.src_0 ! fakesink  d.src_1 ! fakesink
+ *
+ * CPU only stand-ins for nvstreammux / nvstreamdemux so that batch forming
+ * can be profiled on hosts without a GPU. The pad conventions are the same:
+ * request sink_%u pads on the muxer, request src_%u pads on the demuxer,
+ * the number in the pad name is the source id.
+ *
+ * cpubatchmux collects at most one buffer per source into a batch, the
+ * buffers are not copied, and pushes the batch as one GstBufferList when
+ *  - it holds batch-size buffers (0, the default, means one per linked
+ *    source that is not EOS yet), or
+ *  - every linked source contributed, or
+ *  - batched-push-timeout us passed since the first buffer of the batch
+ *    (-1, the default, waits for a full batch).
+ * With sync-inputs buffers wait for their running time on the pipeline
+ * clock before they join a batch. Every buffer carries a GstCpuBatchMeta
+ * with its source id, the batch it went out in and when it arrived. The
+ * caps of the first source are used for the batch, the sources are
+ * expected to agree like they do for nvstreammux. width, height,
+ * live-source and gpu-id are accepted so the element can be swapped in
+ * for nvstreammux, they have no effect.
+ *
+ * When going back to READY the muxer prints the number of batches, how
+ * many were pushed by the timeout, the average fill and percentiles of the
+ * time from the first buffer of a batch to its push.
+ *
+ * cpubatchdemux routes every buffer of a batch to src_<source id> and
+ * forwards events to all source pads.
+ * */
+
+#include <gst/gst.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hdr_histogram.h"
+
+#define PACKAGE "cpubatchmux"
+
+/* ---------------------------------------------------------------------- */
+/* per buffer batch metadata */
+
+typedef struct _GstCpuBatchMeta
+{
+    GstMeta meta;
+    guint source_id;
+    guint64 batch_id;
+    /* monotonic us when the muxer received the buffer */
+    gint64 arrival;
+}GstCpuBatchMeta;
+
+static GType gst_cpu_batch_meta_api_get_type (void)
+{
+    static gsize type = 0;
+    static const gchar *tags[] = { NULL };
+
+    if (g_once_init_enter (&type))
+    {
+        GType t = gst_meta_api_type_register ("GstCpuBatchMetaAPI", tags);
+        g_once_init_leave (&type, t);
+    }
+
+    return (GType) type;
+}
+
+static gboolean gst_cpu_batch_meta_init (GstMeta *meta, gpointer params, GstBuffer *buffer)
+{
+    GstCpuBatchMeta *bmeta = (GstCpuBatchMeta *) meta;
+
+    bmeta->source_id = 0;
+    bmeta->batch_id = 0;
+    bmeta->arrival = 0;
+
+    return TRUE;
+}
+
+static const GstMetaInfo *gst_cpu_batch_meta_get_info (void);
+
+static gboolean gst_cpu_batch_meta_transform (GstBuffer *dest, GstMeta *meta, GstBuffer *buffer, GQuark type,
+        gpointer data)
+{
+    GstCpuBatchMeta *src = (GstCpuBatchMeta *) meta;
+    GstCpuBatchMeta *dst;
+
+    if (!GST_META_TRANSFORM_IS_COPY (type))
+        return FALSE;
+
+    dst = (GstCpuBatchMeta *) gst_buffer_add_meta (dest, gst_cpu_batch_meta_get_info (), NULL);
+    dst->source_id = src->source_id;
+    dst->batch_id = src->batch_id;
+    dst->arrival = src->arrival;
+
+    return TRUE;
+}
+
+static const GstMetaInfo *gst_cpu_batch_meta_get_info (void)
+{
+    static const GstMetaInfo *info = NULL;
+
+    if (g_once_init_enter ((GstMetaInfo **) &info))
+    {
+        const GstMetaInfo *mi = gst_meta_register (gst_cpu_batch_meta_api_get_type (), "GstCpuBatchMeta",
+                sizeof (GstCpuBatchMeta), gst_cpu_batch_meta_init, NULL, gst_cpu_batch_meta_transform);
+        g_once_init_leave ((GstMetaInfo **) &info, (GstMetaInfo *) mi);
+    }
+
+    return info;
+}
+
+#define gst_buffer_get_cpu_batch_meta(b) \
+    ((GstCpuBatchMeta *) gst_buffer_get_meta ((b), gst_cpu_batch_meta_api_get_type ()))
+
+/* ---------------------------------------------------------------------- */
+/* cpubatchmux */
+
+typedef struct _GstCpuBatchMuxPad
+{
+    GstPad *pad;
+    guint source_id;
+    GstSegment segment;
+    /* a buffer of this source is in the batch being formed */
+    gboolean in_batch;
+    gboolean eos;
+    gboolean released;
+    /* sync-inputs wait in progress */
+    GstClockID clock_id;
+}GstCpuBatchMuxPad;
+
+typedef struct _GstCpuBatchMux
+{
+    GstElement element;
+    GstPad *srcpad;
+
+    /* protects everything below, cond signals batch and state changes */
+    GMutex lock;
+    GCond cond;
+    GPtrArray *pads;
+    guint next_source_id;
+
+    guint batch_size;
+    gint push_timeout;
+    gboolean sync_inputs;
+    gint width, height;
+    gboolean live_source;
+    guint gpu_id;
+
+    GstBufferList *batch;
+    gint64 batch_start;
+    gint64 batch_deadline;
+    /* batches are numbered when formed and pushed in that order */
+    guint64 next_batch_id;
+    guint64 push_batch_id;
+    GstFlowReturn last_ret;
+    gboolean flushing;
+    gboolean sent_stream_start;
+    gboolean sent_caps;
+    gboolean sent_segment;
+    gboolean sent_eos;
+
+    GThread *timer;
+    gboolean timer_stop;
+
+    guint64 batches;
+    guint64 timeout_batches;
+    guint64 batched_buffers;
+    /* us from the first buffer of a batch to its push */
+    HdrHistogram formation;
+}GstCpuBatchMux;
+
+typedef struct _GstCpuBatchMuxClass
+{
+    GstElementClass parent_class;
+}GstCpuBatchMuxClass;
+
+#define GST_TYPE_CPU_BATCH_MUX (gst_cpu_batch_mux_get_type ())
+#define GST_CPU_BATCH_MUX(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_TYPE_CPU_BATCH_MUX, GstCpuBatchMux))
+
+GType gst_cpu_batch_mux_get_type (void);
+G_DEFINE_TYPE (GstCpuBatchMux, gst_cpu_batch_mux, GST_TYPE_ELEMENT);
+
+enum
+{
+    PROP_MUX_0,
+    PROP_BATCH_SIZE,
+    PROP_BATCHED_PUSH_TIMEOUT,
+    PROP_SYNC_INPUTS,
+    PROP_WIDTH,
+    PROP_HEIGHT,
+    PROP_LIVE_SOURCE,
+    PROP_GPU_ID,
+};
+
+static GstStaticPadTemplate mux_sink_template = GST_STATIC_PAD_TEMPLATE ("sink_%u",
+        GST_PAD_SINK, GST_PAD_REQUEST, GST_STATIC_CAPS_ANY);
+
+static GstStaticPadTemplate mux_src_template = GST_STATIC_PAD_TEMPLATE ("src",
+        GST_PAD_SRC, GST_PAD_ALWAYS, GST_STATIC_CAPS_ANY);
+
+/* Called with the lock held. */
+static gboolean gst_cpu_batch_mux_batch_complete (GstCpuBatchMux *mux)
+{
+    guint i, active = 0, waiting = 0;
+
+    if (!mux->batch)
+        return FALSE;
+
+    for (i = 0; i < mux->pads->len; i++)
+    {
+        GstCpuBatchMuxPad *data = (GstCpuBatchMuxPad *) g_ptr_array_index (mux->pads, i);
+
+        if (data->eos || data->released)
+            continue;
+        active++;
+        if (!data->in_batch)
+            waiting++;
+    }
+
+    if (mux->batch_size > 0 && gst_buffer_list_length (mux->batch) >= mux->batch_size)
+        return TRUE;
+
+    return active > 0 && waiting == 0;
+}
+
+/* Called with the lock held, hands the batch out and opens the next one. */
+static GstBufferList *gst_cpu_batch_mux_take_batch (GstCpuBatchMux *mux, gboolean by_timeout, guint64 *batch_id)
+{
+    GstBufferList *batch = mux->batch;
+    guint i;
+
+    if (!batch)
+        return NULL;
+
+    *batch_id = mux->next_batch_id++;
+    for (i = 0; i < gst_buffer_list_length (batch); i++)
+        gst_buffer_get_cpu_batch_meta (gst_buffer_list_get (batch, i))->batch_id = *batch_id;
+
+    mux->batches++;
+    mux->timeout_batches += by_timeout;
+    mux->batched_buffers += gst_buffer_list_length (batch);
+    hdr_record (&mux->formation, g_get_monotonic_time () - mux->batch_start);
+
+    mux->batch = NULL;
+    mux->batch_deadline = 0;
+    for (i = 0; i < mux->pads->len; i++)
+        ((GstCpuBatchMuxPad *) g_ptr_array_index (mux->pads, i))->in_batch = FALSE;
+    g_cond_broadcast (&mux->cond);
+
+    return batch;
+}
+
+/* Pushes batches strictly in the order they were formed, whichever thread
+ * formed them. */
+static GstFlowReturn gst_cpu_batch_mux_push (GstCpuBatchMux *mux, GstBufferList *batch, guint64 batch_id)
+{
+    GstFlowReturn ret;
+
+    g_mutex_lock (&mux->lock);
+    while (mux->push_batch_id != batch_id && !mux->flushing)
+        g_cond_wait (&mux->cond, &mux->lock);
+    if (mux->flushing)
+    {
+        g_mutex_unlock (&mux->lock);
+        gst_buffer_list_unref (batch);
+        return GST_FLOW_FLUSHING;
+    }
+    g_mutex_unlock (&mux->lock);
+
+    ret = gst_pad_push_list (mux->srcpad, batch);
+
+    g_mutex_lock (&mux->lock);
+    mux->push_batch_id++;
+    mux->last_ret = ret;
+    g_cond_broadcast (&mux->cond);
+    g_mutex_unlock (&mux->lock);
+
+    return ret;
+}
+
+static void gst_cpu_batch_mux_wait_clock (GstCpuBatchMux *mux, GstCpuBatchMuxPad *data, GstBuffer *buffer)
+{
+    GstClock *clock = gst_element_get_clock (GST_ELEMENT (mux));
+    GstClockTime running_time;
+    GstClockID id;
+
+    if (!clock)
+        return;
+
+    running_time = gst_segment_to_running_time (&data->segment, GST_FORMAT_TIME, GST_BUFFER_PTS (buffer));
+    if (!GST_CLOCK_TIME_IS_VALID (running_time))
+    {
+        gst_object_unref (clock);
+        return;
+    }
+
+    id = gst_clock_new_single_shot_id (clock, running_time + gst_element_get_base_time (GST_ELEMENT (mux)));
+    gst_object_unref (clock);
+
+    g_mutex_lock (&mux->lock);
+    if (mux->flushing)
+    {
+        g_mutex_unlock (&mux->lock);
+        gst_clock_id_unref (id);
+        return;
+    }
+    data->clock_id = id;
+    g_mutex_unlock (&mux->lock);
+
+    gst_clock_id_wait (id, NULL);
+
+    g_mutex_lock (&mux->lock);
+    data->clock_id = NULL;
+    g_mutex_unlock (&mux->lock);
+    gst_clock_id_unref (id);
+}
+
+static GstFlowReturn gst_cpu_batch_mux_chain (GstPad *pad, GstObject *parent, GstBuffer *buffer)
+{
+    GstCpuBatchMux *mux = GST_CPU_BATCH_MUX (parent);
+    GstCpuBatchMuxPad *data = (GstCpuBatchMuxPad *) gst_pad_get_element_private (pad);
+    GstBufferList *ready = NULL;
+    GstCpuBatchMeta *meta;
+    guint64 batch_id = 0;
+    GstFlowReturn ret;
+    gint64 now;
+
+    if (mux->sync_inputs)
+        gst_cpu_batch_mux_wait_clock (mux, data, buffer);
+
+    buffer = gst_buffer_make_writable (buffer);
+    meta = (GstCpuBatchMeta *) gst_buffer_add_meta (buffer, gst_cpu_batch_meta_get_info (), NULL);
+    meta->source_id = data->source_id;
+
+    g_mutex_lock (&mux->lock);
+    /* one buffer per source and batch */
+    while (data->in_batch && !mux->flushing && !data->released)
+        g_cond_wait (&mux->cond, &mux->lock);
+    if (mux->flushing || data->released)
+    {
+        g_mutex_unlock (&mux->lock);
+        gst_buffer_unref (buffer);
+        return GST_FLOW_FLUSHING;
+    }
+
+    now = g_get_monotonic_time ();
+    meta->arrival = now;
+    if (!mux->batch)
+    {
+        mux->batch = gst_buffer_list_new ();
+        mux->batch_start = now;
+        if (mux->push_timeout >= 0)
+        {
+            mux->batch_deadline = now + mux->push_timeout;
+            g_cond_broadcast (&mux->cond);
+        }
+    }
+    gst_buffer_list_add (mux->batch, buffer);
+    data->in_batch = TRUE;
+
+    if (gst_cpu_batch_mux_batch_complete (mux))
+        ready = gst_cpu_batch_mux_take_batch (mux, FALSE, &batch_id);
+    ret = mux->last_ret;
+    g_mutex_unlock (&mux->lock);
+
+    if (ready)
+        ret = gst_cpu_batch_mux_push (mux, ready, batch_id);
+
+    return ret;
+}
+
+static gpointer gst_cpu_batch_mux_timer (gpointer user_data)
+{
+    GstCpuBatchMux *mux = GST_CPU_BATCH_MUX (user_data);
+
+    g_mutex_lock (&mux->lock);
+    while (!mux->timer_stop)
+    {
+        GstBufferList *ready;
+        guint64 batch_id;
+
+        if (!mux->batch || mux->batch_deadline == 0)
+        {
+            g_cond_wait (&mux->cond, &mux->lock);
+            continue;
+        }
+
+        if (g_get_monotonic_time () < mux->batch_deadline)
+        {
+            g_cond_wait_until (&mux->cond, &mux->lock, mux->batch_deadline);
+            continue;
+        }
+
+        ready = gst_cpu_batch_mux_take_batch (mux, TRUE, &batch_id);
+        g_mutex_unlock (&mux->lock);
+        gst_cpu_batch_mux_push (mux, ready, batch_id);
+        g_mutex_lock (&mux->lock);
+    }
+    g_mutex_unlock (&mux->lock);
+
+    return NULL;
+}
+
+/* Called with the lock held. */
+static gboolean gst_cpu_batch_mux_all_eos (GstCpuBatchMux *mux)
+{
+    guint i;
+
+    for (i = 0; i < mux->pads->len; i++)
+    {
+        GstCpuBatchMuxPad *data = (GstCpuBatchMuxPad *) g_ptr_array_index (mux->pads, i);
+        if (!data->eos && !data->released)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Called with the lock held, wakes every input and the timer. */
+static void gst_cpu_batch_mux_set_flushing (GstCpuBatchMux *mux, gboolean flushing)
+{
+    guint i;
+
+    mux->flushing = flushing;
+    if (flushing)
+    {
+        for (i = 0; i < mux->pads->len; i++)
+        {
+            GstCpuBatchMuxPad *data = (GstCpuBatchMuxPad *) g_ptr_array_index (mux->pads, i);
+            if (data->clock_id)
+                gst_clock_id_unschedule (data->clock_id);
+        }
+    }
+    else
+    {
+        if (mux->batch)
+            gst_buffer_list_unref (mux->batch);
+        mux->batch = NULL;
+        mux->batch_deadline = 0;
+        mux->push_batch_id = mux->next_batch_id;
+        mux->last_ret = GST_FLOW_OK;
+        for (i = 0; i < mux->pads->len; i++)
+            ((GstCpuBatchMuxPad *) g_ptr_array_index (mux->pads, i))->in_batch = FALSE;
+    }
+    g_cond_broadcast (&mux->cond);
+}
+
+/* the first stream-start, caps and segment of any source go downstream */
+static gboolean gst_cpu_batch_mux_forward_once (GstCpuBatchMux *mux, gboolean *sent, GstEvent *event)
+{
+    gboolean forward;
+
+    g_mutex_lock (&mux->lock);
+    forward = !*sent;
+    *sent = TRUE;
+    g_mutex_unlock (&mux->lock);
+
+    if (forward)
+        return gst_pad_push_event (mux->srcpad, event);
+
+    gst_event_unref (event);
+    return TRUE;
+}
+
+static gboolean gst_cpu_batch_mux_sink_event (GstPad *pad, GstObject *parent, GstEvent *event)
+{
+    GstCpuBatchMux *mux = GST_CPU_BATCH_MUX (parent);
+    GstCpuBatchMuxPad *data = (GstCpuBatchMuxPad *) gst_pad_get_element_private (pad);
+
+    switch (GST_EVENT_TYPE (event))
+    {
+        case GST_EVENT_STREAM_START:
+            return gst_cpu_batch_mux_forward_once (mux, &mux->sent_stream_start, event);
+
+        case GST_EVENT_CAPS:
+            return gst_cpu_batch_mux_forward_once (mux, &mux->sent_caps, event);
+
+        case GST_EVENT_SEGMENT:
+            gst_event_copy_segment (event, &data->segment);
+            return gst_cpu_batch_mux_forward_once (mux, &mux->sent_segment, event);
+
+        case GST_EVENT_EOS:
+            {
+                GstBufferList *ready = NULL;
+                guint64 batch_id = 0;
+                gboolean send_eos;
+
+                g_mutex_lock (&mux->lock);
+                data->eos = TRUE;
+                send_eos = gst_cpu_batch_mux_all_eos (mux) && !mux->sent_eos;
+                if (send_eos || gst_cpu_batch_mux_batch_complete (mux))
+                    ready = gst_cpu_batch_mux_take_batch (mux, FALSE, &batch_id);
+                if (send_eos)
+                    mux->sent_eos = TRUE;
+                g_mutex_unlock (&mux->lock);
+
+                if (ready)
+                    gst_cpu_batch_mux_push (mux, ready, batch_id);
+                gst_event_unref (event);
+
+                return send_eos ? gst_pad_push_event (mux->srcpad, gst_event_new_eos ()) : TRUE;
+            }
+
+        case GST_EVENT_FLUSH_START:
+            g_mutex_lock (&mux->lock);
+            gst_cpu_batch_mux_set_flushing (mux, TRUE);
+            g_mutex_unlock (&mux->lock);
+            return gst_pad_push_event (mux->srcpad, event);
+
+        case GST_EVENT_FLUSH_STOP:
+            g_mutex_lock (&mux->lock);
+            gst_cpu_batch_mux_set_flushing (mux, FALSE);
+            data->eos = FALSE;
+            mux->sent_eos = FALSE;
+            g_mutex_unlock (&mux->lock);
+            gst_segment_init (&data->segment, GST_FORMAT_TIME);
+            return gst_pad_push_event (mux->srcpad, event);
+
+        default:
+            return gst_pad_event_default (pad, parent, event);
+    }
+}
+
+static gboolean gst_cpu_batch_mux_sink_query (GstPad *pad, GstObject *parent, GstQuery *query)
+{
+    switch (GST_QUERY_TYPE (query))
+    {
+        case GST_QUERY_CAPS:
+            {
+                GstCaps *filter;
+
+                gst_query_parse_caps (query, &filter);
+                if (filter)
+                    gst_query_set_caps_result (query, filter);
+                else
+                {
+                    GstCaps *any = gst_caps_new_any ();
+                    gst_query_set_caps_result (query, any);
+                    gst_caps_unref (any);
+                }
+                return TRUE;
+            }
+
+        case GST_QUERY_ACCEPT_CAPS:
+            gst_query_set_accept_caps_result (query, TRUE);
+            return TRUE;
+
+        /* the sources do not share downstream buffers */
+        case GST_QUERY_ALLOCATION:
+            return FALSE;
+
+        default:
+            return gst_pad_query_default (pad, parent, query);
+    }
+}
+
+/* Refuses a requested name that is already taken before any pad is built,
+ * like GstAggregator does, so a failing gst_element_add_pad() has nothing
+ * to leak. Frees @pad_name when it returns FALSE. */
+static gboolean gst_cpu_batch_pad_name_free (GstElement *element, gchar *pad_name)
+{
+    GstPad *existing = gst_element_get_static_pad (element, pad_name);
+
+    if (!existing)
+        return TRUE;
+
+    g_printerr ("%s: pad %s already exists\n", GST_ELEMENT_NAME (element), pad_name);
+    gst_object_unref (existing);
+    g_free (pad_name);
+
+    return FALSE;
+}
+
+static GstPad *gst_cpu_batch_mux_request_new_pad (GstElement *element, GstPadTemplate *templ, const gchar *name,
+        const GstCaps *caps)
+{
+    GstCpuBatchMux *mux = GST_CPU_BATCH_MUX (element);
+    GstCpuBatchMuxPad *data;
+    gchar *pad_name;
+    guint source_id;
+    GstPad *pad;
+
+    g_mutex_lock (&mux->lock);
+    if (!name || sscanf (name, "sink_%u", &source_id) != 1)
+        source_id = mux->next_source_id;
+    mux->next_source_id = MAX (mux->next_source_id, source_id + 1);
+    g_mutex_unlock (&mux->lock);
+
+    pad_name = g_strdup_printf ("sink_%u", source_id);
+    if (!gst_cpu_batch_pad_name_free (element, pad_name))
+        return NULL;
+    pad = gst_pad_new_from_template (templ, pad_name);
+    g_free (pad_name);
+
+    data = g_new0 (GstCpuBatchMuxPad, 1);
+    data->pad = pad;
+    data->source_id = source_id;
+    gst_segment_init (&data->segment, GST_FORMAT_TIME);
+    gst_pad_set_element_private (pad, data);
+
+    gst_pad_set_chain_function (pad, GST_DEBUG_FUNCPTR (gst_cpu_batch_mux_chain));
+    gst_pad_set_event_function (pad, GST_DEBUG_FUNCPTR (gst_cpu_batch_mux_sink_event));
+    gst_pad_set_query_function (pad, GST_DEBUG_FUNCPTR (gst_cpu_batch_mux_sink_query));
+
+    if (!gst_element_add_pad (element, pad))
+    {
+        g_free (data);
+        return NULL;
+    }
+
+    g_mutex_lock (&mux->lock);
+    g_ptr_array_add (mux->pads, data);
+    g_mutex_unlock (&mux->lock);
+
+    return pad;
+}
+
+static void gst_cpu_batch_mux_release_pad (GstElement *element, GstPad *pad)
+{
+    GstCpuBatchMux *mux = GST_CPU_BATCH_MUX (element);
+    GstCpuBatchMuxPad *data = (GstCpuBatchMuxPad *) gst_pad_get_element_private (pad);
+    GstBufferList *ready = NULL;
+    guint64 batch_id = 0;
+
+    g_mutex_lock (&mux->lock);
+    data->released = TRUE;
+    if (data->clock_id)
+        gst_clock_id_unschedule (data->clock_id);
+    /* the open batch may have been waiting for this pad only, as on EOS */
+    if (gst_cpu_batch_mux_batch_complete (mux) || (mux->batch && gst_cpu_batch_mux_all_eos (mux)))
+        ready = gst_cpu_batch_mux_take_batch (mux, FALSE, &batch_id);
+    g_cond_broadcast (&mux->cond);
+    g_mutex_unlock (&mux->lock);
+
+    if (ready)
+        gst_cpu_batch_mux_push (mux, ready, batch_id);
+
+    /* deactivating the pad waits for its streaming thread to leave chain */
+    gst_element_remove_pad (element, pad);
+
+    g_mutex_lock (&mux->lock);
+    g_ptr_array_remove (mux->pads, data);
+    g_mutex_unlock (&mux->lock);
+    g_free (data);
+}
+
+static void gst_cpu_batch_mux_print_stats (GstCpuBatchMux *mux)
+{
+    if (mux->batches == 0)
+        return;
+
+    g_print ("%s: %" G_GUINT64_FORMAT " batches, %" G_GUINT64_FORMAT " by timeout, average fill %.1f, "
+            "formation p50 %.2f p99 %.2f max %.2f ms\n", GST_OBJECT_NAME (mux), mux->batches, mux->timeout_batches,
+            (gdouble) mux->batched_buffers / mux->batches, hdr_percentile (&mux->formation, 50) / 1e3,
+            hdr_percentile (&mux->formation, 99) / 1e3, hdr_max (&mux->formation) / 1e3);
+}
+
+static GstStateChangeReturn gst_cpu_batch_mux_change_state (GstElement *element, GstStateChange transition)
+{
+    GstCpuBatchMux *mux = GST_CPU_BATCH_MUX (element);
+    GstStateChangeReturn ret;
+
+    switch (transition)
+    {
+        case GST_STATE_CHANGE_READY_TO_PAUSED:
+            g_mutex_lock (&mux->lock);
+            gst_cpu_batch_mux_set_flushing (mux, FALSE);
+            mux->sent_stream_start = mux->sent_caps = mux->sent_segment = mux->sent_eos = FALSE;
+            mux->timer_stop = FALSE;
+            mux->batches = mux->timeout_batches = mux->batched_buffers = 0;
+            hdr_init (&mux->formation);
+            g_mutex_unlock (&mux->lock);
+            mux->timer = g_thread_new (GST_OBJECT_NAME (mux), gst_cpu_batch_mux_timer, mux);
+            break;
+
+        case GST_STATE_CHANGE_PAUSED_TO_READY:
+            g_mutex_lock (&mux->lock);
+            gst_cpu_batch_mux_set_flushing (mux, TRUE);
+            mux->timer_stop = TRUE;
+            g_cond_broadcast (&mux->cond);
+            g_mutex_unlock (&mux->lock);
+            break;
+
+        default:
+            break;
+    }
+
+    ret = GST_ELEMENT_CLASS (gst_cpu_batch_mux_parent_class)->change_state (element, transition);
+
+    if (transition == GST_STATE_CHANGE_PAUSED_TO_READY)
+    {
+        if (mux->timer)
+            g_thread_join (mux->timer);
+        mux->timer = NULL;
+
+        g_mutex_lock (&mux->lock);
+        if (mux->batch)
+            gst_buffer_list_unref (mux->batch);
+        mux->batch = NULL;
+        g_mutex_unlock (&mux->lock);
+
+        gst_cpu_batch_mux_print_stats (mux);
+    }
+
+    return ret;
+}
+
+static void gst_cpu_batch_mux_set_property (GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+    GstCpuBatchMux *mux = GST_CPU_BATCH_MUX (object);
+
+    g_mutex_lock (&mux->lock);
+    switch (prop_id)
+    {
+        case PROP_BATCH_SIZE:
+            mux->batch_size = g_value_get_uint (value);
+            break;
+        case PROP_BATCHED_PUSH_TIMEOUT:
+            mux->push_timeout = g_value_get_int (value);
+            break;
+        case PROP_SYNC_INPUTS:
+            mux->sync_inputs = g_value_get_boolean (value);
+            break;
+        case PROP_WIDTH:
+            mux->width = g_value_get_int (value);
+            break;
+        case PROP_HEIGHT:
+            mux->height = g_value_get_int (value);
+            break;
+        case PROP_LIVE_SOURCE:
+            mux->live_source = g_value_get_boolean (value);
+            break;
+        case PROP_GPU_ID:
+            mux->gpu_id = g_value_get_uint (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+    g_mutex_unlock (&mux->lock);
+}
+
+static void gst_cpu_batch_mux_get_property (GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+    GstCpuBatchMux *mux = GST_CPU_BATCH_MUX (object);
+
+    g_mutex_lock (&mux->lock);
+    switch (prop_id)
+    {
+        case PROP_BATCH_SIZE:
+            g_value_set_uint (value, mux->batch_size);
+            break;
+        case PROP_BATCHED_PUSH_TIMEOUT:
+            g_value_set_int (value, mux->push_timeout);
+            break;
+        case PROP_SYNC_INPUTS:
+            g_value_set_boolean (value, mux->sync_inputs);
+            break;
+        case PROP_WIDTH:
+            g_value_set_int (value, mux->width);
+            break;
+        case PROP_HEIGHT:
+            g_value_set_int (value, mux->height);
+            break;
+        case PROP_LIVE_SOURCE:
+            g_value_set_boolean (value, mux->live_source);
+            break;
+        case PROP_GPU_ID:
+            g_value_set_uint (value, mux->gpu_id);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+    g_mutex_unlock (&mux->lock);
+}
+
+static void gst_cpu_batch_mux_finalize (GObject *object)
+{
+    GstCpuBatchMux *mux = GST_CPU_BATCH_MUX (object);
+
+    g_ptr_array_unref (mux->pads);
+    g_mutex_clear (&mux->lock);
+    g_cond_clear (&mux->cond);
+
+    G_OBJECT_CLASS (gst_cpu_batch_mux_parent_class)->finalize (object);
+}
+
+static void gst_cpu_batch_mux_class_init (GstCpuBatchMuxClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+    GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+    gobject_class->set_property = gst_cpu_batch_mux_set_property;
+    gobject_class->get_property = gst_cpu_batch_mux_get_property;
+    gobject_class->finalize = gst_cpu_batch_mux_finalize;
+
+    g_object_class_install_property (gobject_class, PROP_BATCH_SIZE,
+            g_param_spec_uint ("batch-size", "Batch size", "Buffers per batch, 0 for one per linked source",
+                0, G_MAXUINT, 0, (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property (gobject_class, PROP_BATCHED_PUSH_TIMEOUT,
+            g_param_spec_int ("batched-push-timeout", "Batched push timeout",
+                "us after the first buffer of a batch to push it incomplete, -1 to wait for a full batch",
+                -1, G_MAXINT, -1, (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property (gobject_class, PROP_SYNC_INPUTS,
+            g_param_spec_boolean ("sync-inputs", "Sync inputs", "Hold buffers until their running time",
+                FALSE, (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property (gobject_class, PROP_WIDTH,
+            g_param_spec_int ("width", "Width", "Accepted for nvstreammux compatibility, unused",
+                0, G_MAXINT, 0, (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property (gobject_class, PROP_HEIGHT,
+            g_param_spec_int ("height", "Height", "Accepted for nvstreammux compatibility, unused",
+                0, G_MAXINT, 0, (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property (gobject_class, PROP_LIVE_SOURCE,
+            g_param_spec_boolean ("live-source", "Live source", "Accepted for nvstreammux compatibility, unused",
+                FALSE, (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property (gobject_class, PROP_GPU_ID,
+            g_param_spec_uint ("gpu-id", "GPU id", "Accepted for nvstreammux compatibility, unused",
+                0, G_MAXUINT, 0, (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+    element_class->request_new_pad = GST_DEBUG_FUNCPTR (gst_cpu_batch_mux_request_new_pad);
+    element_class->release_pad = GST_DEBUG_FUNCPTR (gst_cpu_batch_mux_release_pad);
+    element_class->change_state = GST_DEBUG_FUNCPTR (gst_cpu_batch_mux_change_state);
+
+    gst_element_class_add_static_pad_template (element_class, &mux_sink_template);
+    gst_element_class_add_static_pad_template (element_class, &mux_src_template);
+    gst_element_class_set_static_metadata (element_class, "CPU batch muxer", "Generic/Muxer",
+            "Batches one buffer per source into buffer lists, like nvstreammux without a GPU", "local");
+}
+
+static void gst_cpu_batch_mux_init (GstCpuBatchMux *mux)
+{
+    mux->srcpad = gst_pad_new_from_static_template (&mux_src_template, "src");
+    gst_element_add_pad (GST_ELEMENT (mux), mux->srcpad);
+
+    g_mutex_init (&mux->lock);
+    g_cond_init (&mux->cond);
+    mux->pads = g_ptr_array_new ();
+    mux->push_timeout = -1;
+    hdr_init (&mux->formation);
+}
+
+/* ---------------------------------------------------------------------- */
+/* cpubatchdemux */
+
+typedef struct _GstCpuBatchDemux
+{
+    GstElement element;
+    GstPad *sinkpad;
+
+    /* source id -> src pad */
+    GMutex lock;
+    GHashTable *srcpads;
+}GstCpuBatchDemux;
+
+typedef struct _GstCpuBatchDemuxClass
+{
+    GstElementClass parent_class;
+}GstCpuBatchDemuxClass;
+
+#define GST_TYPE_CPU_BATCH_DEMUX (gst_cpu_batch_demux_get_type ())
+#define GST_CPU_BATCH_DEMUX(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_TYPE_CPU_BATCH_DEMUX, GstCpuBatchDemux))
+
+GType gst_cpu_batch_demux_get_type (void);
+G_DEFINE_TYPE (GstCpuBatchDemux, gst_cpu_batch_demux, GST_TYPE_ELEMENT);
+
+static GstStaticPadTemplate demux_sink_template = GST_STATIC_PAD_TEMPLATE ("sink",
+        GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS_ANY);
+
+static GstStaticPadTemplate demux_src_template = GST_STATIC_PAD_TEMPLATE ("src_%u",
+        GST_PAD_SRC, GST_PAD_REQUEST, GST_STATIC_CAPS_ANY);
+
+static GstFlowReturn gst_cpu_batch_demux_push_buffer (GstCpuBatchDemux *demux, GstBuffer *buffer)
+{
+    GstCpuBatchMeta *meta = gst_buffer_get_cpu_batch_meta (buffer);
+    guint source_id = meta ? meta->source_id : 0;
+    GstPad *srcpad;
+
+    g_mutex_lock (&demux->lock);
+    srcpad = (GstPad *) g_hash_table_lookup (demux->srcpads, GUINT_TO_POINTER (source_id));
+    if (srcpad)
+        gst_object_ref (srcpad);
+    g_mutex_unlock (&demux->lock);
+
+    if (!srcpad)
+    {
+        gst_buffer_unref (buffer);
+        return GST_FLOW_NOT_LINKED;
+    }
+
+    GstFlowReturn ret = gst_pad_push (srcpad, buffer);
+    gst_object_unref (srcpad);
+
+    return ret;
+}
+
+/* one source going away must not stop the others */
+static GstFlowReturn gst_cpu_batch_demux_combine (GstFlowReturn ret, GstFlowReturn pad_ret)
+{
+    if (pad_ret == GST_FLOW_NOT_LINKED || pad_ret == GST_FLOW_EOS || ret < GST_FLOW_OK)
+        return ret;
+
+    return pad_ret;
+}
+
+static GstFlowReturn gst_cpu_batch_demux_chain_list (GstPad *pad, GstObject *parent, GstBufferList *list)
+{
+    GstCpuBatchDemux *demux = GST_CPU_BATCH_DEMUX (parent);
+    GstFlowReturn ret = GST_FLOW_OK;
+    guint i, len = gst_buffer_list_length (list);
+
+    for (i = 0; i < len; i++)
+    {
+        GstBuffer *buffer = gst_buffer_ref (gst_buffer_list_get (list, i));
+        ret = gst_cpu_batch_demux_combine (ret, gst_cpu_batch_demux_push_buffer (demux, buffer));
+    }
+    gst_buffer_list_unref (list);
+
+    return ret;
+}
+
+static GstFlowReturn gst_cpu_batch_demux_chain (GstPad *pad, GstObject *parent, GstBuffer *buffer)
+{
+    GstCpuBatchDemux *demux = GST_CPU_BATCH_DEMUX (parent);
+
+    return gst_cpu_batch_demux_combine (GST_FLOW_OK, gst_cpu_batch_demux_push_buffer (demux, buffer));
+}
+
+static gboolean gst_cpu_batch_demux_copy_sticky (GstPad *pad, GstEvent **event, gpointer user_data)
+{
+    gst_pad_store_sticky_event (GST_PAD (user_data), *event);
+    return TRUE;
+}
+
+static GstPad *gst_cpu_batch_demux_request_new_pad (GstElement *element, GstPadTemplate *templ, const gchar *name,
+        const GstCaps *caps)
+{
+    GstCpuBatchDemux *demux = GST_CPU_BATCH_DEMUX (element);
+    guint source_id = 0;
+    gchar *pad_name;
+    GstPad *pad;
+
+    if (!name || sscanf (name, "src_%u", &source_id) != 1)
+    {
+        g_mutex_lock (&demux->lock);
+        while (g_hash_table_contains (demux->srcpads, GUINT_TO_POINTER (source_id)))
+            source_id++;
+        g_mutex_unlock (&demux->lock);
+    }
+
+    pad_name = g_strdup_printf ("src_%u", source_id);
+    if (!gst_cpu_batch_pad_name_free (element, pad_name))
+        return NULL;
+    pad = gst_pad_new_from_template (templ, pad_name);
+    g_free (pad_name);
+
+    if (!gst_element_add_pad (element, pad))
+        return NULL;
+
+    /* a source linked while running starts with the current caps and segment */
+    gst_pad_sticky_events_foreach (demux->sinkpad, gst_cpu_batch_demux_copy_sticky, pad);
+
+    g_mutex_lock (&demux->lock);
+    g_hash_table_insert (demux->srcpads, GUINT_TO_POINTER (source_id), pad);
+    g_mutex_unlock (&demux->lock);
+
+    return pad;
+}
+
+static void gst_cpu_batch_demux_release_pad (GstElement *element, GstPad *pad)
+{
+    GstCpuBatchDemux *demux = GST_CPU_BATCH_DEMUX (element);
+    guint source_id;
+
+    if (sscanf (GST_OBJECT_NAME (pad), "src_%u", &source_id) == 1)
+    {
+        g_mutex_lock (&demux->lock);
+        g_hash_table_remove (demux->srcpads, GUINT_TO_POINTER (source_id));
+        g_mutex_unlock (&demux->lock);
+    }
+
+    gst_element_remove_pad (element, pad);
+}
+
+static void gst_cpu_batch_demux_finalize (GObject *object)
+{
+    GstCpuBatchDemux *demux = GST_CPU_BATCH_DEMUX (object);
+
+    g_hash_table_unref (demux->srcpads);
+    g_mutex_clear (&demux->lock);
+
+    G_OBJECT_CLASS (gst_cpu_batch_demux_parent_class)->finalize (object);
+}
+
+static void gst_cpu_batch_demux_class_init (GstCpuBatchDemuxClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+    GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+    gobject_class->finalize = gst_cpu_batch_demux_finalize;
+
+    element_class->request_new_pad = GST_DEBUG_FUNCPTR (gst_cpu_batch_demux_request_new_pad);
+    element_class->release_pad = GST_DEBUG_FUNCPTR (gst_cpu_batch_demux_release_pad);
+
+    gst_element_class_add_static_pad_template (element_class, &demux_sink_template);
+    gst_element_class_add_static_pad_template (element_class, &demux_src_template);
+    gst_element_class_set_static_metadata (element_class, "CPU batch demuxer", "Generic/Demuxer",
+            "Splits cpubatchmux batches back into one stream per source", "local");
+}
+
+static void gst_cpu_batch_demux_init (GstCpuBatchDemux *demux)
+{
+    demux->sinkpad = gst_pad_new_from_static_template (&demux_sink_template, "sink");
+    gst_pad_set_chain_function (demux->sinkpad, GST_DEBUG_FUNCPTR (gst_cpu_batch_demux_chain));
+    gst_pad_set_chain_list_function (demux->sinkpad, GST_DEBUG_FUNCPTR (gst_cpu_batch_demux_chain_list));
+    gst_element_add_pad (GST_ELEMENT (demux), demux->sinkpad);
+
+    g_mutex_init (&demux->lock);
+    demux->srcpads = g_hash_table_new (g_direct_hash, g_direct_equal);
+}
+
+/* ---------------------------------------------------------------------- */
+
+static gboolean plugin_init (GstPlugin *plugin)
+{
+    return gst_element_register (plugin, "cpubatchmux", GST_RANK_NONE, GST_TYPE_CPU_BATCH_MUX) &&
+        gst_element_register (plugin, "cpubatchdemux", GST_RANK_NONE, GST_TYPE_CPU_BATCH_DEMUX);
+}
+
+GST_PLUGIN_DEFINE (GST_VERSION_MAJOR, GST_VERSION_MINOR, cpubatchmux,
+        "CPU only batching muxer and demuxer with nvstreammux pad conventions",
+        plugin_init, "1.0", "LGPL", PACKAGE, "local")
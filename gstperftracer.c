@@ -0,0 +1,592 @@
+/*
+ * gcc -shared -fPIC -O2 gstperftracer.c -o libgstperftracer.so `pkg-config --cflags --libs gstreamer-1.0`
+ *
+ * GST_PLUGIN_PATH=. GST_TRACERS="perftracer" ./a.out ...
+ * GST_PLUGIN_PATH=. GST_TRACERS="perftracer(interval=2,overhead=1)" ./a.out ...
+ *
+ * Tracer that replaces the ad hoc timing probes of the samples, it works on
+ * any pipeline without touching the application. It hooks pad-push,
+ * pad-push-list and pad-pull-range and reports every interval seconds
+ * (default 5, 0 disables the timer) and when a pipeline goes to NULL:
+ *
+ *  - per element the buffers it received and its processing time. The time
+ *    of a push is charged to the element receiving it minus the time of the
+ *    pushes that element makes downstream from the same thread, so every
+ *    element only gets its own work. Time spent waiting, e.g. a synced sink
+ *    on the clock or a full queue, counts as processing of that element.
+ *  - per src pad buffers/s and MB/s over the last interval.
+ *  - per queue, queue2 and multiqueue the time buffers stay inside, matched
+ *    by buffer pointer from the push into the queue to the push out of it.
+ *
+ * Percentiles are since start, rates are per interval. overhead=1 times
+ * every hook with the thread CPU clock and reports it against the process
+ * CPU time, compare with a run without GST_TRACERS for the full picture.
+ * */
+
+#include <gst/gst.h>
+#include <string.h>
+#include <time.h>
+
+#include "hdr_histogram.h"
+
+#define PACKAGE "perftracer"
+
+/* buffers recorded in one queue before the oldest entries are assumed to
+ * have been dropped inside it */
+#define PERF_QUEUE_MAX_IN_FLIGHT (4096)
+
+typedef struct _PerfElementStats
+{
+    gchar *name;
+    guint64 buffers;
+    guint64 self_ns;
+    guint64 last_buffers;
+    guint64 last_self_ns;
+    /* ns of own processing per push */
+    HdrHistogram self_time;
+
+    /* queues only: GstBuffer * -> ns when it entered */
+    gboolean is_queue;
+    GMutex lock;
+    GHashTable *in_flight;
+    HdrHistogram *residency;
+}PerfElementStats;
+
+typedef struct _PerfPadStats
+{
+    gchar *name;
+    guint64 buffers;
+    guint64 bytes;
+    guint64 last_buffers;
+    guint64 last_bytes;
+}PerfPadStats;
+
+/* one push in progress on the current thread */
+typedef struct _PerfFrame
+{
+    PerfElementStats *element;
+    guint64 start;
+    guint64 child_ns;
+    guint64 hook_cpu;
+}PerfFrame;
+
+typedef struct _GstPerfTracer
+{
+    GstTracer parent;
+
+    /* protects the registries and the report */
+    GMutex lock;
+    GPtrArray *elements;
+    GPtrArray *pads;
+    guint64 last_report;
+
+    guint interval;
+    gboolean overhead;
+    guint64 hook_cpu_ns;
+    guint64 process_cpu_start;
+
+    GThread *reporter;
+    GMutex reporter_lock;
+    GCond reporter_cond;
+    gboolean stopping;
+}GstPerfTracer;
+
+typedef struct _GstPerfTracerClass
+{
+    GstTracerClass parent_class;
+}GstPerfTracerClass;
+
+#define GST_TYPE_PERF_TRACER (gst_perf_tracer_get_type ())
+#define GST_PERF_TRACER(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_TYPE_PERF_TRACER, GstPerfTracer))
+
+GType gst_perf_tracer_get_type (void);
+G_DEFINE_TYPE (GstPerfTracer, gst_perf_tracer, GST_TYPE_TRACER);
+
+static GQuark perf_element_quark;
+static GQuark perf_pad_quark;
+
+static void perf_stack_free (gpointer data)
+{
+    g_array_unref ((GArray *) data);
+}
+
+static GPrivate perf_stack_key = G_PRIVATE_INIT (perf_stack_free);
+
+static GArray *perf_stack (void)
+{
+    GArray *stack = (GArray *) g_private_get (&perf_stack_key);
+
+    if (G_UNLIKELY (!stack))
+    {
+        stack = g_array_sized_new (FALSE, FALSE, sizeof (PerfFrame), 16);
+        g_private_set (&perf_stack_key, stack);
+    }
+
+    return stack;
+}
+
+static guint64 perf_clock_ns (clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime (clock, &ts);
+    return ts.tv_sec * G_GUINT64_CONSTANT (1000000000) + ts.tv_nsec;
+}
+
+static gboolean perf_element_is_queue (GstElement *element)
+{
+    GstElementFactory *factory = gst_element_get_factory (element);
+    const gchar *name;
+
+    if (!factory)
+        return FALSE;
+
+    name = gst_plugin_feature_get_name (GST_PLUGIN_FEATURE (factory));
+
+    return !g_strcmp0 (name, "queue") || !g_strcmp0 (name, "queue2") || !g_strcmp0 (name, "multiqueue");
+}
+
+/* Stats live as long as the tracer, the object only points at them so a
+ * report can still show elements that are gone. */
+static PerfElementStats *perf_element_stats (GstPerfTracer *self, GstElement *element)
+{
+    PerfElementStats *stats = (PerfElementStats *) g_object_get_qdata (G_OBJECT (element), perf_element_quark);
+
+    if (G_LIKELY (stats))
+        return stats;
+
+    g_mutex_lock (&self->lock);
+    stats = (PerfElementStats *) g_object_get_qdata (G_OBJECT (element), perf_element_quark);
+    if (!stats)
+    {
+        stats = g_new0 (PerfElementStats, 1);
+        stats->name = gst_object_get_name (GST_OBJECT (element));
+        hdr_init (&stats->self_time);
+        g_mutex_init (&stats->lock);
+        stats->is_queue = perf_element_is_queue (element);
+        if (stats->is_queue)
+        {
+            stats->in_flight = g_hash_table_new (g_direct_hash, g_direct_equal);
+            stats->residency = g_new (HdrHistogram, 1);
+            hdr_init (stats->residency);
+        }
+        g_object_set_qdata (G_OBJECT (element), perf_element_quark, stats);
+        g_ptr_array_add (self->elements, stats);
+    }
+    g_mutex_unlock (&self->lock);
+
+    return stats;
+}
+
+static PerfPadStats *perf_pad_stats (GstPerfTracer *self, GstPad *pad)
+{
+    PerfPadStats *stats = (PerfPadStats *) g_object_get_qdata (G_OBJECT (pad), perf_pad_quark);
+
+    if (G_LIKELY (stats))
+        return stats;
+
+    g_mutex_lock (&self->lock);
+    stats = (PerfPadStats *) g_object_get_qdata (G_OBJECT (pad), perf_pad_quark);
+    if (!stats)
+    {
+        GstObject *parent = GST_OBJECT_PARENT (pad);
+
+        stats = g_new0 (PerfPadStats, 1);
+        stats->name = g_strdup_printf ("%s:%s", parent ? GST_OBJECT_NAME (parent) : "", GST_OBJECT_NAME (pad));
+        g_object_set_qdata (G_OBJECT (pad), perf_pad_quark, stats);
+        g_ptr_array_add (self->pads, stats);
+    }
+    g_mutex_unlock (&self->lock);
+
+    return stats;
+}
+
+static void perf_element_stats_free (PerfElementStats *stats)
+{
+    if (stats->in_flight)
+        g_hash_table_unref (stats->in_flight);
+    g_free (stats->residency);
+    g_mutex_clear (&stats->lock);
+    g_free (stats->name);
+    g_free (stats);
+}
+
+static void perf_pad_stats_free (PerfPadStats *stats)
+{
+    g_free (stats->name);
+    g_free (stats);
+}
+
+/* Element that does the work for a push on @pad, NULL for bins and the
+ * proxy pads of ghost pads, which only forward. */
+static GstElement *perf_peer_element (GstPad *pad)
+{
+    GstPad *peer = GST_PAD_PEER (pad);
+    GstObject *parent;
+
+    if (!peer)
+        return NULL;
+
+    parent = GST_OBJECT_PARENT (peer);
+    if (!parent || !GST_IS_ELEMENT (parent) || GST_IS_BIN (parent))
+        return NULL;
+
+    return GST_ELEMENT (parent);
+}
+
+static void perf_push_enter (GstPerfTracer *self, guint64 ts, GstPad *pad, GstBuffer *buffer, guint n_buffers,
+        gsize bytes)
+{
+    guint64 hook_start = self->overhead ? perf_clock_ns (CLOCK_THREAD_CPUTIME_ID) : 0;
+    GstElement *peer = perf_peer_element (pad);
+    GstObject *parent = GST_OBJECT_PARENT (pad);
+    PerfFrame frame = { NULL, ts, 0, 0 };
+
+    if (parent && GST_IS_ELEMENT (parent) && !GST_IS_BIN (parent))
+    {
+        PerfPadStats *pad_stats = perf_pad_stats (self, pad);
+        PerfElementStats *src_stats = perf_element_stats (self, GST_ELEMENT (parent));
+
+        __atomic_fetch_add (&pad_stats->buffers, n_buffers, __ATOMIC_RELAXED);
+        __atomic_fetch_add (&pad_stats->bytes, bytes, __ATOMIC_RELAXED);
+
+        /* leaving a queue */
+        if (src_stats->is_queue && buffer)
+        {
+            gpointer start;
+
+            g_mutex_lock (&src_stats->lock);
+            if (g_hash_table_steal_extended (src_stats->in_flight, buffer, NULL, &start))
+                hdr_record (src_stats->residency, ts - GPOINTER_TO_SIZE (start));
+            g_mutex_unlock (&src_stats->lock);
+        }
+    }
+
+    if (peer)
+    {
+        frame.element = perf_element_stats (self, peer);
+        __atomic_fetch_add (&frame.element->buffers, n_buffers, __ATOMIC_RELAXED);
+
+        /* entering a queue */
+        if (frame.element->is_queue && buffer)
+        {
+            g_mutex_lock (&frame.element->lock);
+            if (g_hash_table_size (frame.element->in_flight) >= PERF_QUEUE_MAX_IN_FLIGHT)
+                g_hash_table_remove_all (frame.element->in_flight);
+            g_hash_table_insert (frame.element->in_flight, buffer, GSIZE_TO_POINTER ((gsize) ts));
+            g_mutex_unlock (&frame.element->lock);
+        }
+    }
+
+    if (self->overhead)
+    {
+        frame.hook_cpu = perf_clock_ns (CLOCK_THREAD_CPUTIME_ID) - hook_start;
+        frame.start = gst_util_get_timestamp ();
+    }
+    g_array_append_val (perf_stack (), frame);
+}
+
+static void perf_push_leave (GstPerfTracer *self, guint64 ts)
+{
+    guint64 hook_start = self->overhead ? perf_clock_ns (CLOCK_THREAD_CPUTIME_ID) : 0;
+    GArray *stack = perf_stack ();
+    PerfFrame *frame;
+    guint64 total, self_ns;
+
+    if (G_UNLIKELY (stack->len == 0))
+        return;
+
+    frame = &g_array_index (stack, PerfFrame, stack->len - 1);
+    total = ts > frame->start ? ts - frame->start : 0;
+    self_ns = total > frame->child_ns ? total - frame->child_ns : 0;
+
+    if (frame->element)
+    {
+        __atomic_fetch_add (&frame->element->self_ns, self_ns, __ATOMIC_RELAXED);
+        hdr_record (&frame->element->self_time, self_ns);
+    }
+
+    if (stack->len > 1)
+        g_array_index (stack, PerfFrame, stack->len - 2).child_ns += total;
+
+    if (self->overhead)
+        __atomic_fetch_add (&self->hook_cpu_ns, frame->hook_cpu + perf_clock_ns (CLOCK_THREAD_CPUTIME_ID) - hook_start,
+                __ATOMIC_RELAXED);
+
+    g_array_set_size (stack, stack->len - 1);
+}
+
+static void do_push_buffer_pre (GstPerfTracer *self, guint64 ts, GstPad *pad, GstBuffer *buffer)
+{
+    perf_push_enter (self, ts, pad, buffer, 1, gst_buffer_get_size (buffer));
+}
+
+static void do_push_buffer_list_pre (GstPerfTracer *self, guint64 ts, GstPad *pad, GstBufferList *list)
+{
+    perf_push_enter (self, ts, pad, NULL, gst_buffer_list_length (list), gst_buffer_list_calculate_size (list));
+}
+
+static void do_push_post (GstPerfTracer *self, guint64 ts, GstPad *pad, GstFlowReturn res)
+{
+    perf_push_leave (self, ts);
+}
+
+/* a pull makes the upstream element work for the pulling pad */
+static void do_pull_range_pre (GstPerfTracer *self, guint64 ts, GstPad *pad, guint64 offset, guint size)
+{
+    perf_push_enter (self, ts, pad, NULL, 0, 0);
+}
+
+static void do_pull_range_post (GstPerfTracer *self, guint64 ts, GstPad *pad, GstBuffer *buffer, GstFlowReturn res)
+{
+    if (buffer)
+    {
+        PerfPadStats *pad_stats = perf_pad_stats (self, pad);
+
+        __atomic_fetch_add (&pad_stats->buffers, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add (&pad_stats->bytes, gst_buffer_get_size (buffer), __ATOMIC_RELAXED);
+    }
+    perf_push_leave (self, ts);
+}
+
+static void gst_perf_tracer_report (GstPerfTracer *self)
+{
+    guint64 now = gst_util_get_timestamp ();
+    gdouble elapsed;
+    guint i;
+
+    g_mutex_lock (&self->lock);
+    elapsed = (now - self->last_report) / 1e9;
+    self->last_report = now;
+
+    g_print ("perftracer: %.1f s interval\n", elapsed);
+    g_print ("  %-28s %10s %8s %8s %10s %10s\n", "element", "buffers", "buf/s", "busy%", "p50 us", "p99 us");
+    for (i = 0; i < self->elements->len; i++)
+    {
+        PerfElementStats *stats = (PerfElementStats *) g_ptr_array_index (self->elements, i);
+        guint64 buffers = __atomic_load_n (&stats->buffers, __ATOMIC_RELAXED);
+        guint64 self_ns = __atomic_load_n (&stats->self_ns, __ATOMIC_RELAXED);
+
+        if (buffers == 0)
+            continue;
+
+        g_print ("  %-28s %10" G_GUINT64_FORMAT " %8.1f %8.2f %10.1f %10.1f\n", stats->name, buffers,
+                elapsed > 0 ? (buffers - stats->last_buffers) / elapsed : 0.0,
+                elapsed > 0 ? (self_ns - stats->last_self_ns) / (elapsed * 1e7) : 0.0,
+                hdr_percentile (&stats->self_time, 50) / 1e3, hdr_percentile (&stats->self_time, 99) / 1e3);
+        stats->last_buffers = buffers;
+        stats->last_self_ns = self_ns;
+    }
+
+    for (i = 0; i < self->elements->len; i++)
+    {
+        PerfElementStats *stats = (PerfElementStats *) g_ptr_array_index (self->elements, i);
+
+        if (!stats->is_queue || hdr_count (stats->residency) == 0)
+            continue;
+
+        g_print ("  queue %-22s residency p50 %.2f p99 %.2f max %.2f ms\n", stats->name,
+                hdr_percentile (stats->residency, 50) / 1e6, hdr_percentile (stats->residency, 99) / 1e6,
+                hdr_max (stats->residency) / 1e6);
+    }
+
+    for (i = 0; i < self->pads->len; i++)
+    {
+        PerfPadStats *stats = (PerfPadStats *) g_ptr_array_index (self->pads, i);
+        guint64 buffers = __atomic_load_n (&stats->buffers, __ATOMIC_RELAXED);
+        guint64 bytes = __atomic_load_n (&stats->bytes, __ATOMIC_RELAXED);
+
+        if (buffers == stats->last_buffers || elapsed <= 0)
+            continue;
+
+        g_print ("  pad %-24s %8.1f buf/s %8.2f MB/s\n", stats->name, (buffers - stats->last_buffers) / elapsed,
+                (bytes - stats->last_bytes) / elapsed / 1e6);
+        stats->last_buffers = buffers;
+        stats->last_bytes = bytes;
+    }
+
+    if (self->overhead)
+    {
+        guint64 process_cpu = perf_clock_ns (CLOCK_PROCESS_CPUTIME_ID) - self->process_cpu_start;
+        guint64 hook_cpu = __atomic_load_n (&self->hook_cpu_ns, __ATOMIC_RELAXED);
+
+        g_print ("  tracer hooks %.1f ms cpu, %.2f%% of process cpu\n", hook_cpu / 1e6,
+                process_cpu ? hook_cpu * 100.0 / process_cpu : 0.0);
+    }
+    g_mutex_unlock (&self->lock);
+}
+
+static void do_element_change_state_post (GstPerfTracer *self, guint64 ts, GstElement *element,
+        GstStateChange transition, GstStateChangeReturn result)
+{
+    if (transition == GST_STATE_CHANGE_READY_TO_NULL && GST_IS_PIPELINE (element))
+        gst_perf_tracer_report (self);
+}
+
+static gpointer gst_perf_tracer_reporter (gpointer data)
+{
+    GstPerfTracer *self = GST_PERF_TRACER (data);
+
+    g_mutex_lock (&self->reporter_lock);
+    while (!self->stopping)
+    {
+        gint64 end = g_get_monotonic_time () + self->interval * G_TIME_SPAN_SECOND;
+
+        while (!self->stopping && g_cond_wait_until (&self->reporter_cond, &self->reporter_lock, end))
+            ;
+        if (self->stopping)
+            break;
+
+        g_mutex_unlock (&self->reporter_lock);
+        gst_perf_tracer_report (self);
+        g_mutex_lock (&self->reporter_lock);
+    }
+    g_mutex_unlock (&self->reporter_lock);
+
+    return NULL;
+}
+
+/* "interval=2" parses as an int, "interval=(uint)2" as an uint and
+ * "overhead=true" as a boolean, any of them is fine for any field. */
+static gboolean gst_perf_tracer_param_value (const GValue *value, guint *out)
+{
+    if (G_VALUE_HOLDS_INT (value) && g_value_get_int (value) >= 0)
+        *out = g_value_get_int (value);
+    else if (G_VALUE_HOLDS_UINT (value))
+        *out = g_value_get_uint (value);
+    else if (G_VALUE_HOLDS_BOOLEAN (value))
+        *out = g_value_get_boolean (value);
+    else
+        return FALSE;
+
+    return TRUE;
+}
+
+static gboolean gst_perf_tracer_parse_field (GQuark field, const GValue *value, gpointer user_data)
+{
+    GstPerfTracer *self = GST_PERF_TRACER (user_data);
+    const gchar *name = g_quark_to_string (field);
+    guint v;
+
+    if (strcmp (name, "interval") && strcmp (name, "overhead"))
+    {
+        g_printerr ("perftracer: unknown param '%s'\n", name);
+        return TRUE;
+    }
+
+    if (!gst_perf_tracer_param_value (value, &v))
+    {
+        gchar *str = gst_value_serialize (value);
+        g_printerr ("perftracer: invalid value '%s' for param '%s'\n", str ? str : "?", name);
+        g_free (str);
+        return TRUE;
+    }
+
+    if (!strcmp (name, "interval"))
+        self->interval = v;
+    else
+        self->overhead = v != 0;
+
+    return TRUE;
+}
+
+/* params look like "interval=2,overhead=1" */
+static void gst_perf_tracer_parse_params (GstPerfTracer *self)
+{
+    gchar *params = NULL, *desc;
+    GstStructure *s;
+
+    g_object_get (self, "params", &params, NULL);
+    if (!params)
+        return;
+
+    desc = g_strdup_printf ("perftracer,%s", params);
+    s = gst_structure_from_string (desc, NULL);
+    if (s)
+    {
+        gst_structure_foreach (s, gst_perf_tracer_parse_field, self);
+        gst_structure_free (s);
+    }
+    else
+        g_printerr ("perftracer: can not parse params '%s'\n", params);
+
+    g_free (desc);
+    g_free (params);
+}
+
+static void gst_perf_tracer_constructed (GObject *object)
+{
+    GstPerfTracer *self = GST_PERF_TRACER (object);
+
+    G_OBJECT_CLASS (gst_perf_tracer_parent_class)->constructed (object);
+
+    gst_perf_tracer_parse_params (self);
+    if (self->interval > 0)
+        self->reporter = g_thread_new ("perftracer", gst_perf_tracer_reporter, self);
+}
+
+static void gst_perf_tracer_finalize (GObject *object)
+{
+    GstPerfTracer *self = GST_PERF_TRACER (object);
+
+    if (self->reporter)
+    {
+        g_mutex_lock (&self->reporter_lock);
+        self->stopping = TRUE;
+        g_cond_signal (&self->reporter_cond);
+        g_mutex_unlock (&self->reporter_lock);
+        g_thread_join (self->reporter);
+    }
+
+    gst_perf_tracer_report (self);
+
+    g_ptr_array_unref (self->elements);
+    g_ptr_array_unref (self->pads);
+    g_mutex_clear (&self->lock);
+    g_mutex_clear (&self->reporter_lock);
+    g_cond_clear (&self->reporter_cond);
+
+    G_OBJECT_CLASS (gst_perf_tracer_parent_class)->finalize (object);
+}
+
+static void gst_perf_tracer_class_init (GstPerfTracerClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+    gobject_class->constructed = gst_perf_tracer_constructed;
+    gobject_class->finalize = gst_perf_tracer_finalize;
+
+    perf_element_quark = g_quark_from_static_string ("perftracer-element");
+    perf_pad_quark = g_quark_from_static_string ("perftracer-pad");
+}
+
+static void gst_perf_tracer_init (GstPerfTracer *self)
+{
+    GstTracer *tracer = GST_TRACER (self);
+
+    g_mutex_init (&self->lock);
+    g_mutex_init (&self->reporter_lock);
+    g_cond_init (&self->reporter_cond);
+    self->elements = g_ptr_array_new_with_free_func ((GDestroyNotify) perf_element_stats_free);
+    self->pads = g_ptr_array_new_with_free_func ((GDestroyNotify) perf_pad_stats_free);
+    self->interval = 5;
+    self->last_report = gst_util_get_timestamp ();
+    self->process_cpu_start = perf_clock_ns (CLOCK_PROCESS_CPUTIME_ID);
+
+    gst_tracing_register_hook (tracer, "pad-push-pre", G_CALLBACK (do_push_buffer_pre));
+    gst_tracing_register_hook (tracer, "pad-push-post", G_CALLBACK (do_push_post));
+    gst_tracing_register_hook (tracer, "pad-push-list-pre", G_CALLBACK (do_push_buffer_list_pre));
+    gst_tracing_register_hook (tracer, "pad-push-list-post", G_CALLBACK (do_push_post));
+    gst_tracing_register_hook (tracer, "pad-pull-range-pre", G_CALLBACK (do_pull_range_pre));
+    gst_tracing_register_hook (tracer, "pad-pull-range-post", G_CALLBACK (do_pull_range_post));
+    gst_tracing_register_hook (tracer, "element-change-state-post", G_CALLBACK (do_element_change_state_post));
+}
+
+static gboolean plugin_init (GstPlugin *plugin)
+{
+    return gst_tracer_register (plugin, "perftracer", GST_TYPE_PERF_TRACER);
+}
+
+GST_PLUGIN_DEFINE (GST_VERSION_MAJOR, GST_VERSION_MINOR, perftracer,
+        "Per element processing time, pad rate and queue residency tracer",
+        plugin_init, "1.0", "LGPL", PACKAGE, "local")
@@ -0,0 +1,416 @@
+/*
+ * Annex-B start code scanning and access unit framing for raw H.264
+ * elementary streams.
+ *
+ * Header only and plain C so it can be included from both the C and the C++
+ * samples. h264_find_start_code() picks the widest implementation the CPU
+ * supports the first time it is called: AVX2, SSE2 or a scalar loop that
+ * skips three bytes whenever the third byte rules out a start code.
+ * */
+
+#ifndef __H264_STARTCODE_H__
+#define __H264_STARTCODE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define H264_SCAN_X86 1
+#endif
+
+typedef size_t (*H264FindStartCodeFunc) (const uint8_t *data, size_t size, size_t pos);
+
+/* All scanners return the offset of the first 00 00 01 prefix at or after
+ * @pos, or @size when there is none. */
+static inline size_t h264_find_start_code_scalar (const uint8_t *data, size_t size, size_t pos)
+{
+    size_t i = pos;
+
+    while (i + 2 < size)
+    {
+        if (data[i + 2] > 1)
+            i += 3;
+        else if (data[i + 2] == 1 && data[i + 1] == 0 && data[i] == 0)
+            return i;
+        else
+            i++;
+    }
+
+    return size;
+}
+
+#ifdef H264_SCAN_X86
+__attribute__((target("sse2")))
+static inline size_t h264_find_start_code_sse2 (const uint8_t *data, size_t size, size_t pos)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i one = _mm_set1_epi8 (1);
+    size_t i = pos;
+
+    /* each round tests the 16 candidate positions i .. i + 15 */
+    while (i + 18 <= size)
+    {
+        __m128i b0 = _mm_loadu_si128 ((const __m128i *) (data + i));
+        __m128i b1 = _mm_loadu_si128 ((const __m128i *) (data + i + 1));
+        __m128i b2 = _mm_loadu_si128 ((const __m128i *) (data + i + 2));
+        __m128i hit = _mm_and_si128 (_mm_and_si128 (_mm_cmpeq_epi8 (b0, zero), _mm_cmpeq_epi8 (b1, zero)),
+                _mm_cmpeq_epi8 (b2, one));
+        unsigned int mask = (unsigned int) _mm_movemask_epi8 (hit);
+
+        if (mask)
+            return i + __builtin_ctz (mask);
+        i += 16;
+    }
+
+    return h264_find_start_code_scalar (data, size, i);
+}
+
+__attribute__((target("avx2")))
+static inline size_t h264_find_start_code_avx2 (const uint8_t *data, size_t size, size_t pos)
+{
+    const __m256i zero = _mm256_setzero_si256 ();
+    const __m256i one = _mm256_set1_epi8 (1);
+    size_t i = pos;
+
+    /* each round tests the 32 candidate positions i .. i + 31 */
+    while (i + 34 <= size)
+    {
+        __m256i b0 = _mm256_loadu_si256 ((const __m256i *) (data + i));
+        __m256i b1 = _mm256_loadu_si256 ((const __m256i *) (data + i + 1));
+        __m256i b2 = _mm256_loadu_si256 ((const __m256i *) (data + i + 2));
+        __m256i hit = _mm256_and_si256 (_mm256_and_si256 (_mm256_cmpeq_epi8 (b0, zero), _mm256_cmpeq_epi8 (b1, zero)),
+                _mm256_cmpeq_epi8 (b2, one));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8 (hit);
+
+        if (mask)
+            return i + __builtin_ctz (mask);
+        i += 32;
+    }
+
+    return h264_find_start_code_sse2 (data, size, i);
+}
+#endif
+
+static inline H264FindStartCodeFunc h264_find_start_code_impl (const char **name)
+{
+    static H264FindStartCodeFunc func = NULL;
+    static const char *func_name = NULL;
+
+    if (!func)
+    {
+#ifdef H264_SCAN_X86
+        __builtin_cpu_init ();
+        if (__builtin_cpu_supports ("avx2"))
+        {
+            func_name = "avx2";
+            func = h264_find_start_code_avx2;
+        }
+        else if (__builtin_cpu_supports ("sse2"))
+        {
+            func_name = "sse2";
+            func = h264_find_start_code_sse2;
+        }
+        else
+#endif
+        {
+            func_name = "scalar";
+            func = h264_find_start_code_scalar;
+        }
+    }
+
+    if (name)
+        *name = func_name;
+
+    return func;
+}
+
+static inline size_t h264_find_start_code (const uint8_t *data, size_t size, size_t pos)
+{
+    return h264_find_start_code_impl (NULL) (data, size, pos);
+}
+
+/* Splits a mapped Annex-B stream into access units following the rules of
+ * H.264 7.4.1.2.3: once the current AU has a VCL NAL, an AUD, SEI, SPS, PPS,
+ * NAL types 14..18 or a slice with first_mb_in_slice == 0 start the next AU. */
+typedef struct _H264AuFramer
+{
+    const uint8_t *data;
+    size_t size;
+    /* offset of the next start code, size once the stream is exhausted */
+    size_t pos;
+}H264AuFramer;
+
+static inline void h264_au_framer_init (H264AuFramer *framer, const uint8_t *data, size_t size)
+{
+    framer->data = data;
+    framer->size = size;
+    framer->pos = h264_find_start_code (data, size, 0);
+}
+
+/* 4 byte start codes carry an extra leading zero that belongs to the NAL */
+static inline size_t h264_nal_begin (const H264AuFramer *framer, size_t start_code)
+{
+    return (start_code > 0 && framer->data[start_code - 1] == 0) ? start_code - 1 : start_code;
+}
+
+static inline int h264_nal_starts_au (const uint8_t *nal, size_t avail)
+{
+    uint8_t type = nal[0] & 0x1f;
+
+    if (type == 6 || type == 7 || type == 8 || type == 9 || (type >= 14 && type <= 18))
+        return 1;
+
+    /* first_mb_in_slice is ue(v), a value of 0 is coded as a single 1 bit */
+    if ((type == 1 || type == 5) && avail > 1 && (nal[1] & 0x80))
+        return 1;
+
+    return 0;
+}
+
+/* Returns 1 and the byte range of the next access unit, 0 at the end of the
+ * stream. */
+static inline int h264_au_framer_next (H264AuFramer *framer, size_t *offset, size_t *size)
+{
+    const uint8_t *data = framer->data;
+    size_t pos = framer->pos;
+    int seen_vcl = 0;
+
+    if (pos + 3 >= framer->size)
+        return 0;
+
+    *offset = h264_nal_begin (framer, pos);
+
+    while (pos + 3 < framer->size)
+    {
+        const uint8_t *nal = data + pos + 3;
+        size_t avail = framer->size - pos - 3;
+        uint8_t type = nal[0] & 0x1f;
+
+        if (seen_vcl && h264_nal_starts_au (nal, avail))
+        {
+            framer->pos = pos;
+            *size = h264_nal_begin (framer, pos) - *offset;
+            return 1;
+        }
+
+        if (type >= 1 && type <= 5)
+            seen_vcl = 1;
+
+        pos = h264_find_start_code (data, framer->size, pos + 3);
+    }
+
+    framer->pos = framer->size;
+    *size = framer->size - *offset;
+
+    return 1;
+}
+
+/* Exp-Golomb reader over an RBSP, skipping the emulation prevention byte of
+ * every 00 00 03. Reads past the end return zero bits and set overrun. */
+typedef struct _H264BitReader
+{
+    const uint8_t *data;
+    size_t size;
+    size_t byte;
+    int bit;
+    int zeros;
+    int overrun;
+}H264BitReader;
+
+static inline uint32_t h264_read_bit (H264BitReader *br)
+{
+    uint32_t v;
+
+    if (br->bit == 0 && br->byte < br->size && br->zeros >= 2 && br->data[br->byte] == 3)
+    {
+        br->byte++;
+        br->zeros = 0;
+    }
+    if (br->byte >= br->size)
+    {
+        br->overrun = 1;
+        return 0;
+    }
+
+    v = (br->data[br->byte] >> (7 - br->bit)) & 1;
+    if (++br->bit == 8)
+    {
+        br->zeros = br->data[br->byte] == 0 ? br->zeros + 1 : 0;
+        br->bit = 0;
+        br->byte++;
+    }
+
+    return v;
+}
+
+static inline uint32_t h264_read_bits (H264BitReader *br, int n)
+{
+    uint32_t v = 0;
+
+    while (n-- > 0)
+        v = (v << 1) | h264_read_bit (br);
+
+    return v;
+}
+
+static inline uint32_t h264_read_ue (H264BitReader *br)
+{
+    int leading = 0;
+
+    while (!h264_read_bit (br) && !br->overrun && leading < 32)
+        leading++;
+
+    return leading >= 32 ? 0 : ((1u << leading) - 1) + h264_read_bits (br, leading);
+}
+
+static inline int32_t h264_read_se (H264BitReader *br)
+{
+    uint32_t v = h264_read_ue (br);
+
+    return (v & 1) ? (int32_t) ((v + 1) / 2) : -(int32_t) (v / 2);
+}
+
+static inline void h264_skip_scaling_list (H264BitReader *br, int size)
+{
+    int last = 8, next = 8, i;
+
+    for (i = 0; i < size && !br->overrun; i++)
+    {
+        if (next != 0)
+            next = (last + h264_read_se (br) + 256) % 256;
+        last = next == 0 ? last : next;
+    }
+}
+
+/* What the samples need from a sequence parameter set: the frame rate of
+ * the VUI timing info, 0/0 when absent, and whether pic_order_cnt_type 2
+ * rules out reordering so that output order equals decode order. */
+typedef struct _H264SpsTiming
+{
+    uint32_t fps_n;
+    uint32_t fps_d;
+    int no_reordering;
+}H264SpsTiming;
+
+/* Parses the SPS NAL at @nal, header byte included, up to the VUI timing
+ * info (H.264 7.3.2.1.1 and E.1.1). Returns 0 when it is truncated. */
+static inline int h264_parse_sps_timing (const uint8_t *nal, size_t size, H264SpsTiming *timing)
+{
+    H264BitReader br = { nal, size, 1, 0, 0, 0 };
+    uint32_t profile_idc, poc_type, i, n;
+
+    timing->fps_n = timing->fps_d = 0;
+    timing->no_reordering = 0;
+
+    profile_idc = h264_read_bits (&br, 8);
+    h264_read_bits (&br, 16);   /* constraint flags, level_idc */
+    h264_read_ue (&br);         /* seq_parameter_set_id */
+
+    if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 || profile_idc == 244 ||
+            profile_idc == 44 || profile_idc == 83 || profile_idc == 86 || profile_idc == 118 ||
+            profile_idc == 128 || profile_idc == 138 || profile_idc == 139 || profile_idc == 134 ||
+            profile_idc == 135)
+    {
+        uint32_t chroma_format_idc = h264_read_ue (&br);
+
+        if (chroma_format_idc == 3)
+            h264_read_bit (&br);
+        h264_read_ue (&br);     /* bit_depth_luma_minus8 */
+        h264_read_ue (&br);     /* bit_depth_chroma_minus8 */
+        h264_read_bit (&br);    /* qpprime_y_zero_transform_bypass_flag */
+        if (h264_read_bit (&br))
+        {
+            n = chroma_format_idc == 3 ? 12 : 8;
+            for (i = 0; i < n; i++)
+            {
+                if (h264_read_bit (&br))
+                    h264_skip_scaling_list (&br, i < 6 ? 16 : 64);
+            }
+        }
+    }
+
+    h264_read_ue (&br);         /* log2_max_frame_num_minus4 */
+    poc_type = h264_read_ue (&br);
+    if (poc_type == 0)
+    {
+        h264_read_ue (&br);     /* log2_max_pic_order_cnt_lsb_minus4 */
+    }
+    else if (poc_type == 1)
+    {
+        h264_read_bit (&br);
+        h264_read_se (&br);
+        h264_read_se (&br);
+        n = h264_read_ue (&br);
+        for (i = 0; i < n && !br.overrun; i++)
+            h264_read_se (&br);
+    }
+    timing->no_reordering = poc_type == 2;
+
+    h264_read_ue (&br);         /* max_num_ref_frames */
+    h264_read_bit (&br);        /* gaps_in_frame_num_value_allowed_flag */
+    h264_read_ue (&br);         /* pic_width_in_mbs_minus1 */
+    h264_read_ue (&br);         /* pic_height_in_map_units_minus1 */
+    if (!h264_read_bit (&br))   /* frame_mbs_only_flag */
+        h264_read_bit (&br);
+    h264_read_bit (&br);        /* direct_8x8_inference_flag */
+    if (h264_read_bit (&br))    /* frame_cropping_flag */
+    {
+        for (i = 0; i < 4; i++)
+            h264_read_ue (&br);
+    }
+
+    if (br.overrun)
+        return 0;
+    if (!h264_read_bit (&br))   /* vui_parameters_present_flag */
+        return 1;
+
+    if (h264_read_bit (&br) && h264_read_bits (&br, 8) == 255)
+        h264_read_bits (&br, 32);   /* sar_width, sar_height */
+    if (h264_read_bit (&br))
+        h264_read_bit (&br);        /* overscan_appropriate_flag */
+    if (h264_read_bit (&br))
+    {
+        h264_read_bits (&br, 4);    /* video_format, video_full_range_flag */
+        if (h264_read_bit (&br))
+            h264_read_bits (&br, 24);
+    }
+    if (h264_read_bit (&br))
+    {
+        h264_read_ue (&br);
+        h264_read_ue (&br);
+    }
+    if (h264_read_bit (&br))        /* timing_info_present_flag */
+    {
+        uint32_t num_units_in_tick = h264_read_bits (&br, 32);
+        uint32_t time_scale = h264_read_bits (&br, 32);
+
+        /* a frame is two field ticks */
+        if (!br.overrun && num_units_in_tick > 0 && time_scale > 0)
+        {
+            timing->fps_n = time_scale;
+            timing->fps_d = 2 * num_units_in_tick;
+        }
+    }
+
+    return !br.overrun;
+}
+
+/* Looks for the first SPS in the Annex-B stream and parses it. */
+static inline int h264_find_sps_timing (const uint8_t *data, size_t size, H264SpsTiming *timing)
+{
+    size_t pos = h264_find_start_code (data, size, 0);
+
+    while (pos + 3 < size)
+    {
+        size_t next = h264_find_start_code (data, size, pos + 3);
+
+        if ((data[pos + 3] & 0x1f) == 7)
+            return h264_parse_sps_timing (data + pos + 3, next - pos - 3, timing);
+        pos = next;
+    }
+
+    return 0;
+}
+
+#endif /* __H264_STARTCODE_H__ */
@@ -0,0 +1,145 @@
+/*
+ * gcc -O2 h264_startcode_bench.c -o h264_startcode_bench
+ *
+ * ./h264_startcode_bench [input.h264]
+ *
+ * Micro-benchmark of the start code scanners in h264_startcode.h against a
+ * naive byte loop. Scans the given Annex-B file, or 256 MB of random data
+ * with a start code every 4 KB when no file is given, and prints GB/s for
+ * every implementation together with the number of start codes found.
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "h264_startcode.h"
+
+#define SYNTHETIC_SIZE (256 * 1024 * 1024)
+#define SYNTHETIC_NAL_SPACING (4096)
+#define ROUNDS (5)
+
+static size_t find_start_code_naive (const uint8_t *data, size_t size, size_t pos)
+{
+    size_t i;
+
+    for (i = pos; i + 2 < size; i++)
+    {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+            return i;
+    }
+
+    return size;
+}
+
+static double now_sec (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench (const char *name, H264FindStartCodeFunc func, const uint8_t *data, size_t size)
+{
+    double best = 0;
+    size_t count = 0;
+    int round;
+
+    for (round = 0; round < ROUNDS; round++)
+    {
+        double start = now_sec ();
+        size_t pos = func (data, size, 0);
+
+        count = 0;
+        while (pos < size)
+        {
+            count++;
+            pos = func (data, size, pos + 3);
+        }
+
+        double elapsed = now_sec () - start;
+        if (best == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    printf ("%-8s %8.2f GB/s  %zu start codes\n", name, size / best / 1e9, count);
+}
+
+static uint8_t *load_file (const char *path, size_t *size)
+{
+    FILE *fp = fopen (path, "rb");
+    uint8_t *data;
+
+    if (!fp)
+        return NULL;
+
+    fseek (fp, 0, SEEK_END);
+    *size = ftell (fp);
+    fseek (fp, 0, SEEK_SET);
+
+    data = (uint8_t *) malloc (*size);
+    if (fread (data, 1, *size, fp) != *size)
+    {
+        free (data);
+        data = NULL;
+    }
+    fclose (fp);
+
+    return data;
+}
+
+static uint8_t *make_synthetic (size_t *size)
+{
+    uint8_t *data = (uint8_t *) malloc (SYNTHETIC_SIZE);
+    size_t i;
+
+    srand (1);
+    for (i = 0; i < SYNTHETIC_SIZE; i++)
+        data[i] = rand () & 0xff;
+
+    for (i = 0; i + 4 < SYNTHETIC_SIZE; i += SYNTHETIC_NAL_SPACING)
+    {
+        data[i] = 0;
+        data[i + 1] = 0;
+        data[i + 2] = 1;
+        data[i + 3] = 0x41;
+    }
+
+    *size = SYNTHETIC_SIZE;
+    return data;
+}
+
+int main (int argc, char *argv[])
+{
+    const char *name;
+    size_t size;
+    uint8_t *data;
+
+    if (argc > 1)
+        data = load_file (argv[1], &size);
+    else
+        data = make_synthetic (&size);
+
+    if (!data)
+    {
+        fprintf (stderr, "failed to load input\n");
+        return -1;
+    }
+
+    h264_find_start_code_impl (&name);
+    printf ("scanning %zu bytes, dispatcher selects %s\n", size, name);
+
+    bench ("naive", find_start_code_naive, data, size);
+    bench ("scalar", h264_find_start_code_scalar, data, size);
+#ifdef H264_SCAN_X86
+    bench ("sse2", h264_find_start_code_sse2, data, size);
+    if (__builtin_cpu_supports ("avx2"))
+        bench ("avx2", h264_find_start_code_avx2, data, size);
+#endif
+
+    free (data);
+
+    return 0;
+}
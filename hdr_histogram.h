@@ -0,0 +1,171 @@
+/*
+ * Log-linear latency histogram in the spirit of HdrHistogram.
+ *
+ * Header only and plain C like h264_startcode.h. Values below
+ * HDR_SUB_COUNT get a bucket each, above that every power of two is split
+ * into HDR_SUB_COUNT / 2 linear buckets, so a recorded value is reported
+ * within 1 / (HDR_SUB_COUNT / 2), about 3%, of its true value over the
+ * whole 64 bit range. Recording only does relaxed atomic adds and a CAS for
+ * the extremes, any number of threads can record into one histogram while
+ * another reads percentiles from it.
+ * */
+
+#ifndef __HDR_HISTOGRAM_H__
+#define __HDR_HISTOGRAM_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#define HDR_SUB_BITS (6)
+#define HDR_SUB_COUNT (1 << HDR_SUB_BITS)
+#define HDR_HALF_COUNT (HDR_SUB_COUNT / 2)
+#define HDR_BUCKETS (HDR_SUB_COUNT + (64 - HDR_SUB_BITS) * HDR_HALF_COUNT)
+
+typedef struct _HdrHistogram
+{
+    uint64_t counts[HDR_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+}HdrHistogram;
+
+static inline void hdr_init (HdrHistogram *h)
+{
+    memset (h, 0, sizeof (*h));
+    h->min = UINT64_MAX;
+}
+
+static inline unsigned int hdr_bucket_index (uint64_t value)
+{
+    int shift;
+
+    if (value < HDR_SUB_COUNT)
+        return (unsigned int) value;
+
+    /* keep the top HDR_SUB_BITS bits, the highest of them is always set */
+    shift = 63 - __builtin_clzll (value) - (HDR_SUB_BITS - 1);
+
+    return HDR_SUB_COUNT + (shift - 1) * HDR_HALF_COUNT + (unsigned int) ((value >> shift) - HDR_HALF_COUNT);
+}
+
+/* highest value that lands in @index */
+static inline uint64_t hdr_bucket_value (unsigned int index)
+{
+    unsigned int shift, sub;
+
+    if (index < HDR_SUB_COUNT)
+        return index;
+
+    shift = (index - HDR_SUB_COUNT) / HDR_HALF_COUNT + 1;
+    sub = (index - HDR_SUB_COUNT) % HDR_HALF_COUNT + HDR_HALF_COUNT;
+
+    return (((uint64_t) sub + 1) << shift) - 1;
+}
+
+static inline void hdr_record (HdrHistogram *h, uint64_t value)
+{
+    uint64_t cur;
+
+    __atomic_fetch_add (&h->counts[hdr_bucket_index (value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&h->total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&h->sum, value, __ATOMIC_RELAXED);
+
+    cur = __atomic_load_n (&h->max, __ATOMIC_RELAXED);
+    while (value > cur && !__atomic_compare_exchange_n (&h->max, &cur, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    cur = __atomic_load_n (&h->min, __ATOMIC_RELAXED);
+    while (value < cur && !__atomic_compare_exchange_n (&h->min, &cur, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static inline uint64_t hdr_count (const HdrHistogram *h)
+{
+    return __atomic_load_n (&h->total, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t hdr_max (const HdrHistogram *h)
+{
+    return __atomic_load_n (&h->max, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t hdr_min (const HdrHistogram *h)
+{
+    uint64_t min = __atomic_load_n (&h->min, __ATOMIC_RELAXED);
+    return min == UINT64_MAX ? 0 : min;
+}
+
+static inline double hdr_mean (const HdrHistogram *h)
+{
+    uint64_t total = hdr_count (h);
+    return total ? (double) __atomic_load_n (&h->sum, __ATOMIC_RELAXED) / total : 0.0;
+}
+
+/* Value at or below which @percentile (0 .. 100) of the recorded values
+ * fall. Concurrent recording only makes the answer slightly stale. */
+static inline uint64_t hdr_percentile (const HdrHistogram *h, double percentile)
+{
+    uint64_t total = hdr_count (h), seen = 0, rank, max;
+    unsigned int i;
+
+    if (total == 0)
+        return 0;
+
+    rank = (uint64_t) (percentile / 100.0 * total + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    for (i = 0; i < HDR_BUCKETS; i++)
+    {
+        seen += __atomic_load_n (&h->counts[i], __ATOMIC_RELAXED);
+        if (seen >= rank)
+        {
+            /* the exact max is known, do not round past it */
+            max = hdr_max (h);
+            return hdr_bucket_value (i) < max ? hdr_bucket_value (i) : max;
+        }
+    }
+
+    return hdr_max (h);
+}
+
+/* Adds @src into @dst, e.g. to report over all decoders. */
+static inline void hdr_merge (HdrHistogram *dst, const HdrHistogram *src)
+{
+    unsigned int i;
+
+    for (i = 0; i < HDR_BUCKETS; i++)
+    {
+        uint64_t n = __atomic_load_n (&src->counts[i], __ATOMIC_RELAXED);
+        if (n)
+            __atomic_fetch_add (&dst->counts[i], n, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add (&dst->total, hdr_count (src), __ATOMIC_RELAXED);
+    __atomic_fetch_add (&dst->sum, __atomic_load_n (&src->sum, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    if (hdr_count (src))
+    {
+        if (hdr_max (src) > dst->max)
+            dst->max = hdr_max (src);
+        if (hdr_min (src) < dst->min)
+            dst->min = hdr_min (src);
+    }
+}
+
+/* Moves everything recorded so far into @dst and leaves @h empty, for
+ * interval reports while recording goes on. A value recorded concurrently
+ * ends up in either interval, min and max are per interval best effort. */
+static inline void hdr_take (HdrHistogram *h, HdrHistogram *dst)
+{
+    unsigned int i;
+
+    hdr_init (dst);
+    for (i = 0; i < HDR_BUCKETS; i++)
+        dst->counts[i] = __atomic_exchange_n (&h->counts[i], 0, __ATOMIC_RELAXED);
+    dst->total = __atomic_exchange_n (&h->total, 0, __ATOMIC_RELAXED);
+    dst->sum = __atomic_exchange_n (&h->sum, 0, __ATOMIC_RELAXED);
+    dst->max = __atomic_exchange_n (&h->max, 0, __ATOMIC_RELAXED);
+    dst->min = __atomic_exchange_n (&h->min, UINT64_MAX, __ATOMIC_RELAXED);
+}
+
+#endif /* __HDR_HISTOGRAM_H__ */
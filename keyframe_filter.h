@@ -0,0 +1,72 @@
+/*
+ * Keyframe-only decoding for sources whose analytics only need a frame
+ * every GOP or less.
+ *
+ * Header only, like hdr_histogram.h. keyframe_filter_probe() goes on the
+ * src pad of h264parse or h265parse as a BUFFER probe. It drops every delta
+ * unit, and every keyframe but the one of each interval-th GOP, before the
+ * decoder sees them. The access units that pass keep their own PTS and
+ * DTS, so downstream sees correctly timed frames with gaps between them.
+ * The parser needs config-interval=-1 so SPS/PPS travel with each IDR. The
+ * counters are updated with relaxed atomics and can be read from any
+ * thread.
+ * */
+
+#ifndef __KEYFRAME_FILTER_H__
+#define __KEYFRAME_FILTER_H__
+
+#include <gst/gst.h>
+#include <string.h>
+
+typedef struct _KeyframeFilter
+{
+    /* decode the keyframe of every interval-th GOP, 0 decodes everything */
+    guint interval;
+    guint64 gops;
+    guint64 seen;
+    guint64 passed;
+}KeyframeFilter;
+
+static inline void keyframe_filter_init (KeyframeFilter *f, guint interval)
+{
+    memset (f, 0, sizeof (*f));
+    f->interval = interval;
+}
+
+static GstPadProbeReturn keyframe_filter_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    KeyframeFilter *f = (KeyframeFilter *) user_data;
+    GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER (info);
+
+    __atomic_fetch_add (&f->seen, 1, __ATOMIC_RELAXED);
+
+    if (f->interval == 0)
+    {
+        __atomic_fetch_add (&f->passed, 1, __ATOMIC_RELAXED);
+        return GST_PAD_PROBE_OK;
+    }
+
+    /* also whatever precedes the first keyframe of a stream joined mid-GOP */
+    if (GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT))
+        return GST_PAD_PROBE_DROP;
+
+    /* only touched from the parser's streaming thread */
+    if (f->gops++ % f->interval)
+        return GST_PAD_PROBE_DROP;
+
+    __atomic_fetch_add (&f->passed, 1, __ATOMIC_RELAXED);
+    return GST_PAD_PROBE_OK;
+}
+
+/* Share of the access units that reach the decoder, 1 before any arrived. */
+static inline gdouble keyframe_filter_fraction (const KeyframeFilter *f)
+{
+    guint64 seen = __atomic_load_n (&f->seen, __ATOMIC_RELAXED);
+
+    if (seen == 0)
+        return 1.0;
+
+    return (gdouble) __atomic_load_n (&f->passed, __ATOMIC_RELAXED) / seen;
+}
+
+#endif
@@ -0,0 +1,544 @@
+/*
+ * Background system metrics sampler for deepstream_test_dynamic_switching.c.
+ *
+ * Header only, needs glib and gmodule:
+ * `pkg-config --cflags --libs glib-2.0 gmodule-2.0`
+ *
+ * One thread polls a list of providers every interval and folds what they
+ * report into exponentially weighted averages. The averages are published
+ * as a MetricsSnapshot under a sequence counter, so metrics_sampler_read()
+ * never blocks and never sees a half written snapshot; the pipeline code
+ * that decides between hardware and software decoding only ever reads.
+ *
+ * Providers:
+ *  - proc_stat: system wide CPU busy percent from /proc/stat
+ *  - proc_self: CPU percent of this process from /proc/self/stat, scaled to
+ *    all online CPUs so 100 means every core is busy, and its threads,
+ *    RSS from /proc/self/status and context switches per second of all its
+ *    threads from getrusage()
+ *  - nvml: NVDEC and GPU utilization through libnvidia-ml.so.1, opened at
+ *    run time so the sampler works on hosts without the driver
+ *  - fake: whatever metrics_fake_set() stored, to drive the decoder
+ *    selection without loading the machine
+ * Each provider fills only the metrics it knows about, a metric nobody
+ * provides stays at 0 and is flagged invalid in the snapshot.
+ * */
+
+#ifndef __METRICS_SAMPLER_H__
+#define __METRICS_SAMPLER_H__
+
+#include <glib.h>
+#include <gmodule.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define METRICS_INTERVAL_MS (500)
+/* weight of a new sample, 0.3 settles within about 3 s at 500 ms */
+#define METRICS_EWMA_ALPHA (0.3)
+
+typedef enum
+{
+    METRIC_CPU,
+    METRIC_PROCESS_CPU,
+    METRIC_NVDEC,
+    METRIC_GPU,
+    METRIC_THREADS,
+    METRIC_RSS_MB,
+    METRIC_CTX_SWITCHES,
+    METRIC_COUNT
+}MetricKind;
+
+typedef struct _MetricsSnapshot
+{
+    gdouble value[METRIC_COUNT];
+    gboolean valid[METRIC_COUNT];
+    /* monotonic us of the sample, 0 before the first one */
+    gint64 time;
+}MetricsSnapshot;
+
+typedef struct _MetricsProvider MetricsProvider;
+
+struct _MetricsProvider
+{
+    const gchar *name;
+    /* stores the metrics it measured into value[] and flags them in
+     * valid[], returns FALSE when the source is gone for good */
+    gboolean (*sample) (MetricsProvider *provider, gdouble *value, gboolean *valid);
+    void (*free) (MetricsProvider *provider);
+    gpointer priv;
+};
+
+typedef struct _MetricsSampler
+{
+    GThread *thread;
+    GMutex lock;
+    GCond cond;
+    gboolean stop;
+    guint interval_ms;
+    GPtrArray *providers;
+
+    /* odd while the sampler thread writes the snapshot */
+    guint seq;
+    MetricsSnapshot snapshot;
+}MetricsSampler;
+
+/* ---------------------------------------------------------------------- */
+/* /proc/stat */
+
+typedef struct _ProcStatPriv
+{
+    guint64 last_total;
+    guint64 last_idle;
+}ProcStatPriv;
+
+static gboolean proc_stat_sample (MetricsProvider *provider, gdouble *value, gboolean *valid)
+{
+    ProcStatPriv *priv = (ProcStatPriv *) provider->priv;
+    unsigned long long v[8] = { 0 };
+    guint64 total = 0, idle;
+    char line[256];
+    FILE *fp;
+    int i;
+
+    fp = fopen ("/proc/stat", "r");
+    if (!fp)
+        return FALSE;
+    if (!fgets (line, sizeof (line), fp) ||
+            sscanf (line, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+                &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) < 4)
+    {
+        fclose (fp);
+        return FALSE;
+    }
+    fclose (fp);
+
+    for (i = 0; i < 8; i++)
+        total += v[i];
+    /* idle + iowait */
+    idle = v[3] + v[4];
+
+    if (priv->last_total && total > priv->last_total)
+    {
+        value[METRIC_CPU] = 100.0 - (idle - priv->last_idle) * 100.0 / (total - priv->last_total);
+        valid[METRIC_CPU] = TRUE;
+    }
+    priv->last_total = total;
+    priv->last_idle = idle;
+
+    return TRUE;
+}
+
+static MetricsProvider *metrics_provider_proc_stat (void)
+{
+    MetricsProvider *provider = g_new0 (MetricsProvider, 1);
+
+    provider->name = "proc_stat";
+    provider->sample = proc_stat_sample;
+    provider->free = NULL;
+    provider->priv = g_new0 (ProcStatPriv, 1);
+
+    return provider;
+}
+
+/* ---------------------------------------------------------------------- */
+/* /proc/self/stat */
+
+typedef struct _ProcSelfPriv
+{
+    guint64 last_ticks;
+    guint64 last_ctx_switches;
+    gboolean have_ctx_switches;
+    gint64 last_time;
+    gdouble ticks_per_sec;
+    gint cpus;
+}ProcSelfPriv;
+
+/* Threads and VmRSS. The ctxt_switches lines of /proc/self/status only
+ * count the main thread, see proc_self_ctx_switches() for the process. */
+static gboolean proc_self_status (guint *threads, guint64 *rss_kb)
+{
+    unsigned long long n;
+    char line[256];
+    int found = 0;
+    FILE *fp;
+
+    fp = fopen ("/proc/self/status", "r");
+    if (!fp)
+        return FALSE;
+
+    while (fgets (line, sizeof (line), fp))
+    {
+        if (sscanf (line, "Threads: %llu", &n) == 1)
+            *threads = n, found++;
+        else if (sscanf (line, "VmRSS: %llu", &n) == 1)
+            *rss_kb = n, found++;
+    }
+    fclose (fp);
+
+    return found == 2;
+}
+
+/* Voluntary + involuntary context switches of every thread of the process,
+ * including the threads that already exited. */
+static gboolean proc_self_ctx_switches (guint64 *ctx_switches)
+{
+    struct rusage usage;
+
+    if (getrusage (RUSAGE_SELF, &usage) != 0)
+        return FALSE;
+
+    *ctx_switches = (guint64) usage.ru_nvcsw + (guint64) usage.ru_nivcsw;
+
+    return TRUE;
+}
+
+static gboolean proc_self_sample (MetricsProvider *provider, gdouble *value, gboolean *valid)
+{
+    ProcSelfPriv *priv = (ProcSelfPriv *) provider->priv;
+    guint64 rss_kb = 0, ctx_switches = 0;
+    unsigned long long utime, stime;
+    gboolean have_status, have_ctx_switches;
+    guint threads = 0;
+    gint64 now = g_get_monotonic_time ();
+    char line[1024];
+    char *p;
+    FILE *fp;
+
+    fp = fopen ("/proc/self/stat", "r");
+    if (!fp)
+        return FALSE;
+    p = fgets (line, sizeof (line), fp);
+    fclose (fp);
+    if (!p)
+        return FALSE;
+
+    /* the command name may contain spaces, fields are counted from the
+     * closing parenthesis: state is field 3, utime 14 and stime 15 */
+    p = strrchr (line, ')');
+    if (!p || sscanf (p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+        return FALSE;
+
+    have_status = proc_self_status (&threads, &rss_kb);
+    have_ctx_switches = proc_self_ctx_switches (&ctx_switches);
+    if (have_status)
+    {
+        value[METRIC_THREADS] = threads;
+        valid[METRIC_THREADS] = TRUE;
+        value[METRIC_RSS_MB] = rss_kb / 1024.0;
+        valid[METRIC_RSS_MB] = TRUE;
+    }
+
+    if (priv->last_time && now > priv->last_time)
+    {
+        gdouble busy = (utime + stime - priv->last_ticks) / priv->ticks_per_sec;
+        gdouble wall = (now - priv->last_time) / 1e6;
+
+        value[METRIC_PROCESS_CPU] = busy * 100.0 / (wall * priv->cpus);
+        valid[METRIC_PROCESS_CPU] = TRUE;
+        if (have_ctx_switches && priv->have_ctx_switches)
+        {
+            value[METRIC_CTX_SWITCHES] = (ctx_switches - priv->last_ctx_switches) / wall;
+            valid[METRIC_CTX_SWITCHES] = TRUE;
+        }
+    }
+    priv->last_ticks = utime + stime;
+    priv->last_time = now;
+    priv->last_ctx_switches = ctx_switches;
+    priv->have_ctx_switches = have_ctx_switches;
+
+    return TRUE;
+}
+
+static MetricsProvider *metrics_provider_proc_self (void)
+{
+    MetricsProvider *provider = g_new0 (MetricsProvider, 1);
+    ProcSelfPriv *priv = g_new0 (ProcSelfPriv, 1);
+
+    priv->ticks_per_sec = sysconf (_SC_CLK_TCK);
+    priv->cpus = MAX (1, (gint) sysconf (_SC_NPROCESSORS_ONLN));
+
+    provider->name = "proc_self";
+    provider->sample = proc_self_sample;
+    provider->free = NULL;
+    provider->priv = priv;
+
+    return provider;
+}
+
+/* ---------------------------------------------------------------------- */
+/* NVML, resolved at run time */
+
+typedef struct _NvmlUtilization
+{
+    unsigned int gpu;
+    unsigned int memory;
+}NvmlUtilization;
+
+typedef struct _NvmlPriv
+{
+    GModule *module;
+    void *device;
+    int (*shutdown) (void);
+    int (*decoder_utilization) (void *device, unsigned int *utilization, unsigned int *period_us);
+    int (*utilization_rates) (void *device, NvmlUtilization *utilization);
+}NvmlPriv;
+
+static gboolean nvml_sample (MetricsProvider *provider, gdouble *value, gboolean *valid)
+{
+    NvmlPriv *priv = (NvmlPriv *) provider->priv;
+    NvmlUtilization rates;
+    unsigned int util, period;
+
+    /* NVML_SUCCESS is 0 */
+    if (priv->decoder_utilization (priv->device, &util, &period) == 0)
+    {
+        value[METRIC_NVDEC] = util;
+        valid[METRIC_NVDEC] = TRUE;
+    }
+    if (priv->utilization_rates (priv->device, &rates) == 0)
+    {
+        value[METRIC_GPU] = rates.gpu;
+        valid[METRIC_GPU] = TRUE;
+    }
+
+    return TRUE;
+}
+
+static void nvml_free (MetricsProvider *provider)
+{
+    NvmlPriv *priv = (NvmlPriv *) provider->priv;
+
+    priv->shutdown ();
+    g_module_close (priv->module);
+}
+
+/* NULL when the driver library or the GPU is not there */
+static MetricsProvider *metrics_provider_nvml (guint gpu_id)
+{
+    MetricsProvider *provider;
+    int (*init) (void);
+    int (*get_handle) (unsigned int index, void **device);
+    NvmlPriv priv;
+
+    memset (&priv, 0, sizeof (priv));
+    priv.module = g_module_open ("libnvidia-ml.so.1", G_MODULE_BIND_LAZY);
+    if (!priv.module)
+        return NULL;
+
+    if (!g_module_symbol (priv.module, "nvmlInit_v2", (gpointer *) &init) ||
+            !g_module_symbol (priv.module, "nvmlShutdown", (gpointer *) &priv.shutdown) ||
+            !g_module_symbol (priv.module, "nvmlDeviceGetHandleByIndex_v2", (gpointer *) &get_handle) ||
+            !g_module_symbol (priv.module, "nvmlDeviceGetDecoderUtilization", (gpointer *) &priv.decoder_utilization) ||
+            !g_module_symbol (priv.module, "nvmlDeviceGetUtilizationRates", (gpointer *) &priv.utilization_rates))
+    {
+        g_module_close (priv.module);
+        return NULL;
+    }
+
+    if (init () != 0)
+    {
+        g_module_close (priv.module);
+        return NULL;
+    }
+    if (get_handle (gpu_id, &priv.device) != 0)
+    {
+        priv.shutdown ();
+        g_module_close (priv.module);
+        return NULL;
+    }
+
+    provider = g_new0 (MetricsProvider, 1);
+    provider->name = "nvml";
+    provider->sample = nvml_sample;
+    provider->free = nvml_free;
+    provider->priv = g_new (NvmlPriv, 1);
+    memcpy (provider->priv, &priv, sizeof (priv));
+
+    return provider;
+}
+
+/* ---------------------------------------------------------------------- */
+/* fake values for tests */
+
+static gdouble metrics_fake_value[METRIC_COUNT];
+static gboolean metrics_fake_valid[METRIC_COUNT];
+
+/* may be called from any thread, picked up at the next sample */
+static void metrics_fake_set (MetricKind kind, gdouble value)
+{
+    metrics_fake_value[kind] = value;
+    __atomic_store_n (&metrics_fake_valid[kind], TRUE, __ATOMIC_RELEASE);
+}
+
+static gboolean fake_sample (MetricsProvider *provider, gdouble *value, gboolean *valid)
+{
+    int i;
+
+    for (i = 0; i < METRIC_COUNT; i++)
+    {
+        if (__atomic_load_n (&metrics_fake_valid[i], __ATOMIC_ACQUIRE))
+        {
+            value[i] = metrics_fake_value[i];
+            valid[i] = TRUE;
+        }
+    }
+
+    return TRUE;
+}
+
+static MetricsProvider *metrics_provider_fake (void)
+{
+    MetricsProvider *provider = g_new0 (MetricsProvider, 1);
+
+    provider->name = "fake";
+    provider->sample = fake_sample;
+    provider->free = NULL;
+    provider->priv = NULL;
+
+    return provider;
+}
+
+/* ---------------------------------------------------------------------- */
+/* sampler */
+
+static void metrics_provider_free (gpointer data)
+{
+    MetricsProvider *provider = (MetricsProvider *) data;
+
+    if (provider->free)
+        provider->free (provider);
+    g_free (provider->priv);
+    g_free (provider);
+}
+
+static void metrics_sampler_publish (MetricsSampler *sampler, const gdouble *value, const gboolean *valid)
+{
+    MetricsSnapshot *s = &sampler->snapshot;
+    int i;
+
+    __atomic_fetch_add (&sampler->seq, 1, __ATOMIC_ACQ_REL);
+    for (i = 0; i < METRIC_COUNT; i++)
+    {
+        if (!valid[i])
+            continue;
+        s->value[i] = s->valid[i] ? s->value[i] + METRICS_EWMA_ALPHA * (value[i] - s->value[i]) : value[i];
+        s->valid[i] = TRUE;
+    }
+    s->time = g_get_monotonic_time ();
+    __atomic_fetch_add (&sampler->seq, 1, __ATOMIC_RELEASE);
+}
+
+static void metrics_sampler_sample (MetricsSampler *sampler)
+{
+    gdouble value[METRIC_COUNT] = { 0 };
+    gboolean valid[METRIC_COUNT] = { 0 };
+    guint i = 0;
+
+    while (i < sampler->providers->len)
+    {
+        MetricsProvider *provider = (MetricsProvider *) g_ptr_array_index (sampler->providers, i);
+
+        if (!provider->sample (provider, value, valid))
+        {
+            g_printerr ("metrics provider %s failed, dropping it\n", provider->name);
+            g_ptr_array_remove_index (sampler->providers, i);
+            continue;
+        }
+        i++;
+    }
+
+    metrics_sampler_publish (sampler, value, valid);
+}
+
+static gpointer metrics_sampler_thread (gpointer data)
+{
+    MetricsSampler *sampler = (MetricsSampler *) data;
+
+    g_mutex_lock (&sampler->lock);
+    while (!sampler->stop)
+    {
+        gint64 next = g_get_monotonic_time () + sampler->interval_ms * G_TIME_SPAN_MILLISECOND;
+
+        g_mutex_unlock (&sampler->lock);
+        metrics_sampler_sample (sampler);
+        g_mutex_lock (&sampler->lock);
+
+        while (!sampler->stop && g_cond_wait_until (&sampler->cond, &sampler->lock, next))
+            ;
+    }
+    g_mutex_unlock (&sampler->lock);
+
+    return NULL;
+}
+
+static MetricsSampler *metrics_sampler_new (guint interval_ms)
+{
+    MetricsSampler *sampler = g_new0 (MetricsSampler, 1);
+
+    g_mutex_init (&sampler->lock);
+    g_cond_init (&sampler->cond);
+    sampler->interval_ms = interval_ms;
+    sampler->providers = g_ptr_array_new_with_free_func (metrics_provider_free);
+
+    return sampler;
+}
+
+/* takes ownership, NULL is ignored so optional providers can be passed
+ * straight in; add all providers before metrics_sampler_start() */
+static void metrics_sampler_add (MetricsSampler *sampler, MetricsProvider *provider)
+{
+    if (provider)
+        g_ptr_array_add (sampler->providers, provider);
+}
+
+/* Takes the first sample synchronously, so readers have values right
+ * away, then keeps sampling in the background. */
+static void metrics_sampler_start (MetricsSampler *sampler)
+{
+    metrics_sampler_sample (sampler);
+    sampler->thread = g_thread_new ("metrics-sampler", metrics_sampler_thread, sampler);
+}
+
+static void metrics_sampler_read (MetricsSampler *sampler, MetricsSnapshot *snapshot)
+{
+    guint seq;
+
+    do
+    {
+        while ((seq = __atomic_load_n (&sampler->seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        memcpy (snapshot, &sampler->snapshot, sizeof (*snapshot));
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n (&sampler->seq, __ATOMIC_RELAXED) != seq);
+}
+
+/* 0 for a metric no provider reports */
+static gdouble metrics_sampler_get (MetricsSampler *sampler, MetricKind kind)
+{
+    MetricsSnapshot snapshot;
+
+    metrics_sampler_read (sampler, &snapshot);
+    return snapshot.valid[kind] ? snapshot.value[kind] : 0.0;
+}
+
+static void metrics_sampler_free (MetricsSampler *sampler)
+{
+    if (sampler->thread)
+    {
+        g_mutex_lock (&sampler->lock);
+        sampler->stop = TRUE;
+        g_cond_signal (&sampler->cond);
+        g_mutex_unlock (&sampler->lock);
+        g_thread_join (sampler->thread);
+    }
+
+    g_ptr_array_unref (sampler->providers);
+    g_mutex_clear (&sampler->lock);
+    g_cond_clear (&sampler->cond);
+    g_free (sampler);
+}
+
+#endif /* __METRICS_SAMPLER_H__ */
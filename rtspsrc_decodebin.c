@@ -1,29 +1,514 @@
+/*
+ * gcc rtspsrc_decodebin.c -o rtspsrc_decodebin `pkg-config --cflags --libs gstreamer-1.0 gmodule-2.0`
+ *
+ * ./rtspsrc_decodebin rtsp://127.0.0.1:8554/test [rtsp://... ...]
+ * ./rtspsrc_decodebin cameras.txt
+ *
+ * Any number of cameras share one pipeline, each with its own rtspsrc,
+ * decode chain and sink, given on the command line or one URL per line in a
+ * file. A single camera is shown with nveglglessink, more go to fakesink.
+ * The rtspsrcs are started STARTUP_STAGGER_MS apart so hundreds of
+ * cameras don't all connect at once. Every STATUS_INTERVAL_S the state,
+ * fps and latency of each camera are printed, followed by the process
+ * RSS per camera, threads and CPU.
+ *
+ * The decode chain is built when the first session of a camera reports
+ * its caps. With USE_DECODE_FAST_PATH the depayloader, parser and decoder
+ * decodebin plugged are remembered per stream caps, and any later camera
+ * with the same caps gets those elements created straight from the cached
+ * factories, no typefinding, autoplugging or registry lookups. Time from
+ * PLAYING, and from caps, to the first decoded frame is reported for both
+ * paths.
+ *
+ * Each camera is watched for errors and for stalls, no RTP for
+ * STALL_TIMEOUT_MS. Either way only the rtspsrc is torn down and rebuilt,
+ * with exponential backoff between attempts, while the decode chain and
+ * the sink keep running. An error from the decode chain also drops the
+ * chain so the next session builds a fresh one, an error from the sink
+ * disables the camera. Errors of elements already removed from the
+ * pipeline, such as an old rtspsrc shutting down, are ignored, and only
+ * errors no camera owns stop the process. The new rtspsrc is linked straight into the
+ * existing chain, so the depayloader, parser and decoder are reused as long as
+ * the stream caps match the ones cached from the first session, and a
+ * keyframe is requested so decoding resumes without waiting out the GOP.
+ * rtspsrc always does its own DESCRIBE, the cached caps are only there to
+ * tell when the camera came back with a different stream. EOS from a
+ * dying session is dropped in front of the decode chain so the sink never
+ * goes EOS.
+ *
+ * To try it, serve a stream with the gst-rtsp-server example
+ *   ./test-launch "( videotestsrc is-live=1 ! x264enc tune=zerolatency key-int-max=30 ! rtph264pay name=pay0 pt=96 )"
+ * then kill test-launch and start it again: the time from the drop to the
+ * first decoded frame is printed once the camera is back. test-launch
+ * does not share the media between clients, so a list with the same URL
+ * a hundred times behaves like a hundred cameras on separate mounts
+ *   for i in $(seq 100); do echo rtsp://127.0.0.1:8554/test; done > cameras.txt
+ * (use a small videotestsrc resolution, the server encodes every client).
+ *
+ * A line of the file may give a GOP interval after the URL,
+ *   rtsp://127.0.0.1:8554/test 2
+ * to decode only the keyframe of every second GOP of that camera, see
+ * keyframe_filter.h. The status line then shows the share of access units
+ * that reached the decoder.
+ *
+ * Latency is measured against the NTP capture time the camera puts in its
+ * RTCP sender reports, which rtspsrc attaches to every buffer as a
+ * reference timestamp (GStreamer 1.22 and newer). The histograms split it
+ * into capture to decodebin, network and jitterbuffer, and capture to
+ * sink, the whole glass to glass path minus the display. They only mean
+ * something when the camera and this host share a clock, e.g. the local
+ * test-launch above, and they start after the first sender report, a few
+ * seconds into the stream.
+ * */
+
 #include <gst/gst.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hdr_histogram.h"
+#include "metrics_sampler.h"
+#include "keyframe_filter.h"
+
+#define STALL_TIMEOUT_MS 2000
+#define WATCHDOG_INTERVAL_MS 250
+#define RECONNECT_MIN_BACKOFF_MS 100
+#define RECONNECT_MAX_BACKOFF_MS 10000
+
+/* Selects the low-latency profile below instead of rtspsrc's defaults */
+//#define USE_LOW_LATENCY_PROFILE
+#define LOW_LATENCY_JITTERBUFFER_MS 50
+/* how long UDP may stay silent before rtspsrc retries over TCP */
+#define LOW_LATENCY_UDP_TIMEOUT_US 1000000
+#define LOW_LATENCY_QUEUE_TIME_NS (100 * GST_MSECOND)
+#define LOW_LATENCY_QUEUE_BUFFERS 4
+#define STATUS_INTERVAL_S 5
+#define STARTUP_STAGGER_MS 20
+#define CAMERA_METRICS_INTERVAL_MS 1000
+
+/* Remembers the depayloader, parser and decoder decodebin plugged for a
+ * stream and builds exactly those for the next stream with the same caps,
+ * skipping typefinding and autoplugging. The first camera of each kind
+ * still goes through decodebin. */
+#define USE_DECODE_FAST_PATH
+
+/* GOP interval of keyframe-only decoding for cameras that don't give one,
+ * 0 decodes every frame */
+#define DEFAULT_KEYFRAME_INTERVAL 0
+
+/* seconds from the NTP epoch, 1900, to the unix one */
+#define NTP_UNIX_OFFSET_S G_GINT64_CONSTANT (2208988800)
+
+typedef struct _RtspProfile
+{
+    const gchar *name;
+    guint latency_ms;
+    gboolean drop_on_latency;
+    /* NULL, 0 keep the element defaults */
+    const gchar *protocols;
+    guint64 udp_timeout_us;
+    guint64 queue_time_ns;
+    guint queue_buffers;
+    gboolean decoder_low_latency;
+}RtspProfile;
+
+static const RtspProfile default_profile = { "default", 2000, FALSE, NULL, 0, 0, 0, FALSE };
+static const RtspProfile low_latency_profile = { "low-latency", LOW_LATENCY_JITTERBUFFER_MS, TRUE, "udp+tcp",
+    LOW_LATENCY_UDP_TIMEOUT_US, LOW_LATENCY_QUEUE_TIME_NS, LOW_LATENCY_QUEUE_BUFFERS, TRUE };
+
+typedef struct _CameraContext
+{
+    guint index;
+    gchar *url;
+    GstElement *pipeline;
+    GstElement *rtspsrc;
+    GstElement *sink;
+    const RtspProfile *profile;
+    /* what rtspsrc links to, decodebin or the first element of a cached
+     * chain, built for the first session and kept over reconnects */
+    GstElement *decode_head;
+    /* the elements of that chain directly in the pipeline, not owned */
+    GPtrArray *chain;
+    gboolean fast_path;
+    /* factories decodebin plugged, for the cache */
+    GPtrArray *plugged;
+    KeyframeFilter keyframes;
+
+    /* caps of the video stream of the first session, volatile RTP fields
+     * stripped */
+    GstCaps *stream_caps;
+    /* monotonic us, written on streaming threads */
+    gint64 last_rtp;
+    gint64 last_frame;
+    /* set from pad-added */
+    gboolean linked;
+
+    /* us from NTP capture time, recorded on streaming threads */
+    HdrHistogram net_latency;
+    HdrHistogram e2e_latency;
+    guint64 frames_no_ntp;
+    guint64 frames_early;
+    guint64 frames;
+    guint64 frames_reported;
+    /* monotonic us of the first session's caps and first frame */
+    gint64 caps_time;
+    gint64 first_frame;
+    gboolean startup_recorded;
+
+    /* reconnect state, main loop only */
+    gint64 connect_time;
+    gint64 drop_time;
+    guint attempts;
+    guint reconnects;
+    guint backoff_ms;
+    guint reconnect_id;
+    /* after an error of its sink, main loop only */
+    gboolean disabled;
+}CameraContext;
+
+static void camera_schedule_reconnect (CameraContext *cam, const gchar *reason);
+
+static GstCaps *ntp_caps = NULL;
+GPtrArray *cameras = NULL;
+guint cameras_started = 0;
+MetricsSampler *metrics = NULL;
+GMainLoop *loop = NULL;
+
+/* stream caps string -> GPtrArray of GstElementFactory, never changed once
+ * inserted */
+static GHashTable *chain_cache = NULL;
+static GMutex chain_cache_lock;
+/* us, [0] decodebin, [1] fast path */
+static HdrHistogram startup_time[2];
+static HdrHistogram caps_to_frame_time[2];
+
+/* Records now minus the NTP capture time of the buffer, FALSE when the
+ * buffer has none yet. */
+static gboolean record_capture_latency (GstBuffer *buf, HdrHistogram *h, guint64 *early)
+{
+    GstReferenceTimestampMeta *meta = gst_buffer_get_reference_timestamp_meta (buf, ntp_caps);
+    gint64 now_us, capture_us;
+
+    if (!meta)
+        return FALSE;
+
+    now_us = g_get_real_time () + NTP_UNIX_OFFSET_S * G_USEC_PER_SEC;
+    capture_us = meta->timestamp / GST_USECOND;
+    /* clocks not in sync */
+    if (capture_us > now_us)
+    {
+        __atomic_fetch_add (early, 1, __ATOMIC_RELAXED);
+        return TRUE;
+    }
+
+    hdr_record (h, now_us - capture_us);
+    return TRUE;
+}
+
+static void set_property_if_exists (gpointer object, const gchar *name, const gchar *value)
+{
+    if (g_object_class_find_property (G_OBJECT_GET_CLASS (object), name))
+        gst_util_set_object_arg (G_OBJECT (object), name, value);
+}
+
+/* The caps without the fields that change with every session. */
+static GstCaps *camera_stream_caps (GstCaps *caps)
+{
+    static const gchar *volatile_fields[] = { "ssrc", "clock-base", "seqnum-base", "npt-start", "npt-stop",
+        "play-speed", "play-scale", "onvif-mode", NULL };
+    GstCaps *copy = gst_caps_copy (caps);
+    guint i, j;
+
+    for (i = 0; i < gst_caps_get_size (copy); i++)
+    {
+        GstStructure *s = gst_caps_get_structure (copy, i);
+        for (j = 0; volatile_fields[j]; j++)
+            gst_structure_remove_field (s, volatile_fields[j]);
+    }
+
+    return copy;
+}
+
+/* Asks the camera for a keyframe, rtpbin turns this into an RTCP PLI. */
+static void camera_request_keyframe (CameraContext *cam)
+{
+    GstPad *sink_pad = gst_element_get_static_pad (cam->decode_head, "sink");
+    GstStructure *s = gst_structure_new ("GstForceKeyUnit", "all-headers", G_TYPE_BOOLEAN, TRUE, NULL);
+
+    gst_pad_push_event (sink_pad, gst_event_new_custom (GST_EVENT_CUSTOM_UPSTREAM, s));
+    gst_object_unref (sink_pad);
+}
+
+static GstPadProbeReturn
+decoder_src_pad_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    //g_print ("A buffer is output from decoder \n");
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+videosink_pad_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    CameraContext *cam = (CameraContext *) user_data;
+    gint64 now = g_get_monotonic_time ();
+
+    //g_print ("A buffer is received on nveglglessink pad \n");
+    __atomic_store_n (&cam->last_frame, now, __ATOMIC_RELAXED);
+    if (!__atomic_load_n (&cam->first_frame, __ATOMIC_RELAXED))
+        __atomic_store_n (&cam->first_frame, now, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&cam->frames, 1, __ATOMIC_RELAXED);
+    if (!record_capture_latency (GST_PAD_PROBE_INFO_BUFFER (info), &cam->e2e_latency, &cam->frames_early))
+        __atomic_fetch_add (&cam->frames_no_ntp, 1, __ATOMIC_RELAXED);
+    return GST_PAD_PROBE_OK;
+}
+
+/* In front of the decode chain: RTP arrival for the stall check, and the
+ * EOS of a session going down must not reach the sink. */
+static GstPadProbeReturn
+decode_sink_pad_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    CameraContext *cam = (CameraContext *) user_data;
+
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER)
+    {
+        __atomic_store_n (&cam->last_rtp, g_get_monotonic_time (), __ATOMIC_RELAXED);
+        record_capture_latency (GST_PAD_PROBE_INFO_BUFFER (info), &cam->net_latency, &cam->frames_early);
+        return GST_PAD_PROBE_OK;
+    }
+
+    if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_EOS)
+        return GST_PAD_PROBE_DROP;
+
+    return GST_PAD_PROBE_OK;
+}
+
+static void
+configure_decode_element (CameraContext *cam, GstElement *element)
+{
+  const gchar *name = GST_ELEMENT_NAME (element);
+
+  if ((g_strstr_len (name, -1, "h264parse") == name)  || (g_strstr_len (name, -1, "h265parse") == name))
+  {
+      g_print ("parser found\n");
+      g_object_set(element, "config-interval", -1, NULL);
+      if (cam->keyframes.interval)
+      {
+          GstPad *parser_src_pad = gst_element_get_static_pad (element, "src");
+          gst_pad_add_probe (parser_src_pad, GST_PAD_PROBE_TYPE_BUFFER, keyframe_filter_probe, &cam->keyframes, NULL);
+          gst_object_unref (parser_src_pad);
+      }
+  }
+
+  if (g_strstr_len (name, -1, "nvv4l2decoder") == name)
+  {
+      g_print ("nvv4l2decoder found\n");
+      GstPad *decoder_src_pad = gst_element_get_static_pad (element, "src");
+      gst_pad_add_probe(decoder_src_pad, GST_PAD_PROBE_TYPE_BUFFER, decoder_src_pad_probe, NULL, NULL);
+      gst_object_unref (decoder_src_pad);
+      /* output in decode order, no reordering delay (dGPU decoder only) */
+      if (cam->profile->decoder_low_latency)
+          set_property_if_exists (element, "low-latency-mode", "true");
+  }
+}
 
+/* Every element decodebin plugs, at any depth. */
+static void
+decodebin_element_added (GstBin * bin, GstBin * sub_bin, GstElement * element, gpointer user_data)
+{
+  CameraContext *cam = (CameraContext *) user_data;
+  GstElementFactory *factory = gst_element_get_factory (element);
+  const gchar *klass;
+
+  configure_decode_element (cam, element);
+
+  if (!factory || GST_IS_BIN (element))
+      return;
+
+  /* typefind, capsfilter and multiqueue are decodebin's own plumbing */
+  klass = gst_element_factory_get_metadata (factory, GST_ELEMENT_METADATA_KLASS);
+  if (strstr (klass, "Depayloader") || strstr (klass, "Parser") || strstr (klass, "Decoder"))
+      g_ptr_array_add (cam->plugged, gst_object_ref (factory));
+}
+
+static void decodebin_pad_added(GstElement *src, GstPad *new_pad, gpointer user_data)
+{
+    CameraContext *cam = (CameraContext *) user_data;
+    GstCaps *caps = gst_pad_query_caps (new_pad, NULL);
+    const GstStructure *str = gst_caps_get_structure (caps, 0);
+    const gchar *name = gst_structure_get_name (str);
+
+    if (!strncmp (name, "video", 5))
+    {
+        GstPad *sinkpad = gst_element_get_static_pad (cam->sink, "sink");
+
+        if (gst_pad_link(new_pad, sinkpad) != GST_PAD_LINK_OK)
+        {
+            g_print ("could not link decodebin src pad to videosink sink pad\n");
+        }
+        gst_object_unref (sinkpad);
+
+#ifdef USE_DECODE_FAST_PATH
+        /* the chain is complete, the next camera like this one can skip
+         * decodebin */
+        if (cam->plugged->len > 0)
+        {
+            gchar *key = gst_caps_to_string (cam->stream_caps);
+
+            g_mutex_lock (&chain_cache_lock);
+            if (!g_hash_table_contains (chain_cache, key))
+            {
+                GPtrArray *factories = g_ptr_array_new_with_free_func (gst_object_unref);
+                guint i;
+
+                for (i = 0; i < cam->plugged->len; i++)
+                    g_ptr_array_add (factories, gst_object_ref (g_ptr_array_index (cam->plugged, i)));
+                g_hash_table_insert (chain_cache, key, factories);
+                key = NULL;
+            }
+            g_mutex_unlock (&chain_cache_lock);
+            g_free (key);
+        }
+#endif
+    }
+    gst_caps_unref (caps);
+}
+
+static GstElement *decodebin_chain_new (CameraContext *cam)
+{
+    GstElement *decodebin;
+    gchar name[64];
+
+    g_snprintf (name, sizeof (name), "decodebin-%u", cam->index);
+    decodebin = gst_element_factory_make ("decodebin", name);
+    if (!decodebin)
+        return NULL;
+
+    /* the multiqueue inside decodebin */
+    if (cam->profile->queue_time_ns)
+        g_object_set (decodebin, "max-size-time", cam->profile->queue_time_ns,
+                "max-size-buffers", cam->profile->queue_buffers, NULL);
+
+    g_signal_connect (decodebin, "pad-added", G_CALLBACK (decodebin_pad_added), cam);
+    g_signal_connect (decodebin, "deep-element-added", G_CALLBACK (decodebin_element_added), cam);
+
+    gst_bin_add (GST_BIN (cam->pipeline), decodebin);
+    gst_element_sync_state_with_parent (decodebin);
+    g_ptr_array_add (cam->chain, decodebin);
+
+    return decodebin;
+}
+
+/* Instantiates the factories decodebin plugged for these caps before and
+ * links them to the sink, NULL if any of it fails. */
+static GstElement *cached_chain_new (CameraContext *cam, GPtrArray *factories)
+{
+    GstElement *elements[16];
+    guint i, n = MIN (factories->len, G_N_ELEMENTS (elements));
+
+    for (i = 0; i < n; i++)
+    {
+        elements[i] = gst_element_factory_create (g_ptr_array_index (factories, i), NULL);
+        if (!elements[i])
+            break;
+        configure_decode_element (cam, elements[i]);
+        gst_bin_add (GST_BIN (cam->pipeline), elements[i]);
+        if (i > 0 && !gst_element_link (elements[i - 1], elements[i]))
+        {
+            i++;
+            break;
+        }
+    }
+
+    if (i == n && gst_element_link (elements[n - 1], cam->sink))
+    {
+        /* downstream first, so nothing pushes into a stopped element */
+        while (i-- > 0)
+            gst_element_sync_state_with_parent (elements[i]);
+        for (i = 0; i < n; i++)
+            g_ptr_array_add (cam->chain, elements[i]);
+        return elements[0];
+    }
+
+    g_printerr ("camera %u: cached decode chain failed, using decodebin\n", cam->index);
+    while (i-- > 0)
+    {
+        if (elements[i])
+        {
+            gst_element_set_state (elements[i], GST_STATE_NULL);
+            gst_bin_remove (GST_BIN (cam->pipeline), elements[i]);
+        }
+    }
+    return NULL;
+}
+
+/* Builds the decode chain for the first session of a camera, from the
+ * cache when a camera with the same stream caps was decoded before. */
+static GstElement *decode_chain_new (CameraContext *cam)
+{
+    GstElement *head = NULL;
+    GstPad *head_pad;
+
+#ifdef USE_DECODE_FAST_PATH
+    gchar *key = gst_caps_to_string (cam->stream_caps);
+    GPtrArray *factories;
+
+    g_mutex_lock (&chain_cache_lock);
+    factories = g_hash_table_lookup (chain_cache, key);
+    g_mutex_unlock (&chain_cache_lock);
+    g_free (key);
+
+    if (factories)
+        head = cached_chain_new (cam, factories);
+    cam->fast_path = head != NULL;
+#endif
+
+    if (!head)
+        head = decodebin_chain_new (cam);
+    if (!head)
+        return NULL;
+
+    head_pad = gst_element_get_static_pad (head, "sink");
+    gst_pad_add_probe (head_pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+            decode_sink_pad_probe, cam, NULL);
+    gst_object_unref (head_pad);
+
+    return head;
+}
 
 // Function to handle "pad-added" signal
 static void rtspsrc_pad_added(GstElement *src, GstPad *new_pad, gpointer user_data)
 {
+    CameraContext *cam = (CameraContext *) user_data;
     //g_print ("RTSPSRC new pad added caps = %s\n\n\n", gst_caps_to_string (caps));
     GstCaps *caps = gst_pad_query_caps (new_pad, NULL);
     const GstStructure *str = gst_caps_get_structure (caps, 0);
     const gchar *name = gst_structure_get_name (str);
     const gchar* media = gst_structure_get_string (str, "media");
 
-    if (g_strrstr (name, "x-rtp") && !strcmp (media, "video"))
+    if (g_strrstr (name, "x-rtp") && media && !strcmp (media, "video"))
     {
+        GstCaps *stream_caps = camera_stream_caps (caps);
 
-        GstElement *decodebin = GST_ELEMENT(user_data);
+        if (!cam->stream_caps)
+            cam->stream_caps = gst_caps_ref (stream_caps);
+        else if (!gst_caps_is_equal (stream_caps, cam->stream_caps))
+            g_printerr ("camera %u: stream caps changed, the decode chain may not be able to follow\n", cam->index);
+        gst_caps_unref (stream_caps);
 
-        // Request a new pad from decodebin
-        GstPad *sink_pad = gst_element_get_static_pad(decodebin, "sink");
-        if (!sink_pad)
+        if (!cam->decode_head)
         {
-            g_printerr("Failed to get request pad from decodebin.\n");
-            return;
+            cam->caps_time = g_get_monotonic_time ();
+            cam->decode_head = decode_chain_new (cam);
+            if (!cam->decode_head)
+            {
+                g_printerr ("camera %u: could not build the decode chain\n", cam->index);
+                gst_caps_unref (caps);
+                return;
+            }
         }
 
-        // Link the new pad to the sink pad of decodebin
+        GstPad *sink_pad = gst_element_get_static_pad(cam->decode_head, "sink");
+
+        // Link the new pad to the sink pad of the decode chain
         if (gst_pad_link(new_pad, sink_pad) != GST_PAD_LINK_OK)
         {
             g_printerr("Failed to link pads.\n");
@@ -31,124 +516,580 @@ static void rtspsrc_pad_added(GstElement *src, GstPad *new_pad, gpointer user_da
         else
         {
             g_print("Pads linked successfully.\n");
+            cam->linked = TRUE;
+            if (cam->reconnects > 0)
+                camera_request_keyframe (cam);
         }
 
         // Unreference the sink pad
         gst_object_unref(sink_pad);
     }
+
+    gst_caps_unref (caps);
 }
 
-static void decodebin_pad_added(GstElement *src, GstPad *new_pad, gpointer user_data)
+static GstElement *camera_rtspsrc_new (CameraContext *cam)
 {
+    GstElement *rtspsrc = gst_element_factory_make ("rtspsrc", NULL);
 
-    GstCaps *caps = gst_pad_query_caps (new_pad, NULL);
-    const GstStructure *str = gst_caps_get_structure (caps, 0);
-    const gchar *name = gst_structure_get_name (str);
+    if (!rtspsrc)
+        return NULL;
 
-    if (!strncmp (name, "video", 5))
+    g_object_set (rtspsrc, "location", cam->url, "latency", cam->profile->latency_ms,
+            "drop-on-latency", cam->profile->drop_on_latency, NULL);
+    if (cam->profile->protocols)
+        gst_util_set_object_arg (G_OBJECT (rtspsrc), "protocols", cam->profile->protocols);
+    if (cam->profile->udp_timeout_us)
+        g_object_set (rtspsrc, "timeout", cam->profile->udp_timeout_us, NULL);
+    set_property_if_exists (rtspsrc, "add-reference-timestamp-meta", "true");
+    g_signal_connect (rtspsrc, "pad-added", G_CALLBACK (rtspsrc_pad_added), cam);
+
+    return rtspsrc;
+}
+
+/* Adds the rtspsrc, or replaces it. Nothing else in the pipeline changes
+ * state. */
+static gboolean camera_connect (CameraContext *cam)
+{
+    if (cam->disabled)
+        return TRUE;
+
+    if (cam->rtspsrc)
     {
-        GstElement *sink = GST_ELEMENT(user_data);
-        GstPad *sinkpad = gst_element_get_static_pad (sink, "sink");
+        gst_element_set_state (cam->rtspsrc, GST_STATE_NULL);
+        gst_bin_remove (GST_BIN (cam->pipeline), cam->rtspsrc);
+    }
 
-        if (gst_pad_link(new_pad, sinkpad) != GST_PAD_LINK_OK)
+    cam->rtspsrc = camera_rtspsrc_new (cam);
+    if (!cam->rtspsrc)
+    {
+        g_printerr ("camera %u: could not create rtspsrc\n", cam->index);
+        g_main_loop_quit (loop);
+        return FALSE;
+    }
+
+    cam->linked = FALSE;
+    cam->connect_time = g_get_monotonic_time ();
+    gst_bin_add (GST_BIN (cam->pipeline), cam->rtspsrc);
+    gst_element_sync_state_with_parent (cam->rtspsrc);
+
+    return TRUE;
+}
+
+static gboolean camera_reconnect (gpointer user_data)
+{
+    CameraContext *cam = (CameraContext *) user_data;
+
+    cam->reconnect_id = 0;
+    cam->attempts++;
+    camera_connect (cam);
+
+    return FALSE;
+}
+
+static gboolean start_next_camera (gpointer user_data)
+{
+    if (cameras_started == cameras->len)
+        return FALSE;
+
+    if (!camera_connect (g_ptr_array_index (cameras, cameras_started++)))
+        return FALSE;
+
+    return cameras_started < cameras->len;
+}
+
+static void camera_schedule_reconnect (CameraContext *cam, const gchar *reason)
+{
+    guint delay_ms;
+
+    if (cam->reconnect_id || cam->disabled)
+        return;
+
+    if (!cam->drop_time)
+    {
+        cam->drop_time = g_get_monotonic_time ();
+        cam->attempts = 0;
+        cam->reconnects++;
+    }
+
+    /* jittered, cameras dropped by the same server outage must not all
+     * come back in the same instant */
+    delay_ms = cam->backoff_ms + g_random_int_range (0, cam->backoff_ms / 2 + 1);
+    g_print ("camera %u: %s, reconnecting in %u ms\n", cam->index, reason, delay_ms);
+    cam->reconnect_id = g_timeout_add (delay_ms, camera_reconnect, cam);
+    cam->backoff_ms = MIN (cam->backoff_ms * 2, RECONNECT_MAX_BACKOFF_MS);
+}
+
+/* Removes the decode chain after an error left it in an unknown state,
+ * the next session builds a new one. The rtspsrc must be stopped. */
+static void camera_drop_decode_chain (CameraContext *cam)
+{
+    guint i;
+
+    for (i = 0; i < cam->chain->len; i++)
+    {
+        GstElement *element = g_ptr_array_index (cam->chain, i);
+
+        gst_element_set_state (element, GST_STATE_NULL);
+        gst_bin_remove (GST_BIN (cam->pipeline), element);
+    }
+    g_ptr_array_set_size (cam->chain, 0);
+    g_ptr_array_set_size (cam->plugged, 0);
+    cam->decode_head = NULL;
+}
+
+/* Takes the camera out of the pipeline for good, the rest keeps running. */
+static void camera_disable (CameraContext *cam, const gchar *reason)
+{
+    g_printerr ("camera %u: %s, disabled\n", cam->index, reason);
+    cam->disabled = TRUE;
+
+    if (cam->reconnect_id)
+    {
+        g_source_remove (cam->reconnect_id);
+        cam->reconnect_id = 0;
+    }
+    if (cam->rtspsrc)
+    {
+        gst_element_set_state (cam->rtspsrc, GST_STATE_NULL);
+        gst_bin_remove (GST_BIN (cam->pipeline), cam->rtspsrc);
+        cam->rtspsrc = NULL;
+    }
+    camera_drop_decode_chain (cam);
+    if (cam->sink)
+    {
+        gst_element_set_state (cam->sink, GST_STATE_NULL);
+        gst_bin_remove (GST_BIN (cam->pipeline), cam->sink);
+        cam->sink = NULL;
+    }
+}
+
+static void camera_watchdog (CameraContext *cam, gint64 now)
+{
+    gint64 last_rtp = __atomic_load_n (&cam->last_rtp, __ATOMIC_RELAXED);
+    gint64 last_frame = __atomic_load_n (&cam->last_frame, __ATOMIC_RELAXED);
+    gint64 first_frame = __atomic_load_n (&cam->first_frame, __ATOMIC_RELAXED);
+
+    /* not started yet, disabled or waiting for its backoff */
+    if (!cam->rtspsrc || cam->reconnect_id)
+        return;
+
+    /* PLAYING of the rtspsrc that delivered, and the first caps, to the
+     * first decoded frame */
+    if (first_frame && !cam->startup_recorded)
+    {
+        hdr_record (&startup_time[cam->fast_path], first_frame - cam->connect_time);
+        hdr_record (&caps_to_frame_time[cam->fast_path], first_frame - cam->caps_time);
+        g_print ("camera %u: first frame %.0f ms after PLAYING, %.0f ms after caps (%s)\n", cam->index,
+                (first_frame - cam->connect_time) / 1e3, (first_frame - cam->caps_time) / 1e3,
+                cam->fast_path ? "cached chain" : "decodebin");
+        cam->startup_recorded = TRUE;
+    }
+
+    if (cam->drop_time && last_frame > cam->drop_time)
+    {
+        g_print ("camera %u: back %.0f ms after the drop, %u attempt(s)\n", cam->index,
+                (last_frame - cam->drop_time) / 1e3, cam->attempts);
+        cam->drop_time = 0;
+        cam->backoff_ms = RECONNECT_MIN_BACKOFF_MS;
+    }
+
+    /* a fresh rtspsrc gets the full timeout for its handshake */
+    if (now - MAX (last_rtp, cam->connect_time) > STALL_TIMEOUT_MS * G_TIME_SPAN_MILLISECOND)
+        camera_schedule_reconnect (cam, cam->linked ? "no RTP" : "no stream");
+}
+
+static gboolean watchdog (gpointer user_data)
+{
+    gint64 now = g_get_monotonic_time ();
+    guint i;
+
+    for (i = 0; i < cameras->len; i++)
+        camera_watchdog (g_ptr_array_index (cameras, i), now);
+
+    return TRUE;
+}
+
+static const gchar *camera_state (CameraContext *cam)
+{
+    if (cam->disabled)
+        return "disabled";
+    if (!cam->rtspsrc)
+        return "waiting";
+    if (cam->reconnect_id)
+        return "backoff";
+    if (!cam->linked)
+        return "connecting";
+    if (cam->drop_time)
+        return "resuming";
+    return "streaming";
+}
+
+static void camera_report (CameraContext *cam, guint64 frames)
+{
+    g_print ("camera %u %-10s %5.1f fps, %u reconnects", cam->index, camera_state (cam),
+            (gdouble) frames / STATUS_INTERVAL_S, cam->reconnects);
+    if (cam->keyframes.interval)
+        g_print (", keyframes of every %u GOP, %.1f%% of AUs decoded", cam->keyframes.interval,
+                keyframe_filter_fraction (&cam->keyframes) * 100);
+
+    if (hdr_count (&cam->e2e_latency) == 0)
+    {
+        g_print (", no NTP capture time yet (%lu frames)\n",
+                (unsigned long) __atomic_load_n (&cam->frames_no_ntp, __ATOMIC_RELAXED));
+        return;
+    }
+
+    g_print (", capture to decodebin p50 %.1f p99 %.1f ms, capture to sink p50 %.1f p99 %.1f max %.1f ms",
+            hdr_percentile (&cam->net_latency, 50) / 1e3, hdr_percentile (&cam->net_latency, 99) / 1e3,
+            hdr_percentile (&cam->e2e_latency, 50) / 1e3, hdr_percentile (&cam->e2e_latency, 99) / 1e3,
+            hdr_max (&cam->e2e_latency) / 1e3);
+    if (cam->frames_early)
+        g_print (", %lu stamps ahead of the local clock", (unsigned long) cam->frames_early);
+    g_print ("\n");
+}
+
+static gboolean status_report (gpointer user_data)
+{
+    MetricsSnapshot m;
+    guint i, streaming = 0;
+    guint64 total = 0;
+
+    for (i = 0; i < cameras->len; i++)
+    {
+        CameraContext *cam = g_ptr_array_index (cameras, i);
+        guint64 frames = __atomic_load_n (&cam->frames, __ATOMIC_RELAXED);
+
+        camera_report (cam, frames - cam->frames_reported);
+        total += frames - cam->frames_reported;
+        cam->frames_reported = frames;
+        if (!strcmp (camera_state (cam), "streaming"))
+            streaming++;
+    }
+
+    metrics_sampler_read (metrics, &m);
+    g_print ("%u/%u cameras streaming, %.1f fps total, RSS %.0f MB (%.2f MB per camera), %.0f threads, process cpu %.0f%%\n",
+            streaming, cameras->len, (gdouble) total / STATUS_INTERVAL_S, m.value[METRIC_RSS_MB],
+            m.value[METRIC_RSS_MB] / cameras->len, m.value[METRIC_THREADS], m.value[METRIC_PROCESS_CPU]);
+
+    for (i = 0; i < 2; i++)
+    {
+        if (hdr_count (&startup_time[i]) == 0)
+            continue;
+        g_print ("%-12s %lu cameras, PLAYING to first frame p50 %.0f p99 %.0f ms, caps to first frame p50 %.0f p99 %.0f ms\n",
+                i ? "cached chain" : "decodebin", (unsigned long) hdr_count (&startup_time[i]),
+                hdr_percentile (&startup_time[i], 50) / 1e3, hdr_percentile (&startup_time[i], 99) / 1e3,
+                hdr_percentile (&caps_to_frame_time[i], 50) / 1e3, hdr_percentile (&caps_to_frame_time[i], 99) / 1e3);
+    }
+
+    return TRUE;
+}
+
+typedef enum
+{
+    CAMERA_PART_SOURCE,
+    CAMERA_PART_DECODE,
+    CAMERA_PART_SINK
+}CameraPart;
+
+/* The element directly in @pipeline that @src is or is inside of, NULL
+ * when @src is the pipeline itself or is no longer in it. Elements are
+ * only added and removed from the main loop, so the parents can't change
+ * under us. */
+static GstObject *pipeline_child (GstElement *pipeline, GstObject *src)
+{
+    GstObject *object = src;
+
+    while (GST_OBJECT_PARENT (object))
+    {
+        if (GST_OBJECT_PARENT (object) == GST_OBJECT (pipeline))
+            return object;
+        object = GST_OBJECT_PARENT (object);
+    }
+
+    return NULL;
+}
+
+static CameraContext *find_camera (GstObject *child, CameraPart *part)
+{
+    guint i, j;
+
+    for (i = 0; i < cameras->len; i++)
+    {
+        CameraContext *cam = g_ptr_array_index (cameras, i);
+
+        if (cam->rtspsrc && child == GST_OBJECT (cam->rtspsrc))
         {
-            g_print ("could not link decodebin src pad to videosink sink pad\n");
+            *part = CAMERA_PART_SOURCE;
+            return cam;
+        }
+        if (cam->sink && child == GST_OBJECT (cam->sink))
+        {
+            *part = CAMERA_PART_SINK;
+            return cam;
+        }
+        for (j = 0; j < cam->chain->len; j++)
+        {
+            if (child == g_ptr_array_index (cam->chain, j))
+            {
+                *part = CAMERA_PART_DECODE;
+                return cam;
+            }
         }
     }
+
+    return NULL;
 }
 
-static GstPadProbeReturn
-decoder_src_pad_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+static void camera_error (CameraContext *cam, CameraPart part, const gchar *reason)
 {
-    //g_print ("A buffer is output from decoder \n");
-    return GST_PAD_PROBE_OK;
+    switch (part)
+    {
+        case CAMERA_PART_SOURCE:
+            camera_schedule_reconnect (cam, reason);
+            break;
+        case CAMERA_PART_DECODE:
+            /* nothing may push into the chain while it goes away */
+            if (cam->rtspsrc)
+                gst_element_set_state (cam->rtspsrc, GST_STATE_NULL);
+            camera_drop_decode_chain (cam);
+            camera_schedule_reconnect (cam, reason);
+            break;
+        case CAMERA_PART_SINK:
+            camera_disable (cam, reason);
+            break;
+    }
 }
 
-static GstPadProbeReturn
-videosink_pad_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+static gboolean bus_call (GstBus * bus, GstMessage * msg, gpointer data)
 {
-    //g_print ("A buffer is received on nveglglessink pad \n");
-    return GST_PAD_PROBE_OK;
+    GstElement *pipeline = (GstElement *) data;
+    CameraContext *cam;
+    CameraPart part;
+    GstObject *child;
+
+    switch (GST_MESSAGE_TYPE (msg))
+    {
+        case GST_MESSAGE_ERROR:
+            {
+                gchar *debug;
+                GError *error;
+                gst_message_parse_error (msg, &error, &debug);
+                g_printerr ("ERROR from element %s: %s\n", GST_OBJECT_NAME (msg->src), error->message);
+                if (debug)
+                    g_printerr ("Error details: %s\n", debug);
+
+                /* a camera recovers on its own, only the rest is fatal */
+                child = pipeline_child (pipeline, msg->src);
+                if (!child && GST_MESSAGE_SRC (msg) != GST_OBJECT (pipeline))
+                    g_printerr ("%s is no longer in the pipeline, ignored\n", GST_OBJECT_NAME (msg->src));
+                else if (child && (cam = find_camera (child, &part)))
+                    camera_error (cam, part, error->message);
+                else
+                    g_main_loop_quit (loop);
+
+                g_free (debug);
+                g_error_free (error);
+                break;
+            }
+        case GST_MESSAGE_WARNING:
+            {
+                gchar *debug;
+                GError *error;
+                gst_message_parse_warning (msg, &error, &debug);
+                g_printerr ("WARNING from element %s: %s\n", GST_OBJECT_NAME (msg->src), error->message);
+                g_free (debug);
+                g_error_free (error);
+                break;
+            }
+        case GST_MESSAGE_EOS:
+            g_print ("End of stream\n");
+            g_main_loop_quit (loop);
+            break;
+        default:
+            break;
+    }
+
+    return TRUE;
 }
 
-static void
-decodebin_child_added (GstChildProxy * child_proxy, GObject * object,
-    gchar * name, gpointer user_data)
+/* The decode side of a camera, the rtspsrc is added by camera_connect. */
+static CameraContext *camera_new (GstElement *pipeline, guint index, const gchar *url, guint keyframe_interval,
+        const gchar *sink_factory)
 {
-  GstElement *decodebin = GST_ELEMENT(user_data);
-  if (g_strrstr (name, "decodebin") == name)
-  {
-    g_signal_connect (G_OBJECT (object), "child-added", G_CALLBACK (decodebin_child_added), user_data);
-  }
+    CameraContext *cam = g_new0 (CameraContext, 1);
+    gchar name[64];
 
-  if ((g_strstr_len (name, -1, "h264parse") == name)  || (g_strstr_len (name, -1, "h265parse") == name))
-  {
-      g_print ("parser found\n");
-      GstElement *parser = GST_ELEMENT(object);
-      g_object_set(parser, "config-interval", -1, NULL);
-  }
-  
-  if (g_strstr_len (name, -1, "nvv4l2decoder") == name)
-  {
-      g_print ("nvv4l2decoder found\n");
-      GstElement *decoder = GST_ELEMENT(object);
-      GstPad *decoder_src_pad = gst_element_get_static_pad (decoder, "src");
-      gst_pad_add_probe(decoder_src_pad, GST_PAD_PROBE_TYPE_BUFFER, decoder_src_pad_probe, NULL, NULL);
-  }
+    cam->index = index;
+    cam->url = g_strdup (url);
+    cam->pipeline = pipeline;
+    cam->backoff_ms = RECONNECT_MIN_BACKOFF_MS;
+#ifdef USE_LOW_LATENCY_PROFILE
+    cam->profile = &low_latency_profile;
+#else
+    cam->profile = &default_profile;
+#endif
+    hdr_init (&cam->net_latency);
+    hdr_init (&cam->e2e_latency);
+    keyframe_filter_init (&cam->keyframes, keyframe_interval);
+
+    cam->plugged = g_ptr_array_new_with_free_func (gst_object_unref);
+    cam->chain = g_ptr_array_new ();
+
+    g_snprintf (name, sizeof (name), "videosink-%u", index);
+    cam->sink = gst_element_factory_make (sink_factory, name);
+
+    if (!cam->sink)
+    {
+        g_printerr ("Not all elements could be created.\n");
+        return NULL;
+    }
+
+    GstPad *videosink_pad = gst_element_get_static_pad (cam->sink, "sink");
+    gst_pad_add_probe(videosink_pad, GST_PAD_PROBE_TYPE_BUFFER, videosink_pad_probe, cam, NULL);
+    gst_object_unref (videosink_pad);
+
+    /* no preroll, the cameras come up one by one while the pipeline plays */
+    g_object_set (cam->sink, "sync", 0, "async", FALSE, NULL);
+
+    gst_bin_add (GST_BIN (pipeline), cam->sink);
+
+    return cam;
+}
+
+static void camera_free (gpointer data)
+{
+    CameraContext *cam = (CameraContext *) data;
+
+    if (cam->stream_caps)
+        gst_caps_unref (cam->stream_caps);
+    g_ptr_array_unref (cam->plugged);
+    g_ptr_array_unref (cam->chain);
+    g_free (cam->url);
+    g_free (cam);
 }
 
+/* The URLs from the command line, or from a file with one per line. */
+static gchar **read_urls (int argc, char *argv[])
+{
+    GPtrArray *urls = g_ptr_array_new ();
+    gchar *contents = NULL;
+    int i;
+
+    if (argc == 2 && !strstr (argv[1], "://"))
+    {
+        gchar **lines;
+
+        if (!g_file_get_contents (argv[1], &contents, NULL, NULL))
+        {
+            g_printerr ("Could not read %s\n", argv[1]);
+            exit (-1);
+        }
+
+        lines = g_strsplit (contents, "\n", -1);
+        for (i = 0; lines[i]; i++)
+        {
+            g_strstrip (lines[i]);
+            if (lines[i][0] && lines[i][0] != '#')
+                g_ptr_array_add (urls, g_strdup (lines[i]));
+        }
+        g_strfreev (lines);
+        g_free (contents);
+    }
+    else
+    {
+        for (i = 1; i < argc; i++)
+            g_ptr_array_add (urls, g_strdup (argv[i]));
+    }
+
+    g_ptr_array_add (urls, NULL);
+    return (gchar **) g_ptr_array_free (urls, FALSE);
+}
 
 int main(int argc, char *argv[]) {
     gst_init(&argc, &argv);
 
-    if (argc != 2)
+    if (argc < 2)
     {
-        g_print ("Usage    ./application <URL>\n");
+        g_print ("Usage    ./application <URL> [URL ...] | <file with one URL per line>\n");
         exit (0);
     }
 
-    const char *url = argv[1];
-
-    GstElement *pipeline, *rtspsrc, *decodebin, *videosink;
-
-    pipeline = gst_pipeline_new("rtspsrc-decodebin-pipeline");
-    rtspsrc = gst_element_factory_make("rtspsrc", "rtspsrc");
-    decodebin = gst_element_factory_make("decodebin", "decodebin");
-    videosink = gst_element_factory_make("nveglglessink", "videosink");
+    gchar **urls = read_urls (argc, argv);
+    guint n = g_strv_length (urls), i;
 
+    if (n == 0)
+    {
+        g_printerr ("No URLs given.\n");
+        return -1;
+    }
 
-    GstPad *videosink_pad = gst_element_get_static_pad (videosink, "sink");
-    gst_pad_add_probe(videosink_pad, GST_PAD_PROBE_TYPE_BUFFER, videosink_pad_probe, NULL, NULL);
+    GstElement *pipeline;
+    GstBus *bus;
+    guint bus_watch_id;
 
-    g_object_set (videosink, "sync", 0, NULL);
+    loop = g_main_loop_new(NULL, FALSE);
+    pipeline = gst_pipeline_new("rtspsrc-decodebin-pipeline");
+    ntp_caps = gst_caps_new_empty_simple ("timestamp/x-ntp");
+    cameras = g_ptr_array_new_with_free_func (camera_free);
+    chain_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_ptr_array_unref);
+    for (i = 0; i < 2; i++)
+    {
+        hdr_init (&startup_time[i]);
+        hdr_init (&caps_to_frame_time[i]);
+    }
 
-    if (!pipeline || !rtspsrc || !decodebin || !videosink)
+    if (!pipeline)
     {
         g_printerr("Not all elements could be created.\n");
         return -1;
     }
 
-    gst_bin_add_many(GST_BIN(pipeline), rtspsrc, decodebin, videosink, NULL);
-
-    g_signal_connect(rtspsrc, "pad-added", G_CALLBACK(rtspsrc_pad_added), decodebin);
+    for (i = 0; i < n; i++)
+    {
+        /* "<url> [keyframe interval]" */
+        gchar **fields = g_strsplit_set (urls[i], " \t", 2);
+        guint keyframe_interval = DEFAULT_KEYFRAME_INTERVAL;
+        CameraContext *cam;
 
-    g_signal_connect(decodebin, "pad-added", G_CALLBACK(decodebin_pad_added), videosink);
+        if (fields[1])
+            keyframe_interval = strtoul (g_strstrip (fields[1]), NULL, 10);
+        cam = camera_new (pipeline, i, fields[0], keyframe_interval, n == 1 ? "nveglglessink" : "fakesink");
+        g_strfreev (fields);
+        if (!cam)
+            return -1;
+        g_ptr_array_add (cameras, cam);
+    }
+    g_strfreev (urls);
 
-    g_object_set(rtspsrc, "location", url, NULL);
+    metrics = metrics_sampler_new (CAMERA_METRICS_INTERVAL_MS);
+    metrics_sampler_add (metrics, metrics_provider_proc_self ());
+    metrics_sampler_start (metrics);
 
-    g_signal_connect (G_OBJECT (decodebin), "child-added", G_CALLBACK (decodebin_child_added), decodebin);
+    bus = gst_pipeline_get_bus (GST_PIPELINE (pipeline));
+    bus_watch_id = gst_bus_add_watch (bus, bus_call, pipeline);
+    gst_object_unref (bus);
 
     GST_DEBUG_BIN_TO_DOT_FILE_WITH_TS(GST_BIN(pipeline), GST_DEBUG_GRAPH_SHOW_ALL, "pipeline");
 
     gst_element_set_state(pipeline, GST_STATE_PLAYING);
 
-    GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+    g_print ("%u camera(s), %s profile\n", n, ((CameraContext *) g_ptr_array_index (cameras, 0))->profile->name);
+    start_next_camera (NULL);
+    if (n > 1)
+        g_timeout_add (STARTUP_STAGGER_MS, start_next_camera, NULL);
+    g_timeout_add (WATCHDOG_INTERVAL_MS, watchdog, NULL);
+    g_timeout_add_seconds (STATUS_INTERVAL_S, status_report, NULL);
     g_main_loop_run(loop);
 
     gst_element_set_state(pipeline, GST_STATE_NULL);
     gst_object_unref(pipeline);
+    g_source_remove (bus_watch_id);
     g_main_loop_unref(loop);
+    g_ptr_array_free (cameras, TRUE);
+    metrics_sampler_free (metrics);
+    gst_caps_unref (ntp_caps);
+    g_hash_table_destroy (chain_cache);
 
     return 0;
 }
-